@@ -4,7 +4,9 @@
 
 #define ACTIONS \
     {.name = {.data = "article.get_version", .length = 19}, .handler = &article_get_version},\
-    {.name = {.data = "example.hello_world", .length = 19}, .handler = &example_hello_world},
+    {.name = {.data = "example.hello_world", .length = 19}, .handler = &example_hello_world},\
+    {.name = {.data = "server.io_stats", .length = 15}, .handler = &server_io_stats},
 
 int article_get_version(const struct http_request *request, struct http_response *restrict response, struct resources *restrict resources, const union json *options);
 int example_hello_world(const struct http_request *request, struct http_response *restrict response, struct resources *restrict resources, const union json *options);
+int server_io_stats(const struct http_request *request, struct http_response *restrict response, struct resources *restrict resources, const union json *options);
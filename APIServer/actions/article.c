@@ -1,33 +1,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "../base.h"
 #include "../stream.h"
 #include "../format.h"
+#include "../json.h"
 #include "../server.h"
 #include "../storage.h"
 #include "../actions.h"
 
+#define VERSION_LENGTH_MAX (sizeof(unsigned) * 3) /* enough digits for any version */
+
 int article_get_version(const struct http_request *request, struct http_response *restrict response, struct resources *restrict resources, const union json *options)
 {
+	struct response_writer writer;
+	char buffer[sizeof("{\"version\": ") - 1 + VERSION_LENGTH_MAX + sizeof("}") - 1], *position;
+	struct string key = string("name");
+	struct file_info *file_info;
+	union json *name;
 	int status;
 
-	struct file_info *file_info = storage_get(&request->path);
+	// The article is named by the name option.
+	if (json_type(options) != OBJECT) return BadRequest;
+	name = dict_get(options->object, &key);
+	if (!name || (json_type(name) != STRING)) return BadRequest;
+
+	file_info = storage_get(&name->string_node);
+	if (!file_info) return NotFound;
 
-	char buffer[64], *position; // TODO change this
 	position = format_bytes(buffer, "{\"version\": ", sizeof("{\"version\": ") - 1);
 	position = format_uint(position, file_info->version, 10);
 	position = format_bytes(position, "}", sizeof("}") - 1);
 
-	response->code = OK;
-	if (!response_headers_send(&resources->stream, request, response, file_info->size))
-		return -1;
-
-	if (response->content_encoding) // if response body is required
-		status = response_entity_send(&resources->stream, response, buffer, position - buffer);
-
 	storage_release(file_info);
 
-	return status;
+	response->code = OK;
+	if (!response_writer_start(&writer, &resources->stream, request, response))
+		return -1;
+	if (status = response_writer_append(&writer, buffer, position - buffer))
+		return status;
+	return response_writer_end(&writer);
 }
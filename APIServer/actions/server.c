@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "../base.h"
+#include "../stream.h"
+#include "../json.h"
+#include "../server.h"
+#include "../actions.h"
+
+static const struct string types[REQUEST_TYPES] = {
+	[RequestStatic] = {"static", 6},
+	[RequestUpload] = {"upload", 6},
+	[RequestDynamic] = {"dynamic", 7},
+	[RequestOptions] = {"options", 7},
+	[RequestHTTP2] = {"http2", 5},
+};
+
+// Returns the I/O statistics collected for each request type since the server started. With TLS, also returns the handshake statistics.
+int server_io_stats(const struct http_request *request, struct http_response *restrict response, struct resources *restrict resources, const union json *options)
+{
+	struct stream_stats total[REQUEST_TYPES];
+	union json *result, *counters;
+	struct string key, *entity;
+	size_t type;
+
+	server_stats(total);
+
+	result = json_object();
+	for(type = 0; type < REQUEST_TYPES; ++type)
+	{
+		counters = json_object();
+		#define STATS_INSERT(name) \
+			key = string(#name); \
+			counters = json_object_insert(counters, &key, json_integer(total[type].name));
+		STREAM_STATS(STATS_INSERT)
+		#undef STATS_INSERT
+
+		result = json_object_insert(result, types + type, counters);
+	}
+
+#if defined(TLS)
+	// Session resumption effectiveness.
+	unsigned long handshakes, resumed;
+	tls_stats(&handshakes, &resumed);
+
+	counters = json_object();
+	key = string("handshakes");
+	counters = json_object_insert(counters, &key, json_integer(handshakes));
+	key = string("resumed");
+	counters = json_object_insert(counters, &key, json_integer(resumed));
+	key = string("resumed_ratio");
+	counters = json_object_insert(counters, &key, json_real(handshakes ? (double)resumed / handshakes : 0));
+
+	key = string("tls");
+	result = json_object_insert(result, &key, counters);
+#endif
+	if (!result) return ERROR_MEMORY;
+
+	entity = json_serialize(result);
+	json_free(result);
+	if (!entity) return ERROR_MEMORY;
+
+	response->code = OK;
+	if (!response_headers_send(&resources->stream, request, response, entity->length))
+	{
+		free(entity);
+		return -1;
+	}
+	response_entity_send(&resources->stream, response, entity->data, entity->length);
+	free(entity);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "base.h"
+
+// Alignment suitable for any type stored in the arena.
+#define ARENA_ALIGNMENT 16
+
+#define ARENA_BLOCK_SIZE 4096
+
+// Heap block header. Block data follows the header.
+union arena_block
+{
+	union arena_block *next;
+	char _align[ARENA_ALIGNMENT];
+};
+
+void arena_init(struct arena *restrict arena, void *buffer, size_t size)
+{
+	arena->position = buffer;
+	arena->end = arena->position + size;
+	arena->blocks = 0;
+}
+
+void *arena_alloc(struct arena *restrict arena, size_t size)
+{
+	char *result = (char *)(((uintptr_t)arena->position + (ARENA_ALIGNMENT - 1)) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+
+	if ((result > arena->end) || (size > (size_t)(arena->end - result)))
+	{
+		// Allocations bigger than half a block get a block of their own. This keeps the free space of the current block.
+		size_t block_size = ((size > ARENA_BLOCK_SIZE / 2) ? size : ARENA_BLOCK_SIZE);
+		union arena_block *block = malloc(sizeof(*block) + block_size);
+		if (!block) return 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+
+		result = (char *)(block + 1);
+		if (block_size == size) return result;
+		arena->end = result + block_size;
+	}
+
+	arena->position = result + size;
+	return result;
+}
+
+void *arena_dup(struct arena *restrict arena, const char *data, size_t length)
+{
+	char *result = arena_alloc(arena, length + 1);
+	if (!result) return 0;
+	memcpy(result, data, length);
+	result[length] = 0;
+	return result;
+}
+
+void arena_term(struct arena *restrict arena)
+{
+	while (arena->blocks)
+	{
+		union arena_block *block = arena->blocks;
+		arena->blocks = block->next;
+		free(block);
+	}
+}
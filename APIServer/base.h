@@ -68,22 +68,40 @@ struct string
 
 #define string_equal(s0, s1) (((s0)->length == (s1)->length) && !memcmp((s0)->data, (s1)->data, (s0)->length))
 
+/* Arena */
+
+// Memory allocated from an arena is not freed individually. arena_term() frees it all at once.
+// The arena starts with a buffer provided by the caller and allocates additional blocks from the heap when it is exhausted.
+struct arena
+{
+	char *position, *end;
+	union arena_block *blocks;
+};
+
+void arena_init(struct arena *restrict arena, void *buffer, size_t size);
+void *arena_alloc(struct arena *restrict arena, size_t size);
+void *arena_dup(struct arena *restrict arena, const char *data, size_t length); // adds terminating NUL
+void arena_term(struct arena *restrict arena);
+
 /* Vector */
 
 #include <stdbool.h>
 
+// If arena is set, vector memory is allocated from it.
 struct vector
 {
     void **data;
     size_t length, size;
+    struct arena *arena;
 };
 
 #define VECTOR_SIZE_BASE 4
 
 bool vector_init(struct vector *restrict v, size_t size);
+bool vector_init_arena(struct vector *restrict v, size_t size, struct arena *restrict arena);
 #define vector_get(vector, index) ((vector)->data[index])
 bool vector_add(struct vector *restrict v, void *value);
-#define vector_term(v) (free(((struct vector *)(v))->data))
+#define vector_term(v) ((((struct vector *)(v))->arena) ? (void)0 : free(((struct vector *)(v))->data))
 
 /* Dictionary */
 
@@ -99,6 +117,7 @@ struct dict
         struct dict_item *_next;
     } **items;
     size_t count, size;
+    struct arena *arena; // if set, memory is allocated from it and dict_term() frees nothing
 };
 
 struct dict_iterator
@@ -114,6 +133,7 @@ const struct dict_item *dict_next(struct dict_iterator *restrict it, const struc
 
 // WARNING: size must be a power of 2
 bool dict_init(struct dict *restrict dict, size_t size);
+bool dict_init_arena(struct dict *restrict dict, size_t size, struct arena *restrict arena);
 
 int dict_set(struct dict *restrict dict, const struct string *key, void *value, void **result);
 #define dict_add(dict, key, value) dict_set((dict), (key), (value), 0)
@@ -74,6 +74,18 @@ bool dict_init(struct dict *restrict dict, size_t size)
 	if (!dict->items) return false;
 	dict->count = 0;
 	dict->size = size;
+	dict->arena = 0;
+	return true;
+}
+
+bool dict_init_arena(struct dict *restrict dict, size_t size, struct arena *restrict arena)
+{
+	dict->items = arena_alloc(arena, sizeof(struct dict_item *) * size);
+	if (!dict->items) return false;
+	memset(dict->items, 0, sizeof(struct dict_item *) * size);
+	dict->count = 0;
+	dict->size = size;
+	dict->arena = arena;
 	return true;
 }
 
@@ -103,7 +115,9 @@ int dict_set(struct dict *restrict dict, const struct string *key, void *value,
 		char *key_data;
         void *value;
         struct dict_item *_next;
-	} *slot = malloc(sizeof(struct dict_item) + sizeof(char) * (key->length + 1));
+	} *slot;
+	size_t size = sizeof(struct dict_item) + sizeof(char) * (key->length + 1);
+	slot = (dict->arena ? arena_alloc(dict->arena, size) : malloc(size));
 	if (!slot) return ERROR_MEMORY;
 
 	// Initialize the allocated memory.
@@ -142,7 +156,7 @@ void *dict_remove(struct dict *restrict dict, const struct string *key)
 			// This is the item we are looking for
 			void *value = item->value;
 			*items = item->_next;
-			free(item);
+			if (!dict->arena) free(item);
 			dict->count -= 1;
 			return value;
 		}
@@ -156,6 +170,8 @@ void dict_term(struct dict *restrict dict)
 	struct dict_iterator it;
 	struct dict_item *prev = 0;
 
+	if (dict->arena) return; // the memory is freed with the arena
+
 	// Free each item in each slot of the dictionary
 	for(it.index = 0; it.index < dict->size; ++it.index)
 		if (dict->items[it.index])
@@ -180,6 +196,8 @@ void dict_term_custom(struct dict *restrict dict, void (*custom)(void *))
 	struct dict_iterator it;
 	struct dict_item *prev = 0;
 
+	if (dict->arena) return; // the memory is freed with the arena
+
 	// Free each item in each slot of the dictionary
 	for(it.index = 0; it.index < dict->size; ++it.index)
 		if (dict->items[it.index])
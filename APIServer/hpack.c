@@ -0,0 +1,410 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "base.h"
+#include "format.h"
+#include "hpack.h"
+
+#define HPACK_ENTRIES_MAX (sizeof(((struct hpack_table *)0)->entries) / sizeof(struct hpack_entry))
+
+// Every entry takes 32 bytes of the table size in addition to its name and value.
+#define HPACK_ENTRY_OVERHEAD 32
+
+#define INTEGER_LENGTH_MAX 6 /* prefix byte and enough continuation bytes for 32 bits */
+
+// TODO: string() can be used instead of string_static() with newer versions of gcc
+#define string_static(s) {(s), sizeof(s) - 1}
+#define ENTRY(name, value) {string_static(name), string_static(value)}
+static const struct hpack_entry table_static[] = {
+	ENTRY(":authority", ""),
+	ENTRY(":method", "GET"),
+	ENTRY(":method", "POST"),
+	ENTRY(":path", "/"),
+	ENTRY(":path", "/index.html"),
+	ENTRY(":scheme", "http"),
+	ENTRY(":scheme", "https"),
+	ENTRY(":status", "200"),
+	ENTRY(":status", "204"),
+	ENTRY(":status", "206"),
+	ENTRY(":status", "304"),
+	ENTRY(":status", "400"),
+	ENTRY(":status", "404"),
+	ENTRY(":status", "500"),
+	ENTRY("accept-charset", ""),
+	ENTRY("accept-encoding", "gzip, deflate"),
+	ENTRY("accept-language", ""),
+	ENTRY("accept-ranges", ""),
+	ENTRY("accept", ""),
+	ENTRY("access-control-allow-origin", ""),
+	ENTRY("age", ""),
+	ENTRY("allow", ""),
+	ENTRY("authorization", ""),
+	ENTRY("cache-control", ""),
+	ENTRY("content-disposition", ""),
+	ENTRY("content-encoding", ""),
+	ENTRY("content-language", ""),
+	ENTRY("content-length", ""),
+	ENTRY("content-location", ""),
+	ENTRY("content-range", ""),
+	ENTRY("content-type", ""),
+	ENTRY("cookie", ""),
+	ENTRY("date", ""),
+	ENTRY("etag", ""),
+	ENTRY("expect", ""),
+	ENTRY("expires", ""),
+	ENTRY("from", ""),
+	ENTRY("host", ""),
+	ENTRY("if-match", ""),
+	ENTRY("if-modified-since", ""),
+	ENTRY("if-none-match", ""),
+	ENTRY("if-range", ""),
+	ENTRY("if-unmodified-since", ""),
+	ENTRY("last-modified", ""),
+	ENTRY("link", ""),
+	ENTRY("location", ""),
+	ENTRY("max-forwards", ""),
+	ENTRY("proxy-authenticate", ""),
+	ENTRY("proxy-authorization", ""),
+	ENTRY("range", ""),
+	ENTRY("referer", ""),
+	ENTRY("refresh", ""),
+	ENTRY("retry-after", ""),
+	ENTRY("server", ""),
+	ENTRY("set-cookie", ""),
+	ENTRY("strict-transport-security", ""),
+	ENTRY("transfer-encoding", ""),
+	ENTRY("user-agent", ""),
+	ENTRY("vary", ""),
+	ENTRY("via", ""),
+	ENTRY("www-authenticate", ""),
+};
+#undef ENTRY
+#undef string_static
+
+#define TABLE_STATIC_COUNT (sizeof(table_static) / sizeof(*table_static))
+
+// The Huffman code of RFC 7541 appendix B is canonical: the codes of each length are consecutive and follow the symbol order.
+// Such a code is described by the number of codes of each length and by the symbols sorted by code.
+static const unsigned char huffman_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const unsigned short huffman_symbols[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104,
+	108, 109, 110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+	106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+	94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+	132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139,
+	140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+	171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+	221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22, 256
+};
+#define HUFFMAN_EOS 256
+
+void hpack_table_init(struct hpack_table *restrict table)
+{
+	table->first = 0;
+	table->count = 0;
+	table->size = 0;
+	table->size_max = HPACK_TABLE_SIZE;
+	table->update = false;
+}
+
+void hpack_table_term(struct hpack_table *restrict table)
+{
+	size_t index;
+	for(index = 0; index < table->count; ++index)
+		free(table->entries[(table->first + index) % HPACK_ENTRIES_MAX].name.data);
+	table->count = 0;
+	table->size = 0;
+}
+
+// Evicts the oldest entries until the table has space for an entry of the specified size.
+static void table_evict(struct hpack_table *restrict table, size_t size)
+{
+	struct hpack_entry *entry;
+	while (table->count && ((table->size + size) > table->size_max))
+	{
+		table->count -= 1;
+		entry = table->entries + (table->first + table->count) % HPACK_ENTRIES_MAX;
+		table->size -= entry->name.length + entry->value.length + HPACK_ENTRY_OVERHEAD;
+		free(entry->name.data);
+	}
+}
+
+static void table_size(struct hpack_table *restrict table, size_t size)
+{
+	table->size_max = size;
+	table_evict(table, 0);
+}
+
+void hpack_table_limit(struct hpack_table *restrict table, size_t size)
+{
+	// The encoder never uses a table bigger than the default.
+	if (size >= table->size_max) return;
+	table_size(table, size);
+	table->update = true;
+}
+
+// Adds an entry to the table. Entries bigger than the table only empty it (RFC 7541 section 4.4).
+static int table_add(struct hpack_table *restrict table, const struct string *name, const struct string *value)
+{
+	size_t size = name->length + value->length + HPACK_ENTRY_OVERHEAD;
+	struct hpack_entry *entry;
+	char *data;
+
+	table_evict(table, size);
+	if (size > table->size_max) return 0;
+
+	data = malloc(name->length + 1 + value->length + 1);
+	if (!data) return ERROR_MEMORY;
+
+	table->first = (table->first + HPACK_ENTRIES_MAX - 1) % HPACK_ENTRIES_MAX;
+	table->count += 1;
+	table->size += size;
+
+	entry = table->entries + table->first;
+	entry->name = string(data, name->length);
+	memcpy(entry->name.data, name->data, name->length);
+	entry->name.data[name->length] = 0;
+	entry->value = string(data + name->length + 1, value->length);
+	memcpy(entry->value.data, value->data, value->length);
+	entry->value.data[value->length] = 0;
+
+	return 0;
+}
+
+// Returns the entry with the specified index or 0 if there is no such entry. Indices start from 1 with the static table.
+static const struct hpack_entry *table_entry(const struct hpack_table *restrict table, size_t index)
+{
+	if (!index) return 0;
+	if (index <= TABLE_STATIC_COUNT) return table_static + index - 1;
+	index -= TABLE_STATIC_COUNT + 1;
+	if (index >= table->count) return 0;
+	return table->entries + (table->first + index) % HPACK_ENTRIES_MAX;
+}
+
+// Decodes an integer with the specified prefix length (RFC 7541 section 5.1).
+static int integer_decode(const unsigned char **restrict data, const unsigned char *end, unsigned prefix, size_t *restrict value)
+{
+	size_t mask = (1 << prefix) - 1;
+	unsigned shift = 0;
+	unsigned char byte;
+
+	*value = *(*data)++ & mask;
+	if (*value < mask) return 0;
+
+	do
+	{
+		if ((*data == end) || (shift > 28)) return ERROR_INPUT;
+		byte = *(*data)++;
+		*value += (size_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return 0;
+}
+
+// Decodes Huffman-coded data. Returns the length of the decoded string or -1 if the data is not valid.
+static ssize_t huffman_decode(const unsigned char *restrict data, size_t length, char *restrict output)
+{
+	const char *start = output;
+	unsigned code = 0, first = 0, index = 0, bits = 0; // current code, first code of the current length, index of its symbol
+	unsigned count;
+	size_t position;
+	int bit;
+
+	for(position = 0; position < length; ++position)
+		for(bit = 7; bit >= 0; --bit)
+		{
+			code |= (data[position] >> bit) & 1;
+			bits += 1;
+			count = huffman_count[bits];
+			if ((code - first) < count)
+			{
+				unsigned symbol = huffman_symbols[index + code - first];
+				if (symbol == HUFFMAN_EOS) return -1;
+				*output++ = symbol;
+				code = first = index = bits = 0;
+			}
+			else
+			{
+				if (bits == sizeof(huffman_count) - 1) return -1;
+				index += count;
+				first = (first + count) << 1;
+				code <<= 1;
+			}
+		}
+
+	// The padding is the most significant bits of EOS (all ones) and is shorter than 8 bits.
+	if ((bits > 7) || ((code >> 1) != (1u << bits) - 1)) return -1;
+
+	return output - start;
+}
+
+// Decodes a string literal (RFC 7541 section 5.2) and allocates it in the arena.
+static int string_decode(const unsigned char **restrict data, const unsigned char *end, struct arena *restrict arena, struct string *restrict result)
+{
+	bool huffman;
+	size_t length;
+	int status;
+
+	if (*data == end) return ERROR_INPUT;
+	huffman = (**data & 0x80);
+	if (status = integer_decode(data, end, 7, &length)) return status;
+	if (length > (size_t)(end - *data)) return ERROR_INPUT;
+
+	if (huffman)
+	{
+		// The shortest code has 5 bits.
+		result->data = arena_alloc(arena, length * 8 / 5 + 1);
+		if (!result->data) return ERROR_MEMORY;
+
+		ssize_t size = huffman_decode(*data, length, result->data);
+		if (size < 0) return ERROR_INPUT;
+		result->length = size;
+		result->data[size] = 0;
+	}
+	else
+	{
+		result->data = arena_dup(arena, (const char *)*data, length);
+		if (!result->data) return ERROR_MEMORY;
+		result->length = length;
+	}
+
+	*data += length;
+	return 0;
+}
+
+int hpack_decode(struct hpack_table *restrict table, const unsigned char *data, size_t length, struct arena *restrict arena, int (*field)(void *, struct string *, struct string *), void *argument)
+{
+	const unsigned char *end = data + length;
+	const struct hpack_entry *entry;
+	struct string name, value;
+	size_t index;
+	bool indexing;
+	int status;
+
+	while (data < end)
+	{
+		if (*data & 0x80) // indexed header field
+		{
+			if (status = integer_decode(&data, end, 7, &index)) return status;
+			if (!(entry = table_entry(table, index))) return ERROR_INPUT;
+
+			// Entries of the dynamic table may be evicted before the header field is used.
+			if (index > TABLE_STATIC_COUNT)
+			{
+				name = string(arena_dup(arena, entry->name.data, entry->name.length), entry->name.length);
+				value = string(arena_dup(arena, entry->value.data, entry->value.length), entry->value.length);
+				if (!name.data || !value.data) return ERROR_MEMORY;
+			}
+			else
+			{
+				name = entry->name;
+				value = entry->value;
+			}
+
+			if (status = field(argument, &name, &value)) return status;
+			continue;
+		}
+		else if ((*data & 0xe0) == 0x20) // dynamic table size update
+		{
+			if (status = integer_decode(&data, end, 5, &index)) return status;
+			if (index > HPACK_TABLE_SIZE) return ERROR_INPUT;
+			table_size(table, index);
+			continue;
+		}
+
+		// Literal header field. With incremental indexing, it is added to the dynamic table.
+		indexing = ((*data & 0xc0) == 0x40);
+		if (status = integer_decode(&data, end, (indexing ? 6 : 4), &index)) return status;
+		if (index)
+		{
+			if (!(entry = table_entry(table, index))) return ERROR_INPUT;
+			if (index > TABLE_STATIC_COUNT)
+			{
+				name = string(arena_dup(arena, entry->name.data, entry->name.length), entry->name.length);
+				if (!name.data) return ERROR_MEMORY;
+			}
+			else name = entry->name;
+		}
+		else if (status = string_decode(&data, end, arena, &name)) return status;
+		if (status = string_decode(&data, end, arena, &value)) return status;
+
+		if (indexing && (status = table_add(table, &name, &value))) return status;
+		if (status = field(argument, &name, &value)) return status;
+	}
+
+	return 0;
+}
+
+// Encodes an integer with the specified prefix length. flags are stored in the bits of the first byte before the prefix.
+static unsigned char *integer_encode(unsigned char *restrict position, unsigned char flags, unsigned prefix, size_t value)
+{
+	size_t mask = (1 << prefix) - 1;
+
+	if (value < mask)
+	{
+		*position++ = flags | value;
+		return position;
+	}
+
+	*position++ = flags | mask;
+	value -= mask;
+	while (value >= 0x80)
+	{
+		*position++ = 0x80 | (value & 0x7f);
+		value >>= 7;
+	}
+	*position++ = value;
+	return position;
+}
+
+// Encodes a string literal. Huffman coding is not used.
+static unsigned char *string_encode(unsigned char *restrict position, const unsigned char *end, const struct string *string)
+{
+	if ((size_t)(end - position) < INTEGER_LENGTH_MAX + string->length) return 0;
+	position = integer_encode(position, 0, 7, string->length);
+	return format_bytes(position, string->data, string->length);
+}
+
+unsigned char *hpack_encode_start(struct hpack_table *restrict table, unsigned char *restrict position, const unsigned char *end)
+{
+	if (table->update)
+	{
+		if ((end - position) < INTEGER_LENGTH_MAX) return 0;
+		position = integer_encode(position, 0x20, 5, table->size_max);
+		table->update = false;
+	}
+	return position;
+}
+
+unsigned char *hpack_encode(struct hpack_table *restrict table, unsigned char *restrict position, const unsigned char *end, const struct string *name, const struct string *value, bool index)
+{
+	const struct hpack_entry *entry;
+	size_t name_index = 0;
+	size_t i;
+
+	if ((end - position) < INTEGER_LENGTH_MAX) return 0;
+
+	// Look for the header field in the static table and in the dynamic table.
+	for(i = 1; i <= TABLE_STATIC_COUNT + table->count; ++i)
+	{
+		entry = table_entry(table, i);
+		if (!string_equal(&entry->name, name)) continue;
+		if (string_equal(&entry->value, value))
+			return integer_encode(position, 0x80, 7, i);
+		if (!name_index) name_index = i;
+	}
+
+	if (index) position = integer_encode(position, 0x40, 6, name_index);
+	else position = integer_encode(position, 0x00, 4, name_index);
+	if (!name_index && !(position = string_encode(position, end, name))) return 0;
+	if (!(position = string_encode(position, end, value))) return 0;
+
+	if (index && table_add(table, name, value)) return 0;
+	return position;
+}
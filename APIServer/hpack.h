@@ -0,0 +1,37 @@
+// HPACK header compression for HTTP/2 (RFC 7541).
+
+#define HPACK_TABLE_SIZE 4096 /* default dynamic table size */
+
+struct hpack_entry
+{
+	struct string name, value; // name.data points to memory that holds both strings
+};
+
+// Dynamic table. The entries are stored in a ring buffer starting with the newest entry.
+struct hpack_table
+{
+	struct hpack_entry entries[HPACK_TABLE_SIZE / 32]; // each entry takes at least 32 bytes of the table size
+	size_t first, count;
+	size_t size; // table size as defined by RFC 7541 section 4.1
+	size_t size_max; // maximum table size currently in effect
+	bool update; // whether the encoder must signal a change of the maximum table size
+};
+
+void hpack_table_init(struct hpack_table *restrict table);
+void hpack_table_term(struct hpack_table *restrict table);
+
+// Limits the size of the encoder table to the size the decoder on the other side allows.
+void hpack_table_limit(struct hpack_table *restrict table, size_t size);
+
+// Decodes a header block. Calls field(argument, name, value) for each header field.
+// The strings are allocated in the arena (or are static) and are NUL-terminated.
+// Returns ERROR_INPUT if the block is not valid. If field() returns an error, decoding stops and the error is returned.
+int hpack_decode(struct hpack_table *restrict table, const unsigned char *data, size_t length, struct arena *restrict arena, int (*field)(void *, struct string *, struct string *), void *argument);
+
+// Each function below appends to a header block and returns the end of the block or 0 if there is not enough space.
+
+// Starts a header block. Must be called before the first hpack_encode() for the block.
+unsigned char *hpack_encode_start(struct hpack_table *restrict table, unsigned char *restrict position, const unsigned char *end);
+
+// Adds a header field. Fields with values that change between responses should not be indexed.
+unsigned char *hpack_encode(struct hpack_table *restrict table, unsigned char *restrict position, const unsigned char *end, const struct string *name, const struct string *value, bool index);
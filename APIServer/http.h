@@ -26,6 +26,7 @@
 #define HTTP_DATE_LENGTH 29
 
 size_t url_decode(const char *src, char *restrict dest, size_t length);
+size_t url_decode_text(const char *src, char *restrict dest, size_t length);
 struct string *restrict uri_encode(const char *restrict source, size_t size);
 
 void http_date(char buffer[HTTP_DATE_LENGTH + 1], time_t timestamp);
@@ -0,0 +1,1105 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "format.h"
+#include "stream.h"
+#include "http.h"
+#include "http_parse.h"
+#include "http_response.h"
+#include "hpack.h"
+#include "http2.h"
+
+#define FRAME_HEADER_SIZE 9
+#define FRAME_SIZE 16384 /* maximum frame payload (SETTINGS_MAX_FRAME_SIZE of the server) */
+#define FRAME_SIZE_MAX 16777215
+
+#define WINDOW_SIZE 65535 /* initial flow control window of the server */
+#define WINDOW_MAX 0x7fffffff
+
+// Header blocks longer than this are not accepted.
+#define HEADER_BLOCK_MAX 65536
+
+// Response header fields are encoded in a single frame. The literals are not longer than the HTTP/1.1 header lines.
+#define RESPONSE_BLOCK_SIZE (HEADERS_LENGTH_MAX * 2)
+
+#define SETTINGS_LENGTH_MAX 256 /* maximum length of HTTP2-Settings */
+
+#define HTTP_CODE_LENGTH 3
+
+// The HTTP/1.1 parser reads the first part of the connection preface as a request with method PRI.
+static const struct string preface = {"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24}, preface_rest = {"SM\r\n\r\n", 6};
+
+static const struct string switching = {"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n", 71};
+
+enum {FrameData, FrameHeaders, FramePriority, FrameReset, FrameSettings, FramePushPromise, FramePing, FrameGoaway, FrameWindowUpdate, FrameContinuation};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+// Error codes sent with RST_STREAM and GOAWAY.
+enum {CodeNoError, CodeProtocol, CodeInternal, CodeFlowControl, CodeSettingsTimeout, CodeStreamClosed, CodeFrameSize, CodeRefused, CodeCancel, CodeCompression};
+
+struct http2
+{
+	struct stream *stream;
+	pthread_mutex_t lock; // protects the fields below and writing to the stream
+	pthread_cond_t changed; // signaled when flow control windows grow, when a stream is freed and when the connection is closed
+
+	struct http2_stream *streams[HTTP2_STREAMS_MAX]; // streams with a request that is being handled
+	unsigned alive; // streams that are not freed yet
+	long window; // how many bytes of data the client accepts on the connection
+	long window_initial; // initial window of each stream as set by the client
+	size_t frame_max; // maximum frame payload accepted by the client
+	struct hpack_table encoder;
+	bool closed; // whether nothing more can be sent
+
+	// Used only by the connection thread.
+	struct hpack_table decoder;
+	uint32_t last; // highest stream identifier used by the client
+	size_t received; // bytes of DATA frames for which no WINDOW_UPDATE is sent yet
+	int (*dispatch)(struct http2_stream *);
+};
+
+// State of header block decoding for a request.
+struct request_fields
+{
+	struct http_request *request;
+	int status;
+};
+
+static inline void uint32_store(unsigned char *restrict buffer, uint32_t value)
+{
+	buffer[0] = value >> 24;
+	buffer[1] = value >> 16;
+	buffer[2] = value >> 8;
+	buffer[3] = value;
+}
+
+static inline uint32_t uint32_load(const unsigned char *buffer)
+{
+	return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+// Writes a frame to the output buffer. The connection must be locked.
+static int frame_write(struct http2 *restrict connection, unsigned type, unsigned flags, uint32_t id, const void *payload, size_t length)
+{
+	unsigned char header[FRAME_HEADER_SIZE];
+	struct string buffer;
+	int status;
+
+	header[0] = length >> 16;
+	header[1] = length >> 8;
+	header[2] = length;
+	header[3] = type;
+	header[4] = flags;
+	uint32_store(header + 5, id);
+
+	buffer = string((char *)header, sizeof(header));
+	if (status = stream_write(connection->stream, &buffer)) goto error;
+	if (length)
+	{
+		buffer = string((char *)payload, length);
+		if (status = stream_write(connection->stream, &buffer)) goto error;
+	}
+	return 0;
+
+error:
+	connection->closed = true;
+	pthread_cond_broadcast(&connection->changed);
+	return status;
+}
+
+// Sends the buffered frames. The connection must be locked.
+static int frame_flush(struct http2 *restrict connection)
+{
+	int status = stream_write_flush(connection->stream);
+	if (status)
+	{
+		connection->closed = true;
+		pthread_cond_broadcast(&connection->changed);
+	}
+	return status;
+}
+
+// Sends a frame with a 32-bit payload (RST_STREAM or WINDOW_UPDATE).
+static int frame_send_uint32(struct http2 *restrict connection, unsigned type, uint32_t id, uint32_t value)
+{
+	unsigned char payload[4];
+	int status;
+
+	uint32_store(payload, value);
+
+	pthread_mutex_lock(&connection->lock);
+	if (connection->closed) status = ERROR_NETWORK;
+	else if (!(status = frame_write(connection, type, 0, id, payload, sizeof(payload))))
+		status = frame_flush(connection);
+	pthread_mutex_unlock(&connection->lock);
+
+	return status;
+}
+
+// Finds a stream with a request that is being handled. The connection must be locked.
+static struct http2_stream *stream_find(struct http2 *restrict connection, uint32_t id)
+{
+	size_t index;
+	for(index = 0; index < HTTP2_STREAMS_MAX; ++index)
+		if (connection->streams[index] && (connection->streams[index]->id == id))
+			return connection->streams[index];
+	return 0;
+}
+
+static struct http2_stream *stream_create(struct http2 *restrict connection, uint32_t id)
+{
+	struct http2_stream *stream = malloc(sizeof(*stream));
+	if (!stream) return 0;
+
+	stream->connection = connection;
+	stream->id = id;
+	stream->window = connection->window_initial;
+	stream->input = -1;
+	stream->body = -1;
+	stream->received = 0;
+	stream->links = 1;
+	stream->headers = false;
+	stream->end = false;
+	stream->reset = false;
+
+	http_parse_init(&stream->context);
+	stream->context.request.version[0] = 2;
+	stream->context.request.version[1] = 0;
+	stream->context.request.http2 = stream;
+
+	pthread_mutex_lock(&connection->lock);
+	connection->alive += 1;
+	pthread_mutex_unlock(&connection->lock);
+
+	return stream;
+}
+
+// The connection must be locked.
+static void stream_release(struct http2 *restrict connection, struct http2_stream *restrict stream)
+{
+	if (--stream->links) return;
+
+	if (stream->input >= 0) close(stream->input);
+	if (stream->body >= 0) close(stream->body);
+	http_parse_term(&stream->context);
+	free(stream);
+
+	connection->alive -= 1;
+	pthread_cond_broadcast(&connection->changed);
+}
+
+// Removes the stream from the streams with a request that is being handled. The connection must be locked.
+static void stream_remove(struct http2 *restrict connection, struct http2_stream *restrict stream)
+{
+	size_t index;
+	for(index = 0; index < HTTP2_STREAMS_MAX; ++index)
+		if (connection->streams[index] == stream)
+		{
+			connection->streams[index] = 0;
+			stream_release(connection, stream);
+			break;
+		}
+}
+
+// Starts handling the request of the stream. On error, the stream is released.
+static int stream_dispatch(struct http2 *restrict connection, struct http2_stream *restrict stream)
+{
+	size_t index;
+	int status;
+
+	pthread_mutex_lock(&connection->lock);
+	for(index = 0; index < HTTP2_STREAMS_MAX; ++index)
+		if (!connection->streams[index])
+		{
+			connection->streams[index] = stream;
+			stream->links += 1; // for the handler
+			break;
+		}
+	pthread_mutex_unlock(&connection->lock);
+
+	if (index == HTTP2_STREAMS_MAX)
+	{
+		frame_send_uint32(connection, FrameReset, stream->id, CodeRefused);
+		pthread_mutex_lock(&connection->lock);
+		stream_release(connection, stream);
+		pthread_mutex_unlock(&connection->lock);
+		return 0;
+	}
+
+	if (status = (*connection->dispatch)(stream))
+	{
+		frame_send_uint32(connection, FrameReset, stream->id, ((status == ERROR_AGAIN) ? CodeRefused : CodeInternal));
+		pthread_mutex_lock(&connection->lock);
+		stream->reset = true;
+		stream_remove(connection, stream);
+		stream_release(connection, stream);
+		pthread_mutex_unlock(&connection->lock);
+	}
+
+	return 0;
+}
+
+// Adds a decoded header field to the request. Decoding continues after an error to keep the dynamic table in sync.
+static int request_field(void *argument, struct string *name, struct string *value)
+{
+	static const struct string method = {":method", 7}, path = {":path", 5}, authority = {":authority", 10}, host = {"host", 4};
+
+	struct request_fields *fields = argument;
+	struct http_request *request = fields->request;
+
+	if (fields->status) return 0;
+
+	if (name->length && (name->data[0] == ':'))
+	{
+		if (string_equal(name, &method))
+		{
+			if (!(request->method = http_method(value))) fields->status = ERROR_UNSUPPORTED;
+		}
+		else if (string_equal(name, &path)) request->URI = *value;
+		else if (string_equal(name, &authority))
+		{
+			if (!http_header_add(request, &host, value)) fields->status = ERROR_INPUT;
+		}
+		// :scheme is not used
+	}
+	else if (!http_header_add(request, name, value)) fields->status = ERROR_INPUT;
+
+	return 0;
+}
+
+// Handles a complete header block. Returns the connection error code.
+static int headers_receive(struct http2 *restrict connection, uint32_t id, const unsigned char *block, size_t length, bool end)
+{
+	struct http2_stream *stream;
+	struct http_request *request;
+	struct request_fields fields;
+	int fds[2];
+	int code;
+
+	if (!(id & 1)) return CodeProtocol;
+
+	stream = stream_create(connection, id);
+	if (!stream) return CodeInternal;
+	request = &stream->context.request;
+
+	fields.request = request;
+	fields.status = 0;
+	if (hpack_decode(&connection->decoder, block, length, &stream->context.arena, &request_field, &fields))
+	{
+		pthread_mutex_lock(&connection->lock);
+		stream_release(connection, stream);
+		pthread_mutex_unlock(&connection->lock);
+		return CodeCompression;
+	}
+
+	if (id <= connection->last)
+	{
+		// A header block on a stream that is already used can only be trailer fields.
+		// They must end the request body of an open stream. Trailer fields are not used.
+		code = CodeProtocol;
+		pthread_mutex_lock(&connection->lock);
+		stream_release(connection, stream);
+		stream = stream_find(connection, id);
+		if (stream && !stream->reset && end && (stream->input >= 0))
+		{
+			close(stream->input);
+			stream->input = -1;
+			code = CodeNoError;
+		}
+		pthread_mutex_unlock(&connection->lock);
+		return code;
+	}
+	connection->last = id;
+
+	if (fields.status == ERROR_UNSUPPORTED)
+	{
+		http2_headers_send(stream, NotImplemented, 0, 0, true);
+		goto finally;
+	}
+	if (fields.status || !request->method || !request->URI.data)
+	{
+		frame_send_uint32(connection, FrameReset, id, CodeProtocol);
+		goto finally;
+	}
+	request->hostname = request->headers_known[HEADER_HOST];
+
+	// The handler reads the request body from a pipe.
+	// The connection thread never waits for the handler. The client sends no more than the stream window before the handler reads the data.
+	// A pipe holds 64 KiB which is more than the window.
+	if (!end)
+	{
+		if (pipe(fds))
+		{
+			frame_send_uint32(connection, FrameReset, id, CodeRefused);
+			goto finally;
+		}
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		stream->body = fds[0];
+		stream->input = fds[1];
+	}
+
+	return stream_dispatch(connection, stream);
+
+finally:
+	pthread_mutex_lock(&connection->lock);
+	stream_release(connection, stream);
+	pthread_mutex_unlock(&connection->lock);
+	return CodeNoError;
+}
+
+// Counts body data that the stream no longer holds. The client is allowed to send more data when enough data is counted.
+static void stream_consumed(struct http2 *restrict connection, struct http2_stream *restrict stream, size_t size)
+{
+	unsigned char payload[4];
+
+	pthread_mutex_lock(&connection->lock);
+	if (!stream->reset && !connection->closed && ((stream->received += size) >= WINDOW_SIZE / 2))
+	{
+		uint32_store(payload, stream->received);
+		if (!frame_write(connection, FrameWindowUpdate, 0, stream->id, payload, sizeof(payload)))
+			frame_flush(connection);
+		stream->received = 0;
+	}
+	pthread_mutex_unlock(&connection->lock);
+}
+
+// Called by the handler for the request body it reads from the pipe.
+static void body_consumed(void *argument, size_t size)
+{
+	struct http2_stream *stream = argument;
+	stream_consumed(stream->connection, stream, size);
+}
+
+// Passes request body data to the handler.
+static void data_receive(struct http2 *restrict connection, uint32_t id, const char *data, size_t length, size_t size, bool end)
+{
+	struct http2_stream *stream;
+	ssize_t written;
+
+	pthread_mutex_lock(&connection->lock);
+	stream = stream_find(connection, id);
+	if (stream) stream->links += 1;
+	pthread_mutex_unlock(&connection->lock);
+	if (!stream) return;
+
+	// Only the connection thread closes the input so it can be used without locking.
+	// The window for the data written to the pipe is updated when the handler reads it.
+	while (length && (stream->input >= 0))
+	{
+		written = write(stream->input, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+
+			// The pipe is full only if the client sends more than the window allows.
+			if (errno == EAGAIN)
+			{
+				frame_send_uint32(connection, FrameReset, id, CodeFlowControl);
+				pthread_mutex_lock(&connection->lock);
+				stream->reset = true;
+				stream_remove(connection, stream);
+				pthread_mutex_unlock(&connection->lock);
+			}
+
+			// The handler no longer reads the body.
+			close(stream->input);
+			stream->input = -1;
+			break;
+		}
+		data += written;
+		length -= written;
+		size -= written;
+	}
+
+	if (end && (stream->input >= 0))
+	{
+		close(stream->input);
+		stream->input = -1;
+	}
+	else if (stream->input >= 0) stream_consumed(connection, stream, size); // padding
+
+	pthread_mutex_lock(&connection->lock);
+	stream_release(connection, stream);
+	pthread_mutex_unlock(&connection->lock);
+}
+
+int http2_stream_body(struct http2_stream *restrict stream, struct stream *restrict body)
+{
+	int status = stream_init(body, stream->body);
+	if (!status) stream_read_notify(body, &body_consumed, stream);
+	return status;
+}
+
+// Applies the settings of the client. Returns the connection error code.
+static int settings_apply(struct http2 *restrict connection, const unsigned char *data, size_t length)
+{
+	unsigned id;
+	uint32_t value;
+	size_t index;
+	long delta;
+	int code = CodeNoError;
+
+	if (length % 6) return CodeFrameSize;
+
+	pthread_mutex_lock(&connection->lock);
+	for(; length && !code; data += 6, length -= 6)
+	{
+		id = (data[0] << 8) | data[1];
+		value = uint32_load(data + 2);
+		switch (id)
+		{
+		case SETTINGS_HEADER_TABLE_SIZE:
+			hpack_table_limit(&connection->encoder, value);
+			break;
+
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > WINDOW_MAX)
+			{
+				code = CodeFlowControl;
+				break;
+			}
+
+			// The change applies to the streams that are already open.
+			delta = (long)value - connection->window_initial;
+			connection->window_initial = value;
+			for(index = 0; index < HTTP2_STREAMS_MAX; ++index)
+				if (connection->streams[index])
+					connection->streams[index]->window += delta;
+			pthread_cond_broadcast(&connection->changed);
+			break;
+
+		case SETTINGS_MAX_FRAME_SIZE:
+			if ((value < FRAME_SIZE) || (value > FRAME_SIZE_MAX)) code = CodeProtocol;
+			else connection->frame_max = value;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&connection->lock);
+
+	return code;
+}
+
+// Decodes base64url data without padding (RFC 4648 section 5). Returns the decoded length or -1 if the data is not valid.
+static ssize_t base64url_decode(const struct string *restrict data, unsigned char *restrict output)
+{
+	unsigned char *start = output;
+	uint32_t block = 0;
+	unsigned bits = 0;
+	size_t index;
+	int value;
+
+	for(index = 0; index < data->length; ++index)
+	{
+		char c = data->data[index];
+		if (('A' <= c) && (c <= 'Z')) value = c - 'A';
+		else if (('a' <= c) && (c <= 'z')) value = c - 'a' + 26;
+		else if (('0' <= c) && (c <= '9')) value = c - '0' + 52;
+		else if (c == '-') value = 62;
+		else if (c == '_') value = 63;
+		else if (c == '=') break;
+		else return -1;
+
+		block = (block << 6) | value;
+		bits += 6;
+		if (bits >= 8)
+		{
+			bits -= 8;
+			*output++ = block >> bits;
+		}
+	}
+
+	return output - start;
+}
+
+// Returns whether the header field is specific to HTTP/1.1 connections. Such fields are not allowed in HTTP/2.
+static bool header_connection(const struct string *name)
+{
+	static const struct string fields[] = {{"connection", 10}, {"keep-alive", 10}, {"transfer-encoding", 17}, {"upgrade", 7}};
+	size_t index;
+	for(index = 0; index < sizeof(fields) / sizeof(*fields); ++index)
+		if (string_equal(name, fields + index))
+			return true;
+	return false;
+}
+
+// Handles the request that upgraded the connection as stream 1.
+static struct http2_stream *upgrade_request(struct http2 *restrict connection, const struct http_request *request)
+{
+	static const struct string settings = {"http2-settings", 14};
+
+	struct http2_stream *stream = stream_create(connection, 1);
+	struct request_fields fields;
+	struct string name, value;
+	size_t index;
+
+	if (!stream) return 0;
+
+	fields.request = &stream->context.request;
+	fields.status = 0;
+
+	fields.request->method = request->method;
+	fields.request->URI = string(arena_dup(&stream->context.arena, request->URI.data, request->URI.length), request->URI.length);
+	if (!fields.request->URI.data) goto error;
+
+	// The data of the original request is released when the connection switches to HTTP/2.
+	for(index = 0; index < request->headers_count; ++index)
+	{
+		const struct http_header *header = request->headers + index;
+
+		// Connection-specific header fields are not used in HTTP/2.
+		if (header_connection(&header->name) || string_equal(&header->name, &settings)) continue;
+
+		name = string(arena_dup(&stream->context.arena, header->name.data, header->name.length), header->name.length);
+		value = string(arena_dup(&stream->context.arena, header->value.data, header->value.length), header->value.length);
+		if (!name.data || !value.data) goto error;
+		request_field(&fields, &name, &value);
+	}
+	if (fields.status) goto error;
+	fields.request->hostname = fields.request->headers_known[HEADER_HOST];
+
+	connection->last = 1;
+	return stream;
+
+error:
+	pthread_mutex_lock(&connection->lock);
+	stream_release(connection, stream);
+	pthread_mutex_unlock(&connection->lock);
+	return 0;
+}
+
+bool http2_start(const struct http_request *request)
+{
+	static const struct string h2c = {"h2c", 3};
+
+	if (request->method == METHOD_PRI) return (request->version[0] == 2);
+
+	// Only requests without body can upgrade the connection.
+	const struct string *upgrade = request->headers_known[HEADER_UPGRADE];
+	const struct string *length = request->headers_known[HEADER_CONTENT_LENGTH];
+	if (!upgrade || (upgrade->length != h2c.length) || strncasecmp(upgrade->data, h2c.data, h2c.length)) return false;
+	if (!request->headers_known[HEADER_HTTP2_SETTINGS] || request->headers_known[HEADER_TRANSFER_ENCODING]) return false;
+	return (!length || ((length->length == 1) && (length->data[0] == '0')));
+}
+
+int http2_serve(struct stream *restrict stream, struct http_context *restrict context, int (*dispatch)(struct http2_stream *))
+{
+	struct http2 connection;
+	struct http2_stream *upgrade = 0;
+	const struct string *expected;
+	struct string buffer;
+
+	unsigned char *block = 0; // header block being received with CONTINUATION frames
+	size_t block_length = 0;
+	uint32_t block_id = 0;
+	bool block_end = false;
+
+	const unsigned char *payload;
+	size_t length, size;
+	unsigned type, flags;
+	uint32_t id;
+
+	bool goaway = false; // whether the client is closing the connection
+	int code = CodeNoError; // error code sent with GOAWAY
+	int status = 0;
+
+	connection.stream = stream;
+	pthread_mutex_init(&connection.lock, 0);
+	pthread_cond_init(&connection.changed, 0);
+	memset(connection.streams, 0, sizeof(connection.streams));
+	connection.alive = 0;
+	connection.window = WINDOW_SIZE;
+	connection.window_initial = WINDOW_SIZE;
+	connection.frame_max = FRAME_SIZE;
+	hpack_table_init(&connection.encoder);
+	connection.closed = false;
+	hpack_table_init(&connection.decoder);
+	connection.last = 0;
+	connection.received = 0;
+	connection.dispatch = dispatch;
+
+	if (context->request.method == METHOD_PRI) expected = &preface_rest;
+	else
+	{
+		// The client requested an upgrade. Switch protocols and handle the request as stream 1.
+		unsigned char settings[SETTINGS_LENGTH_MAX];
+		const struct string *value = context->request.headers_known[HEADER_HTTP2_SETTINGS];
+		ssize_t settings_length;
+
+		if ((status = stream_write(stream, &switching)) || (status = stream_write_flush(stream))) goto finally;
+
+		// HTTP2-Settings contains the payload of a SETTINGS frame.
+		if ((value->length > SETTINGS_LENGTH_MAX) || ((settings_length = base64url_decode(value, settings)) < 0)) code = CodeProtocol;
+		else code = settings_apply(&connection, settings, settings_length);
+		if (code) goto finally;
+
+		upgrade = upgrade_request(&connection, &context->request);
+		if (!upgrade)
+		{
+			code = CodeInternal;
+			goto finally;
+		}
+
+		expected = &preface;
+	}
+
+	// The HTTP/1.1 request is no longer needed.
+	http_parse_term(context);
+	stream_read_unpin(stream);
+	context = 0;
+
+	// The server connection preface is a SETTINGS frame.
+	{
+		unsigned char settings[6];
+		settings[0] = 0;
+		settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+		uint32_store(settings + 2, HTTP2_STREAMS_MAX);
+
+		pthread_mutex_lock(&connection.lock);
+		if (!(status = frame_write(&connection, FrameSettings, 0, 0, settings, sizeof(settings))))
+			status = frame_flush(&connection);
+		pthread_mutex_unlock(&connection.lock);
+		if (status) goto finally;
+	}
+
+	if (status = stream_read(stream, &buffer, expected->length)) goto finally;
+	if (memcmp(buffer.data, expected->data, expected->length))
+	{
+		code = CodeProtocol;
+		goto finally;
+	}
+	stream_read_flush(stream, expected->length);
+
+	if (upgrade)
+	{
+		stream_dispatch(&connection, upgrade);
+		upgrade = 0;
+	}
+
+	while (1)
+	{
+		status = stream_read(stream, &buffer, FRAME_HEADER_SIZE);
+		if (status == ERROR_AGAIN)
+		{
+			// Close the connection if it is idle.
+			pthread_mutex_lock(&connection.lock);
+			status = (connection.alive ? 0 : ERROR_AGAIN);
+			pthread_mutex_unlock(&connection.lock);
+			if (status) goto finally;
+			continue;
+		}
+		else if (status) goto finally;
+
+		payload = (const unsigned char *)buffer.data;
+		length = (payload[0] << 16) | (payload[1] << 8) | payload[2];
+		type = payload[3];
+		flags = payload[4];
+		id = uint32_load(payload + 5) & WINDOW_MAX;
+
+		if (length > FRAME_SIZE)
+		{
+			code = CodeFrameSize;
+			goto finally;
+		}
+		if (status = stream_read(stream, &buffer, FRAME_HEADER_SIZE + length)) goto finally;
+		payload = (const unsigned char *)buffer.data + FRAME_HEADER_SIZE;
+
+		// A header block is sent as contiguous frames.
+		if (block && ((type != FrameContinuation) || (id != block_id)))
+		{
+			code = CodeProtocol;
+			goto finally;
+		}
+
+		// Remove padding.
+		size = length;
+		if (((type == FrameData) || (type == FrameHeaders)) && (flags & FLAG_PADDED))
+		{
+			if (!length || (payload[0] >= length))
+			{
+				code = CodeProtocol;
+				goto finally;
+			}
+			size -= 1 + payload[0];
+			payload += 1;
+		}
+
+		switch (type)
+		{
+		case FrameData:
+			if (!id)
+			{
+				code = CodeProtocol;
+				goto finally;
+			}
+
+			data_receive(&connection, id, (const char *)payload, size, length, flags & FLAG_END_STREAM);
+
+			// Data for closed streams is still counted for the connection.
+			if ((connection.received += length) >= WINDOW_SIZE / 2)
+			{
+				frame_send_uint32(&connection, FrameWindowUpdate, 0, connection.received);
+				connection.received = 0;
+			}
+			break;
+
+		case FrameHeaders:
+			if (!id)
+			{
+				code = CodeProtocol;
+				goto finally;
+			}
+
+			// Stream priority is not used.
+			if (flags & FLAG_PRIORITY)
+			{
+				if (size < 5)
+				{
+					code = CodeFrameSize;
+					goto finally;
+				}
+				payload += 5;
+				size -= 5;
+			}
+
+			if (flags & FLAG_END_HEADERS)
+			{
+				code = headers_receive(&connection, id, payload, size, flags & FLAG_END_STREAM);
+				break;
+			}
+
+			block = malloc(size);
+			if (!block)
+			{
+				code = CodeInternal;
+				goto finally;
+			}
+			memcpy(block, payload, size);
+			block_length = size;
+			block_id = id;
+			block_end = (flags & FLAG_END_STREAM);
+			break;
+
+		case FrameContinuation:
+			if (!block || ((block_length + size) > HEADER_BLOCK_MAX))
+			{
+				code = CodeProtocol;
+				goto finally;
+			}
+			{
+				unsigned char *buffer = realloc(block, block_length + size);
+				if (!buffer)
+				{
+					code = CodeInternal;
+					goto finally;
+				}
+				block = buffer;
+			}
+			memcpy(block + block_length, payload, size);
+			block_length += size;
+
+			if (flags & FLAG_END_HEADERS)
+			{
+				code = headers_receive(&connection, block_id, block, block_length, block_end);
+				free(block);
+				block = 0;
+			}
+			break;
+
+		case FrameReset:
+			if (length != 4)
+			{
+				code = CodeFrameSize;
+				goto finally;
+			}
+
+			{
+				struct http2_stream *item;
+
+				pthread_mutex_lock(&connection.lock);
+				if (item = stream_find(&connection, id))
+				{
+					item->reset = true;
+					if (item->input >= 0)
+					{
+						close(item->input);
+						item->input = -1;
+					}
+					stream_remove(&connection, item);
+					pthread_cond_broadcast(&connection.changed);
+				}
+				pthread_mutex_unlock(&connection.lock);
+			}
+			break;
+
+		case FrameSettings:
+			if (flags & FLAG_ACK) break;
+			if (id)
+			{
+				code = CodeProtocol;
+				goto finally;
+			}
+
+			if (code = settings_apply(&connection, payload, length)) goto finally;
+
+			pthread_mutex_lock(&connection.lock);
+			if (!frame_write(&connection, FrameSettings, FLAG_ACK, 0, 0, 0))
+				frame_flush(&connection);
+			pthread_mutex_unlock(&connection.lock);
+			break;
+
+		case FramePing:
+			if (length != 8)
+			{
+				code = CodeFrameSize;
+				goto finally;
+			}
+			if (flags & FLAG_ACK) break;
+
+			pthread_mutex_lock(&connection.lock);
+			if (!frame_write(&connection, FramePing, FLAG_ACK, 0, payload, length))
+				frame_flush(&connection);
+			pthread_mutex_unlock(&connection.lock);
+			break;
+
+		case FrameGoaway:
+			// Let the requests that are being handled complete.
+			goaway = true;
+			goto finally;
+
+		case FrameWindowUpdate:
+			if (length != 4)
+			{
+				code = CodeFrameSize;
+				goto finally;
+			}
+
+			{
+				uint32_t increment = uint32_load(payload) & WINDOW_MAX;
+				struct http2_stream *item;
+
+				pthread_mutex_lock(&connection.lock);
+				if (!id) connection.window += increment;
+				else if (item = stream_find(&connection, id)) item->window += increment;
+				pthread_cond_broadcast(&connection.changed);
+				pthread_mutex_unlock(&connection.lock);
+			}
+			break;
+
+		// PRIORITY and unknown frames are ignored. Clients don't send PUSH_PROMISE.
+		}
+
+		stream_read_flush(stream, FRAME_HEADER_SIZE + length);
+		if (code) goto finally;
+	}
+
+finally:
+	free(block);
+
+	if (context)
+	{
+		http_parse_term(context);
+		stream_read_unpin(stream);
+	}
+
+	pthread_mutex_lock(&connection.lock);
+
+	if (upgrade) stream_release(&connection, upgrade);
+
+	if (!goaway && !connection.closed && (status != ERROR_NETWORK))
+	{
+		unsigned char payload[8];
+		uint32_store(payload, connection.last);
+		uint32_store(payload + 4, code);
+		if (!frame_write(&connection, FrameGoaway, 0, 0, payload, sizeof(payload)))
+			frame_flush(&connection);
+	}
+
+	// Handlers waiting for the request body get an error.
+	for(size = 0; size < HTTP2_STREAMS_MAX; ++size)
+		if (connection.streams[size] && (connection.streams[size]->input >= 0))
+		{
+			close(connection.streams[size]->input);
+			connection.streams[size]->input = -1;
+		}
+
+	// Let the handlers send their responses unless the connection is broken. Wait until they are done.
+	if (code || (status && (status != ERROR_AGAIN))) connection.closed = true;
+	pthread_cond_broadcast(&connection.changed);
+	while (connection.alive)
+		pthread_cond_wait(&connection.changed, &connection.lock);
+
+	pthread_mutex_unlock(&connection.lock);
+
+	hpack_table_term(&connection.encoder);
+	hpack_table_term(&connection.decoder);
+	pthread_cond_destroy(&connection.changed);
+	pthread_mutex_destroy(&connection.lock);
+
+	return status;
+}
+
+// Returns whether the values of the header field differ between responses. Such fields are not added to the dynamic table.
+static bool header_volatile(const struct string *name)
+{
+	static const struct string fields[] = {{"date", 4}, {"content-length", 14}, {"content-range", 13}};
+	size_t index;
+	for(index = 0; index < sizeof(fields) / sizeof(*fields); ++index)
+		if (string_equal(name, fields + index))
+			return true;
+	return false;
+}
+
+int http2_headers_send(struct http2_stream *restrict stream, unsigned code, const char *headers, size_t length, bool end)
+{
+	struct http2 *connection = stream->connection;
+	unsigned char block[RESPONSE_BLOCK_SIZE], *position = block;
+	const unsigned char *block_end = block + sizeof(block);
+	char status[HTTP_CODE_LENGTH], lower[HEADERS_LENGTH_MAX];
+	const char *line, *separator, *terminator, *headers_end = headers + length;
+	struct string name, value;
+	size_t index;
+	int result;
+
+	pthread_mutex_lock(&connection->lock);
+	if (connection->closed || stream->reset)
+	{
+		pthread_mutex_unlock(&connection->lock);
+		return ERROR_NETWORK;
+	}
+
+	// The header block must be sent before any other block is encoded.
+	position = hpack_encode_start(&connection->encoder, position, block_end);
+	name = string(":status");
+	value = string(status, (char *)format_uint_pad(status, code, 10, HTTP_CODE_LENGTH, 0) - status);
+	if (position) position = hpack_encode(&connection->encoder, position, block_end, &name, &value, true);
+
+	// Each line has the format name: value\r\n
+	for(line = headers; position && (line < headers_end); line = terminator + 2)
+	{
+		separator = memchr(line, ':', headers_end - line);
+		terminator = memchr(separator, '\r', headers_end - separator);
+
+		// Header field names are in lower case.
+		for(index = 0; (line + index) < separator; ++index)
+			lower[index] = (((line[index] >= 'A') && (line[index] <= 'Z')) ? (line[index] + ('a' - 'A')) : line[index]);
+		name = string(lower, index);
+		value = string((char *)separator + 2, terminator - separator - 2);
+
+		if (header_connection(&name)) continue;
+		position = hpack_encode(&connection->encoder, position, block_end, &name, &value, !header_volatile(&name));
+	}
+
+	// The dynamic table of the client is no longer in sync. The connection can't be used.
+	if (!position)
+	{
+		connection->closed = true;
+		pthread_cond_broadcast(&connection->changed);
+		pthread_mutex_unlock(&connection->lock);
+		return ERROR_MEMORY;
+	}
+
+	result = frame_write(connection, FrameHeaders, FLAG_END_HEADERS | (end ? FLAG_END_STREAM : 0), stream->id, block, position - block);
+	stream->headers = true;
+	stream->end = end;
+
+	// The headers are sent together with the data that follows them.
+	if (!result && end) result = frame_flush(connection);
+
+	pthread_mutex_unlock(&connection->lock);
+	return result;
+}
+
+int http2_data_send(struct http2_stream *restrict stream, const char *data, size_t length, bool end)
+{
+	struct http2 *connection = stream->connection;
+	size_t size;
+	int status = 0;
+
+	if (!length && !end) return 0;
+
+	pthread_mutex_lock(&connection->lock);
+	do
+	{
+		// Wait until the client accepts more data.
+		while (length && !connection->closed && !stream->reset && ((stream->window <= 0) || (connection->window <= 0)))
+		{
+			if (status = frame_flush(connection)) break;
+			pthread_cond_wait(&connection->changed, &connection->lock);
+		}
+		if (connection->closed || stream->reset)
+		{
+			status = ERROR_NETWORK;
+			break;
+		}
+
+		size = length;
+		if (size > connection->frame_max) size = connection->frame_max;
+		if (size > stream->window) size = stream->window;
+		if (size > connection->window) size = connection->window;
+
+		if (status = frame_write(connection, FrameData, ((end && (size == length)) ? FLAG_END_STREAM : 0), stream->id, data, size)) break;
+		stream->window -= size;
+		connection->window -= size;
+		data += size;
+		length -= size;
+	} while (length);
+
+	if (!status)
+	{
+		stream->end = end;
+		status = frame_flush(connection);
+	}
+	pthread_mutex_unlock(&connection->lock);
+
+	return status;
+}
+
+void http2_stream_close(struct http2_stream *restrict stream)
+{
+	struct http2 *connection = stream->connection;
+
+	// The handler no longer reads the request body.
+	if (stream->body >= 0)
+	{
+		close(stream->body);
+		stream->body = -1;
+	}
+
+	pthread_mutex_lock(&connection->lock);
+
+	if (!connection->closed && !stream->reset && !stream->end)
+	{
+		unsigned char payload[4];
+
+		// Reset the stream if no response was sent. Otherwise complete the response.
+		if (!stream->headers)
+		{
+			uint32_store(payload, CodeInternal);
+			if (!frame_write(connection, FrameReset, 0, stream->id, payload, sizeof(payload))) frame_flush(connection);
+		}
+		else if (!frame_write(connection, FrameData, FLAG_END_STREAM, stream->id, 0, 0)) frame_flush(connection);
+	}
+
+	stream_remove(connection, stream);
+	stream_release(connection, stream);
+
+	pthread_mutex_unlock(&connection->lock);
+}
@@ -0,0 +1,40 @@
+// HTTP/2 over cleartext TCP (h2c) as defined in RFC 7540.
+// Each request is handled in its own thread while the connection thread reads frames.
+
+#define HTTP2_STREAMS_MAX 32 /* concurrent streams per connection */
+
+struct http2;
+
+struct http2_stream
+{
+	struct http2 *connection;
+	uint32_t id;
+	long window; // how many bytes of data the client accepts for this stream
+	int input; // pipe end through which the connection thread passes the request body (-1 when closed)
+	int body; // pipe end from which the handler reads the request body (-1 if there is no body)
+	size_t received; // body bytes read by the handler for which no WINDOW_UPDATE is sent yet (protected by the connection lock)
+	unsigned links; // reference counting
+	bool headers; // whether response headers are sent
+	bool end; // whether the response is complete
+	bool reset; // whether the stream is reset by either side
+	struct http_context context; // the request is decoded here (only request and arena are used)
+};
+
+// Returns whether the request starts an HTTP/2 connection (with connection preface or with Upgrade: h2c).
+// Only cleartext connections may be switched to HTTP/2 this way.
+bool http2_start(const struct http_request *request);
+
+// Serves an HTTP/2 connection started with the request in context. Returns when the connection is closed and all its requests are handled.
+// dispatch() is called for each request. The handler must call http2_stream_close() when it is done with the request.
+// dispatch() returns ERROR_AGAIN to refuse the request (the client can retry it).
+int http2_serve(struct stream *restrict stream, struct http_context *restrict context, int (*dispatch)(struct http2_stream *));
+
+// Initializes body for reading the request body of the stream. Reading the body allows the client to send more of it.
+int http2_stream_body(struct http2_stream *restrict stream, struct stream *restrict body);
+
+// headers contains header lines as generated by response_header_add(). They are converted to HTTP/2 header fields.
+int http2_headers_send(struct http2_stream *restrict stream, unsigned code, const char *headers, size_t length, bool end);
+int http2_data_send(struct http2_stream *restrict stream, const char *data, size_t length, bool end);
+
+// Completes the response (resetting the stream if no response was sent) and releases the stream.
+void http2_stream_close(struct http2_stream *restrict stream);
@@ -1,9 +1,17 @@
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #include "base.h"
 #include "format.h"
 #include "json.h"
@@ -11,7 +19,7 @@
 #include "http.h"
 #include "http_parse.h"
 
-#define URI_LENGTH_MAX 16384 /* 16KiB */
+#define REQUEST_LENGTH_MAX 16384 /* 16KiB */
 
 // http_parse* functions return 0 on success and HTTP status code on error
 
@@ -41,20 +49,15 @@ static int http_parse_uri_path(struct http_request *restrict request, size_t pat
 
 		// Decode query
 		struct string json_raw;
-		json_raw.data = malloc(sizeof(char) * (query_length + 1));
+		json_raw.data = arena_alloc(request->arena, sizeof(char) * (query_length + 1));
 		if (!json_raw.data) return ServiceUnavailable;
 
-		json_raw.length = url_decode(query_start + 1, json_raw.data, query_length);
-		if (!json_raw.length)
-		{
-			free(json_raw.data);
-			return BadRequest;
-		}
+		json_raw.length = url_decode_text(query_start + 1, json_raw.data, query_length);
+		if (!json_raw.length) return BadRequest;
 		json_raw.data[json_raw.length] = 0;
 
 		// Parse query
-		request->query = json_parse(&json_raw);
-		free(json_raw.data);
+		request->query = json_parse_arena(&json_raw, request->arena);
 		if (!request->query) return BadRequest; // TODO: this could be either BadRequest or InternalServerError because of json_parse
 	}
 	else
@@ -64,19 +67,10 @@ static int http_parse_uri_path(struct http_request *restrict request, size_t pat
 	}
 
 	// Decode path
-	request->path.data = malloc(sizeof(char) * (path_length + 1));
-	if (!request->path.data)
-	{
-		json_free(request->query);
-		return ServiceUnavailable;
-	}
-	request->path.length = url_decode(path, request->path.data, path_length);
-	if (!request->path.length)
-	{
-		json_free(request->query);
-		free(request->path.data);
-		return BadRequest;
-	}
+	request->path.data = arena_alloc(request->arena, sizeof(char) * (path_length + 1));
+	if (!request->path.data) return ServiceUnavailable;
+	request->path.length = url_decode_text(path, request->path.data, path_length);
+	if (!request->path.length) return BadRequest;
 	request->path.data[request->path.length] = 0;
 
 	return 0;
@@ -92,7 +86,7 @@ int http_parse_uri(struct http_request *restrict request)
 	if (!length) // Empty URI
 	{
 		request->path.length = 1;
-		request->path.data = dupalloc("/", request->path.length);
+		request->path.data = arena_dup(request->arena, "/", request->path.length);
 		if (!request->path.data) return ServiceUnavailable;
 		request->query = 0;
 		return 0;
@@ -141,13 +135,11 @@ int http_parse_uri(struct http_request *restrict request)
 		}
 		else host_length = path - host;
 
-		// Add host header.
-		// WARNING: The code below assumes that request->headers contains key "host".
-		struct string name = string("host"), *value = string_alloc(host, host_length);
-		if (!value) return ServiceUnavailable;
-		void *old;
-		dict_set(&request->headers, &name, value, &old);
-		free(old);
+		// Set host header to point to the host in the URI.
+		// WARNING: The code below assumes that the request has a host header.
+		struct string *value = request->headers_known[HEADER_HOST];
+		if (!value) return BadRequest;
+		*value = string((char *)host, host_length);
 
 		return http_parse_uri_path(request, path - request->URI.data);
 	}
@@ -698,7 +690,7 @@ enum
 	S_VI,	// minor version
 	S_FC,	// \r before first header
 	S_FL,	// \n before first header
-	S_N,	// header name
+	S_N,	// header name or \r
 	S_NC,	// header name or :
 	S_NE,	// header name or whitespace or \r
 	S_V,	// header value or \r or "
@@ -730,7 +722,7 @@ static const char state[STATES_COUNT][CLASSES_COUNT] = {
 	-1,		-1,		-1,		-1,		S_FC,	-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		//S_VI	minor version
 	-1,		-1,		S_FL,	-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		//S_FC	\r before first header
 	-1,		-1,		-1,		S_N,	-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		//S_FL	\n before first header
-	-1,		-1,		-1,		-1,		S_NC,	S_NC,	S_NC,	S_NC,	S_NC,	-1,		-1,		-1,		S_NC,	-1,		S_NC,	-1,		//S_N	header name
+	-1,		-1,		S_E,	-1,		S_NC,	S_NC,	S_NC,	S_NC,	S_NC,	-1,		-1,		-1,		S_NC,	-1,		S_NC,	-1,		//S_N	header name or \r
 	-1,		-1,		-1,		-1,		S_NC,	S_NC,	S_NC,	S_NC,	S_NC,	-1,		-1,		-1,		S_NC,	S_V,	S_NC,	-1,		//S_NC	header name or :
 	-1,		S_V,	S_E,	-1,		S_NC,	S_NC,	S_NC,	S_NC,	S_NC,	-1,		-1,		-1,		S_NC,	-1,		S_NC,	-1,		//S_NE	header name or whitespace or \r
 	-1,		S_V,	S_VL,	-1,		S_V,	S_V,	S_V,	S_V,	S_V,	S_V,	S_VQ,	S_V,	S_V,	S_V,	S_V,	S_V,	//S_V	header value or \r or "
@@ -740,11 +732,118 @@ static const char state[STATES_COUNT][CLASSES_COUNT] = {
 	-1,		-1,		-1,		FIN,	-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		-1,		//S_E	end of headers \n
 };
 
+// Vector operations used to scan a block of bytes at once. Comparisons are signed so non-ASCII bytes compare less than any ASCII byte.
+#if defined(__AVX2__)
+# define VECTOR_SIZE 32
+typedef __m256i vector;
+# define vector_load(data) _mm256_loadu_si256((const __m256i *)(data))
+# define vector_store(data, v) _mm256_storeu_si256((__m256i *)(data), (v))
+# define vector_set(byte) _mm256_set1_epi8(byte)
+# define vector_index() _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31)
+# define vector_gt(a, b) _mm256_cmpgt_epi8((a), (b))
+# define vector_eq(a, b) _mm256_cmpeq_epi8((a), (b))
+# define vector_or(a, b) _mm256_or_si256((a), (b))
+# define vector_and(a, b) _mm256_and_si256((a), (b))
+# define vector_andnot(a, b) _mm256_andnot_si256((a), (b)) /* ~a & b */
+# define vector_mask(v) (uint32_t)_mm256_movemask_epi8(v)
+# define VECTOR_MASK_ALL 0xffffffff
+#elif defined(__SSE2__)
+# define VECTOR_SIZE 16
+typedef __m128i vector;
+# define vector_load(data) _mm_loadu_si128((const __m128i *)(data))
+# define vector_store(data, v) _mm_storeu_si128((__m128i *)(data), (v))
+# define vector_set(byte) _mm_set1_epi8(byte)
+# define vector_index() _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+# define vector_gt(a, b) _mm_cmpgt_epi8((a), (b))
+# define vector_eq(a, b) _mm_cmpeq_epi8((a), (b))
+# define vector_or(a, b) _mm_or_si128((a), (b))
+# define vector_and(a, b) _mm_and_si128((a), (b))
+# define vector_andnot(a, b) _mm_andnot_si128((a), (b)) /* ~a & b */
+# define vector_mask(v) (uint32_t)_mm_movemask_epi8(v)
+# define VECTOR_MASK_ALL 0xffff
+#endif
+
+// Returns the position of the first byte at or after index that is not a URI character. Returns length if there is no such byte.
+static size_t scan_uri(const char *restrict data, size_t index, size_t length)
+{
+#if defined(VECTOR_SIZE)
+	const vector space = vector_set(' '), del = vector_set(0x7f);
+	for(; (index + VECTOR_SIZE) <= length; index += VECTOR_SIZE)
+	{
+		vector bytes = vector_load(data + index);
+		uint32_t stop = vector_mask(vector_andnot(vector_eq(bytes, del), vector_gt(bytes, space))) ^ VECTOR_MASK_ALL;
+		if (stop) return index + __builtin_ctz(stop);
+	}
+#endif
+
+	// Any character from digit to separator is allowed in the URI.
+	while ((index < length) && (class[(unsigned char)data[index]] >= C_D))
+		index += 1;
+	return index;
+}
+
+// Returns the position of the first byte at or after index that can end an unquoted header value (or is invalid in it). Returns length if there is no such byte.
+static size_t scan_value(const char *restrict data, size_t index, size_t length)
+{
+	unsigned char byte;
+
+#if defined(VECTOR_SIZE)
+	const vector control = vector_set(0x1f), tab = vector_set('\t'), del = vector_set(0x7f), quote = vector_set('"');
+	for(; (index + VECTOR_SIZE) <= length; index += VECTOR_SIZE)
+	{
+		vector bytes = vector_load(data + index);
+		vector allowed = vector_or(vector_gt(bytes, control), vector_eq(bytes, tab));
+		allowed = vector_andnot(vector_or(vector_eq(bytes, del), vector_eq(bytes, quote)), allowed);
+		uint32_t stop = vector_mask(allowed) ^ VECTOR_MASK_ALL;
+		if (stop) return index + __builtin_ctz(stop);
+	}
+#endif
+
+	for(; index < length; ++index)
+	{
+		byte = class[(unsigned char)data[index]];
+		if ((byte != C_LWS) && ((byte < C_D) || (byte == C_QQ))) break;
+	}
+	return index;
+}
+
+// Converts ASCII letters to lower case. available bytes starting from data can be read and written (available >= length).
+static void lowercase(char *restrict data, size_t length, size_t available)
+{
+	size_t index = 0;
+
+#if defined(VECTOR_SIZE)
+	const vector before = vector_set('A' - 1), after = vector_set('Z' + 1), bit = vector_set(0x20);
+	vector bytes, upper;
+
+	for(; (index + VECTOR_SIZE) <= length; index += VECTOR_SIZE)
+	{
+		bytes = vector_load(data + index);
+		upper = vector_and(vector_gt(bytes, before), vector_gt(after, bytes));
+		vector_store(data + index, vector_or(bytes, vector_and(upper, bit)));
+	}
+
+	// Convert the rest with a single block if it can be read. The bytes after length are stored unchanged.
+	if ((index < length) && ((index + VECTOR_SIZE) <= available))
+	{
+		bytes = vector_load(data + index);
+		upper = vector_and(vector_gt(bytes, before), vector_gt(after, bytes));
+		upper = vector_and(upper, vector_gt(vector_set(length - index), vector_index()));
+		vector_store(data + index, vector_or(bytes, vector_and(upper, bit)));
+		return;
+	}
+#endif
+
+	for(; index < length; ++index)
+		data[index] = tolower(data[index]);
+}
+
 bool http_parse_init(struct http_context *restrict context)
 {
 	memset(&context->request, 0, sizeof(context->request));
 
-	if (!dict_init(&context->request.headers, DICT_SIZE_BASE)) return false; // InternalServerError
+	arena_init(&context->arena, context->arena_buffer, sizeof(context->arena_buffer));
+	context->request.arena = &context->arena;
 
 	context->index = 0;
 	context->state = START;
@@ -754,43 +853,106 @@ bool http_parse_init(struct http_context *restrict context)
 
 void http_parse_term(struct http_context *restrict context)
 {
-	free(context->request.URI.data);
-	context->request.URI.data = 0; // TODO is this necessary?
-	dict_term(&context->request.headers); // TODO is this enough?
+	// URI and headers point into the stream input buffer. It is released by stream_read_unpin().
+	context->request.URI.data = 0;
+	context->request.headers_count = 0;
+	memset(context->request.headers_known, 0, sizeof(context->request.headers_known));
+
+	// Free everything allocated while handling the request.
+	arena_term(&context->arena);
+}
+
+struct string *http_header(const struct http_request *restrict request, const struct string *restrict name)
+{
+	size_t index;
+	for(index = 0; index < request->headers_count; ++index)
+	{
+		const struct http_header *header = request->headers + index;
+		if ((header->name.length == name->length) && !memcmp(header->name.data, name->data, name->length))
+			return (struct string *)&header->value;
+	}
+	return 0;
+}
+
+#define HEADER_KNOWN_NAME(id, name) [id] = {name, sizeof(name) - 1},
+static const struct string headers_known[] = {HEADERS_KNOWN(HEADER_KNOWN_NAME)};
+#undef HEADER_KNOWN_NAME
+
+// Returns the well-known header ID of a lower case header name or -1 if the header is not well-known.
+static int header_known(const struct string *name)
+{
+	int id;
+	for(id = 0; id < HEADERS_KNOWN_COUNT; ++id)
+		if (string_equal(name, headers_known + id))
+			return id;
+	return -1;
+}
+
+unsigned http_method(const struct string *name)
+{
+	#define METHOD_IS(m) ((name->length == (sizeof(m) - 1)) && !memcmp(name->data, (m), sizeof(m) - 1))
+	if METHOD_IS("HEAD") return METHOD_HEAD;
+	else if METHOD_IS("GET") return METHOD_GET;
+	else if METHOD_IS("POST") return METHOD_POST;
+	else if METHOD_IS("OPTIONS") return METHOD_OPTIONS;
+	else if METHOD_IS("PUT") return METHOD_PUT;
+	else if METHOD_IS("DELETE") return METHOD_DELETE;
+	else if METHOD_IS("SUBSCRIBE") return METHOD_SUBSCRIBE;
+	else if METHOD_IS("NOTIFY") return METHOD_NOTIFY;
+	else if METHOD_IS("PRI") return METHOD_PRI;
+	else return 0;
+	#undef METHOD_IS
+}
+
+bool http_header_add(struct http_request *restrict request, const struct string *name, const struct string *value)
+{
+	struct http_header *header;
+	int id;
+
+	if (request->headers_count == HEADERS_COUNT_MAX) return false;
+	header = request->headers + request->headers_count++;
+	header->name = *name;
+	header->value = *value;
+
+	// The first occurrence of a header is used.
+	id = header_known(&header->name);
+	if ((id >= 0) && !request->headers_known[id])
+		request->headers_known[id] = &header->value;
+
+	return true;
 }
 
-static int header_add(struct dict *restrict headers, char *restrict buffer, size_t length, size_t separator)
+// Sets header name and value to point to the header data. Normalizes the header in place.
+static bool header_normalize(struct http_header *restrict header, char *restrict data)
 {
-	struct string key = string(buffer, separator);
-	buffer += separator + 1;
-	length -= separator + 1;
-	struct string *value = malloc(sizeof(struct string) + length + 1);
-	if (!value) return ERROR_MEMORY;
-	value->data = (char *)(value + 1);
+	size_t length = header->value.length;
+
+	header->name.data = data;
+	data += header->name.length + 1;
+	header->value.data = data;
 
 	// Convert header name to lower case.
-	separator -= 1;
-	do key.data[separator] = tolower(key.data[separator]);
-	while (separator--);
+	lowercase(header->name.data, header->name.length, header->name.length + 1 + length);
 
 	// Trim whitespace characters and replace any sequence of whitespace characters with a single space.
+	// The result is never longer than the original so it is written over it.
 	bool space = false;
 	size_t src;
 	size_t index;
 	index = 0;
 	for(src = 0; src < length; ++src)
 	{
-		if (isspace(buffer[src]))
+		if (isspace(data[src]))
 		{
 			if (index) space = true;
 		}
-		else if (buffer[src] == '\\')
+		else if (data[src] == '\\')
 		{
-			if (++src == length) return -1; // TODO
-			switch (buffer[src]) // TODO support escape sequences
+			if (++src == length) return false;
+			switch (data[src]) // TODO support escape sequences
 			{
 			default:
-				value->data[index++] = buffer[src];
+				data[index++] = data[src];
 			}
 		}
 		else
@@ -798,33 +960,47 @@ static int header_add(struct dict *restrict headers, char *restrict buffer, size
 			if (space)
 			{
 				space = false;
-				value->data[index++] = ' ';
+				data[index++] = ' ';
 			}
-			value->data[index++] = buffer[src];
+			data[index++] = data[src];
 		}
 	}
 
-	value->data[index] = 0;
-	value->length = index;
-	int status = dict_add(headers, &key, value);
-	if (status) free(value);
-	return status;
+	// The header is followed by at least one line terminator character so there is always place for NUL.
+	data[index] = 0;
+	header->value.length = index;
+	return true;
 }
 
 int http_parse(struct http_context *restrict context, struct stream *restrict stream)
 {
 	int status;
 
+	// The request is kept in the input buffer until it is parsed completely.
+	// Everything is stored relative to the start of the request because reading more data may move the buffer.
+	// Only the part of the request scanned so far counts towards its length (the buffer may hold pipelined requests after it).
 	struct string buffer;
-	size_t cached = stream_cached(stream);
-	if (cached >= URI_LENGTH_MAX) return RequestURITooLong; // TODO: change this
-	if (status = stream_read(stream, &buffer, cached + 1)) return status;
+	if (context->index >= REQUEST_LENGTH_MAX) return ((context->state <= S_U) ? RequestURITooLong : RequestEntityTooLarge);
+	if (status = stream_read(stream, &buffer, context->index + 1)) return status;
 
 	unsigned char byte;
 	char state_new;
 	struct string token;
+	size_t header;
 	for(; context->index < buffer.length; context->index += 1)
 	{
+		// Skip the bytes that don't change the state. Most of the request is in the URI and in the header values.
+		if (context->state == S_U)
+		{
+			context->index = scan_uri(buffer.data, context->index, buffer.length);
+			if (context->index == buffer.length) break;
+		}
+		else if (context->state == S_V)
+		{
+			context->index = scan_value(buffer.data, context->index, buffer.length);
+			if (context->index == buffer.length) break;
+		}
+
 		byte = class[(unsigned char)buffer.data[context->index]];
 		state_new = state[(unsigned char)context->state][(unsigned)byte];
 
@@ -839,33 +1015,14 @@ int http_parse(struct http_context *restrict context, struct stream *restrict st
 		case S_UF: // space after method
 			token = string(buffer.data + context->start, context->index - context->start);
 
-			#define METHOD_IS(m) ((token.length == (sizeof(m) - 1)) && !memcmp(token.data, (m), sizeof(m) - 1))
-			if METHOD_IS("HEAD") context->request.method = METHOD_HEAD;
-			else if METHOD_IS("GET") context->request.method = METHOD_GET;
-			else if METHOD_IS("POST") context->request.method = METHOD_POST;
-			else if METHOD_IS("OPTIONS") context->request.method = METHOD_OPTIONS;
-			else if METHOD_IS("PUT") context->request.method = METHOD_PUT;
-			else if METHOD_IS("DELETE") context->request.method = METHOD_DELETE;
-			else if METHOD_IS("SUBSCRIBE") context->request.method = METHOD_SUBSCRIBE;
-			else if METHOD_IS("NOTIFY") context->request.method = METHOD_NOTIFY;
-			else return NotImplemented; // TODO
-			#undef METHOD_IS
+			if (!(context->request.method = http_method(&token))) return NotImplemented; // TODO
 
 			context->start = context->index + 1;
 			break;
 
 		case S_H: // space after URI
-			token = string(buffer.data + context->start, context->index - context->start);
-
-			context->request.URI.data = malloc(token.length + 1);
-			if (!context->request.URI.data) return InternalServerError;
-			*format_bytes(context->request.URI.data, token.data, token.length) = 0;
-			context->request.URI.length = token.length;
-
-			stream_read_flush(stream, context->index);
-			stream_read(stream, &buffer, buffer.length - context->index); // read data is already buffered
-			context->index = 0;
-
+			context->uri = context->start;
+			context->request.URI.length = context->index - context->start;
 			break;
 
 		case S_VP: // major version
@@ -881,18 +1038,18 @@ int http_parse(struct http_context *restrict context, struct stream *restrict st
 			break;
 
 		case S_E: // end of header
+			if (context->state == S_N) break; // no headers (as in the HTTP/2 connection preface)
 			// assert(context->state == S_NE);
 			goto add;
 		case S_NC: // first character of header name
 			if (context->state == S_NE) // there was a header before this one
 			{
 		add:
-				// TODO check return value
-				header_add(&context->request.headers, buffer.data + context->start, context->index - context->start, context->separator - context->start);
-
-				stream_read_flush(stream, context->index);
-				stream_read(stream, &buffer, buffer.length - context->index); // read data is already buffered
-				context->index = 0;
+				if (context->request.headers_count == HEADERS_COUNT_MAX) return RequestEntityTooLarge;
+				context->offsets[context->request.headers_count] = context->start;
+				context->request.headers[context->request.headers_count].name.length = context->separator - context->start;
+				context->request.headers[context->request.headers_count].value.length = context->index - context->separator - 1;
+				context->request.headers_count += 1;
 			}
 
 			context->start = context->index;
@@ -903,7 +1060,25 @@ int http_parse(struct http_context *restrict context, struct stream *restrict st
 			break;
 
 		case FIN:
-			stream_read_flush(stream, context->index + 1);
+			// Set URI and headers to point to the request data and normalize them.
+			context->request.URI.data = buffer.data + context->uri;
+			context->request.URI.data[context->request.URI.length] = 0; // replaces the space after the URI
+			for(header = 0; header < context->request.headers_count; ++header)
+			{
+				struct http_header *item = context->request.headers + header;
+				int id;
+
+				if (!header_normalize(item, buffer.data + context->offsets[header]))
+					return BadRequest;
+
+				// Remember where the well-known headers are. The first occurrence of a header is used.
+				id = header_known(&item->name);
+				if ((id >= 0) && !context->request.headers_known[id])
+					context->request.headers_known[id] = &item->value;
+			}
+
+			// Keep the request data in the buffer until the request is handled.
+			stream_read_pin(stream, context->index + 1);
 			return 0; // success
 
 		case -1:
@@ -916,6 +1091,7 @@ int http_parse(struct http_context *restrict context, struct stream *restrict st
 	return ERROR_AGAIN; // header not read
 }
 
+// Returns quality value multiplied by 1000 or -1 if the value is not valid.
 static int http_parse_quality(const char *data, size_t length)
 {
 	// /q=(0(\.\d{,3})?|1(\.0{,3})?)/
@@ -925,8 +1101,8 @@ static int http_parse_quality(const char *data, size_t length)
 	int result;
 
 	// Parse first digit
-	result = (data[0] - '0') * 1000;
-	if ((result < 0) || (1000 < result)) return -1;
+	if ((data[2] != '0') && (data[2] != '1')) return -1;
+	result = (data[2] - '0') * 1000;
 
 	if (length == 3) return result;
 	if (data[3] != '.') return -1;
@@ -947,34 +1123,53 @@ static int http_parse_quality(const char *data, size_t length)
 		}
 	}
 
-	return result;
+	return ((result <= 1000) ? result : -1);
 }
 
-static int http_parse_accept_add(const char *buffer, size_t item_length, size_t quality_length, struct string *restrict list, unsigned *priorities, size_t *restrict allow, size_t *restrict deny)
+// Adds an item with its parameters to the list. Allowed items are kept sorted by priority at the start of the list.
+// Items that are not allowed are put at the end of the list.
+static int http_parse_accept_add(const char *buffer, size_t length, struct string *restrict list, size_t count, unsigned *priorities, size_t *restrict allow, size_t *restrict deny)
 {
-	int priority;
+	int priority = 1000;
 	struct string item;
-	size_t last;
+	size_t index, start, last;
+
+	// The item ends where its parameters start.
+	for(index = 0; (index < length) && (buffer[index] != ';'); ++index)
+		;
+	item.length = index;
+	while (item.length && isspace(buffer[item.length - 1])) item.length -= 1;
+	if (!item.length) return BadRequest;
+
+	// Find quality among the parameters.
+	while (index < length)
+	{
+		index += 1; // skip ';'
+		while ((index < length) && isspace(buffer[index])) index += 1;
+		for(start = index; (index < length) && (buffer[index] != ';'); ++index)
+			;
+		for(last = index; (last > start) && isspace(buffer[last - 1]); --last)
+			;
+		if (((last - start) >= 2) && (buffer[start] == 'q') && (buffer[start + 1] == '='))
+		{
+			priority = http_parse_quality(buffer + start, last - start);
+			if (priority < 0) return BadRequest;
+		}
+	}
 
 	// Generate access item.
-	item.length = item_length;
 	item.data = malloc(item.length + 1);
 	if (!item.data) return InternalServerError; // memory error
 	memcpy(item.data, buffer, item.length);
 	item.data[item.length] = 0;
 
-	if (quality_length > 0) // quality is specified
+	if (!priority)
 	{
-		priority = http_parse_quality(buffer + item_length, quality_length);
-		if (priority < 0) return BadRequest;
-		else if (!priority)
-		{
-			// The specified item is not allowed. Add it to the deny list.
-			list[*allow + (*deny)++] = item;
-			return 0;
-		}
+		// The specified item is not allowed. Add it to the deny list.
+		*deny += 1;
+		list[count - *deny] = item;
+		return 0;
 	}
-	else priority = 1;
 
 	// Find the right position for the item and put it there.
 	for(last = *allow; (last && (priorities[last - 1] < priority)); --last)
@@ -990,13 +1185,14 @@ static int http_parse_accept_add(const char *buffer, size_t item_length, size_t
 }
 
 // TODO: some strings may not be parsed correctly
-// WARNING: header must be NUL terminated
 // Initializes array with accepted and not accepted values.
+// The first allow items of the list are accepted (sorted by priority); the next deny items are not accepted.
+// Items with the same priority are in the order in which they are in the header.
 int http_parse_accept(const struct string *header, struct string **list, size_t *restrict allow, size_t *restrict deny)
 {
-	size_t index;
-
+	size_t index, start, end;
 	size_t count = 0;
+	int status;
 
 	// Determine accept values count.
 	bool data = false;
@@ -1011,6 +1207,14 @@ int http_parse_accept(const struct string *header, struct string **list, size_t
 	}
 	count += data;
 
+	*allow = 0;
+	*deny = 0;
+	if (!count)
+	{
+		*list = 0;
+		return 0;
+	}
+
 	// Initialize temporary priority array so that results can be sorted by priority.
 	// Initialize data structures.
 	unsigned *priorities = malloc(sizeof(unsigned) * count);
@@ -1021,77 +1225,98 @@ int http_parse_accept(const struct string *header, struct string **list, size_t
 		free(priorities);
 		return InternalServerError;
 	}
-	*allow = 0;
-	*deny = 0;
-
-	ssize_t start, colon;
-	bool ready = true;
-
-	int status;
-
-	start = -1;
-	colon = -1;
 
-	for(index = 0; index < header->length; ++index)
+	for(start = 0; start < header->length; start = end + 1)
 	{
-		if (header->data[index] == ',') // separator
-		{
-			if (start >= 0)
-			{
-				if (colon < 0) colon = index;
-				status = http_parse_accept_add(header->data + start, colon - start, index - colon, *list, priorities, allow, deny);
-				if (status) goto error;
-				start = -1;
-				colon = -1;
-			}
+		for(end = start; (end < header->length) && (header->data[end] != ','); ++end)
+			;
 
-			ready = true;
-		}
-		else if (isspace(header->data[index]))
-		{
-			if (start >= 0)
-			{
-				if (colon < 0) colon = index;
-				status = http_parse_accept_add(header->data + start, colon - start, index - colon, *list, priorities, allow, deny);
-				if (status) goto error;
-				start = -1;
-				colon = -1;
+		// Skip whitespace before the item. Empty items are allowed.
+		while ((start < end) && isspace(header->data[start])) start += 1;
+		if (start == end) continue;
 
-				ready = false;
-			}
-		}
-		else
-		{
-			if (start >= 0)
-			{
-				if (header->data[index] == ';') colon = index;
-			}
-			else if (ready) start = index;
-			else
-			{
-				status = BadRequest;
-				goto error;
-			}
-		}
-	}
-	if (start >= 0)
-	{
-		if (colon < 0) colon = index;
-		status = http_parse_accept_add(header->data + start, colon - start, index - colon, *list, priorities, allow, deny);
-		if (status) goto error;
+		if (status = http_parse_accept_add(header->data + start, end - start, *list, count, priorities, allow, deny))
+			goto error;
 	}
 
 	free(priorities);
-	count = *allow + *deny;
-	*list = realloc(*list, sizeof(struct string) * count);
+
+	// Move the items that are not allowed right after the allowed ones.
+	memmove(*list + *allow, *list + count - *deny, sizeof(struct string) * *deny);
 
 	return 0;
 
 error:
 	free(priorities);
-	count = *allow + *deny;
-	while (count--) free((*list)[count].data);
+	for(index = 0; index < *allow; ++index) free((*list)[index].data);
+	for(index = count - *deny; index < count; ++index) free((*list)[index].data);
 	free(*list);
 
 	return status;
 }
+
+time_t http_parse_date(const char *data, size_t length)
+{
+	// Sun, 06 Nov 1994 08:49:37 GMT
+	static const char pattern[] = "___, 00 ___ 0000 00:00:00 GMT";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm info = {0};
+	size_t index;
+
+	#define DIGITS2(position) ((data[(position)] - '0') * 10 + (data[(position) + 1] - '0'))
+
+	// Digits are marked with 0 and letters with _.
+	if (length != sizeof(pattern) - 1) return -1;
+	for(index = 0; index < length; ++index)
+	{
+		if (pattern[index] == '0')
+		{
+			if (!isdigit(data[index])) return -1;
+		}
+		else if ((pattern[index] != '_') && (data[index] != pattern[index])) return -1;
+	}
+
+	for(index = 0; index < 12; ++index)
+		if (!memcmp(data + 8, months + index * 3, 3))
+			break;
+	if (index == 12) return -1;
+
+	info.tm_mday = DIGITS2(5);
+	info.tm_mon = index;
+	info.tm_year = DIGITS2(12) * 100 + DIGITS2(14) - 1900;
+	info.tm_hour = DIGITS2(17);
+	info.tm_min = DIGITS2(20);
+	info.tm_sec = DIGITS2(23);
+
+	#undef DIGITS2
+
+	if (!info.tm_mday || (info.tm_mday > 31) || (info.tm_hour > 23) || (info.tm_min > 59) || (info.tm_sec > 60)) return -1;
+
+	return timegm(&info);
+}
+
+bool http_parse_etag_match(const struct string *list, const struct string *etag)
+{
+	size_t index = 0, start;
+
+	while (1)
+	{
+		while ((index < list->length) && (isspace(list->data[index]) || (list->data[index] == ','))) index += 1;
+		if (index == list->length) return false;
+
+		if (list->data[index] == '*') return true;
+
+		// Weak comparison ignores the weakness indicator.
+		if ((list->length - index > 2) && (list->data[index] == 'W') && (list->data[index + 1] == '/')) index += 2;
+
+		if (list->data[index] != '"') return false; // not a valid list
+		start = index;
+		for(index += 1; (index < list->length) && (list->data[index] != '"'); ++index)
+			;
+		if (index == list->length) return false; // not a valid list
+		index += 1;
+
+		if (((index - start) == etag->length) && !memcmp(list->data + start, etag->data, etag->length))
+			return true;
+	}
+}
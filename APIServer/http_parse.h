@@ -6,23 +6,61 @@
 #define METHOD_DELETE 6
 #define METHOD_SUBSCRIBE 7
 #define METHOD_NOTIFY 8
+#define METHOD_PRI 9 /* start of the HTTP/2 connection preface */
 
 #define PROTOCOL_HTTP 1
 #define PROTOCOL_HTTPS 2
 
+#define HEADERS_COUNT_MAX 64
+
+// Well-known headers. The parser recognizes them and stores their values in request->headers_known.
+#define HEADERS_KNOWN(_) \
+	_(HEADER_CONNECTION, "connection") \
+	_(HEADER_ORIGIN, "origin") \
+	_(HEADER_HOST, "host") \
+	_(HEADER_RANGE, "range") \
+	_(HEADER_CONTENT_LENGTH, "content-length") \
+	_(HEADER_TRANSFER_ENCODING, "transfer-encoding") \
+	_(HEADER_ACCEPT_ENCODING, "accept-encoding") \
+	_(HEADER_IF_NONE_MATCH, "if-none-match") \
+	_(HEADER_IF_MODIFIED_SINCE, "if-modified-since") \
+	_(HEADER_UPGRADE, "upgrade") \
+	_(HEADER_HTTP2_SETTINGS, "http2-settings")
+
+#define HEADER_KNOWN_ID(id, name) id,
+enum {HEADERS_KNOWN(HEADER_KNOWN_ID) HEADERS_KNOWN_COUNT};
+#undef HEADER_KNOWN_ID
+
+#define ARENA_BUFFER_SIZE 4096
+
+struct http2_stream;
+
+// Header name and value point into the stream input buffer which is pinned until the request is handled.
+// The name is in lower case. The value is normalized and NUL-terminated.
+struct http_header
+{
+	struct string name, value;
+};
+
 struct http_request
 {
 	// Fields common for all methods
 	unsigned method;
 	struct string URI;
 	short version[2];
-	struct dict headers;
+	struct http_header headers[HEADERS_COUNT_MAX];
+	size_t headers_count;
+	struct string *headers_known[HEADERS_KNOWN_COUNT]; // values of the well-known headers (0 if not present)
 	const struct string *hostname;
 
 	// Fields specific to some methods
 	unsigned protocol, port; // 0 == default
 	struct string path;
 	union json *query;
+
+	struct arena *arena; // memory that is freed when the request is handled
+
+	struct http2_stream *http2; // stream of an HTTP/2 request (0 for HTTP/1.1)
 };
 
 struct http_context
@@ -30,8 +68,13 @@ struct http_context
 	struct http_request request;
 	size_t index;
 	size_t start, separator;
+	size_t uri; // position of the URI relative to the start of the request
+	size_t offsets[HEADERS_COUNT_MAX]; // position of each header relative to the start of the request
 	char state;
 
+	struct arena arena;
+	char arena_buffer[ARENA_BUFFER_SIZE]; // most requests need no memory beyond this buffer
+
 	int control; // pipe file descriptor for control messages
 };
 
@@ -42,6 +85,17 @@ struct http_context
 
 int http_parse_uri(struct http_request *restrict request);
 
+// Returns the METHOD_* constant for a method name or 0 if the method is not supported.
+unsigned http_method(const struct string *name);
+
+// Adds a header to a request that is not parsed from HTTP/1.1 data. The name must be in lower case.
+// The header data must stay valid until the request is handled.
+bool http_header_add(struct http_request *restrict request, const struct string *name, const struct string *value);
+
+// Returns the value of the header with the specified lower case name or 0 if there is no such header.
+// Use request->headers_known for the well-known headers.
+struct string *http_header(const struct http_request *restrict request, const struct string *restrict name);
+
 // WARNING: string must be NUL-terminated
 #if !defined(OS_WINDOWS)
 int http_parse_range(const char *range, off_t content_length, off_t (**ranges)[2], size_t *restrict intervals);
@@ -51,6 +105,12 @@ int http_parse_range(const char *range, int64_t content_length, int64_t (**range
 
 int http_parse_accept(const struct string *header, struct string **list, size_t *restrict allow, size_t *restrict deny);
 
+// Returns the time in an HTTP-date in the preferred format (IMF-fixdate) or -1 if the date is not valid.
+time_t http_parse_date(const char *data, size_t length);
+
+// Returns whether the entity tag matches any of the tags in the list (a value of If-None-Match). Uses weak comparison.
+bool http_parse_etag_match(const struct string *list, const struct string *etag);
+
 int http_parse_content_disposition(struct dict *restrict options, const struct string *string);
 
 // WARNING: string must be NUL-terminated
@@ -1,11 +1,16 @@
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <zlib.h>
+
 #include "base.h"
 #include "log.h"
 #include "format.h"
@@ -14,6 +19,7 @@
 #include "server.h"
 #include "storage.h"
 #include "actions.h"
+#include "http2.h"
 
 #define PHRASE_200 "OK"
 #define PHRASE_204 "No Content"
@@ -41,10 +47,42 @@
 // Number of bytes required to store string representation of content size. Should work for both base 10 and 16.
 #define SIZE_LENGTH_MAX (sizeof(off_t) * 3)
 
-#define RESPONSE_IDENTITY 1
-// #defien RESPONSE_DEFLATE 2
+// Maximum number of digits of a version in a path.
+#define VERSION_DIGITS_MAX 9
+
+// Articles are served at ARTICLE_PATH followed by the article name.
+#define ARTICLE_PATH "/article/"
+
+// Maximum length of an entity tag (quoted version with content coding suffix).
+#define ETAG_LENGTH_MAX (SIZE_LENGTH_MAX + sizeof("\"-deflate\""))
+
+// Maximum entity body size for which the whole serialized response is cached.
+#define RESPONSE_CACHE_MAX 65536 /* 64 KiB */
+
+// Minimum entity body size for which zerocopy transmission is used.
+#define ZEROCOPY_MIN 262144 /* 256 KiB */
+
+// Length of the boundary string that separates the parts of a multipart/byteranges entity body.
+#define BOUNDARY_LENGTH 16 /* hexadecimal digits */
+
+// Maximum length of the data that precedes a part of a multipart/byteranges entity body and length of the data after the last part.
+#define PART_START_LENGTH_MAX (sizeof("\r\n--") - 1 + BOUNDARY_LENGTH + sizeof("\r\nContent-Range: bytes ") - 1 + SIZE_LENGTH_MAX * 3 + 2 + sizeof("\r\n\r\n") - 1)
+#define PART_END_LENGTH (sizeof("\r\n--") - 1 + BOUNDARY_LENGTH + sizeof("--\r\n") - 1)
+
+// Compression level and output buffer size for chunked responses that are compressed as they are sent.
+#define RESPONSE_COMPRESS_LEVEL 6
+#define RESPONSE_COMPRESS_BUFFER 16384
+
+// Size of the chunks in which response writers send data.
+#define RESPONSE_WRITER_BUFFER 16384
 
-#define HTTP_CODE_LENGTH 3
+// Response writers send shorter bodies uncompressed. Compression would make them longer and cost more than sending them.
+#define RESPONSE_WRITER_COMPRESS_MIN 1024
+
+// Values of content_encoding for responses with entity body.
+#define RESPONSE_IDENTITY 1
+#define RESPONSE_DEFLATE 2
+#define RESPONSE_GZIP 3
 
 // TODO: string() can be used instead of string_static() with newer versions of gcc
 #define string_static(s) {(s), sizeof(s) - 1}
@@ -56,8 +94,44 @@ static const struct string methods[] = {
 	[METHOD_PUT] = string_static("PUT"),
 	[METHOD_DELETE] = string_static("DELETE"),
 };
+
+// Status line for each supported response code.
+#define STATUS_LINE_(code) [code] = string_static("HTTP/1.1 " #code " " PHRASE_ ## code "\r\n")
+#define STATUS_LINE(code) STATUS_LINE_(code)
+static const struct string status_lines[] = {
+	STATUS_LINE(OK),
+	STATUS_LINE(NoContent),
+	STATUS_LINE(PartialContent),
+	STATUS_LINE(MovedPermanently),
+	STATUS_LINE(NotModified),
+	STATUS_LINE(BadRequest),
+	STATUS_LINE(Forbidden),
+	STATUS_LINE(NotFound),
+	STATUS_LINE(MethodNotAllowed),
+	STATUS_LINE(RequestTimeout),
+	STATUS_LINE(LengthRequired),
+	STATUS_LINE(RequestEntityTooLarge),
+	STATUS_LINE(RequestURITooLong),
+	STATUS_LINE(UnsupportedMediaType),
+	STATUS_LINE(RequestedRangeNotSatisfiable),
+	STATUS_LINE(InternalServerError),
+	STATUS_LINE(NotImplemented),
+	STATUS_LINE(BadGateway),
+	STATUS_LINE(ServiceUnavailable),
+};
+#undef STATUS_LINE
+#undef STATUS_LINE_
 #undef string_static
 
+// Headers that are the same for many responses. Rendered by response_static_init() for each combination of HEADERS_* flags.
+static struct string headers_static[HEADERS_STATIC];
+
+// Complete responses to OPTIONS requests except for the value of the Date header (for each CORS mode).
+static struct string preflight[2];
+
+// Makes the multipart boundaries of different server processes different.
+static uint64_t boundary_seed;
+
 // TODO maybe hardcode terminator chars in the code
 static const struct string version = {"HTTP/1.1", 8}, terminator = {"\r\n", 2};
 
@@ -146,6 +220,175 @@ static unsigned fibonacci(unsigned number)
 	return (fibonacci(number - 1) + fibonacci(number - 2));
 }
 
+// Returns the content of the file in the specified content coding.
+static struct string response_file_content(const struct file_info *file_info, int encoding)
+{
+	switch (encoding)
+	{
+	case RESPONSE_DEFLATE:
+		return string(file_info->variants[STORAGE_DEFLATE].buffer, file_info->variants[STORAGE_DEFLATE].size);
+	case RESPONSE_GZIP:
+		return string(file_info->variants[STORAGE_GZIP].buffer, file_info->variants[STORAGE_GZIP].size);
+	default:
+		return string(file_info->buffer, file_info->size);
+	}
+}
+
+// Selects content coding according to Accept-Encoding.
+static int response_encoding(const struct http_request *request)
+{
+	struct string *header = request->headers_known[HEADER_ACCEPT_ENCODING];
+	struct string *list;
+	size_t allow, deny, index;
+	int encoding = RESPONSE_IDENTITY;
+
+	if (!header) return RESPONSE_IDENTITY;
+	if (http_parse_accept(header, &list, &allow, &deny)) return RESPONSE_IDENTITY; // the header is ignored if it is not valid
+
+	// The allowed codings are sorted by priority.
+	for(index = 0; index < allow; ++index)
+	{
+		const char *name = list[index].data;
+		if (!strcasecmp(name, "gzip") || !strcasecmp(name, "x-gzip"))
+		{
+			encoding = RESPONSE_GZIP;
+			break;
+		}
+		if (!strcmp(name, "*"))
+		{
+			// Any coding that is not explicitly denied is acceptable.
+			bool gzip = true, deflate = true;
+			size_t denied;
+			for(denied = allow; denied < allow + deny; ++denied)
+			{
+				if (!strcasecmp(list[denied].data, "gzip") || !strcasecmp(list[denied].data, "x-gzip")) gzip = false;
+				else if (!strcasecmp(list[denied].data, "deflate")) deflate = false;
+			}
+			if (gzip) encoding = RESPONSE_GZIP;
+			else if (deflate) encoding = RESPONSE_DEFLATE;
+			break;
+		}
+		if (!strcasecmp(name, "deflate"))
+		{
+			encoding = RESPONSE_DEFLATE;
+			break;
+		}
+		if (!strcasecmp(name, "identity")) break;
+	}
+
+	for(index = 0; index < allow + deny; ++index) free(list[index].data);
+	free(list);
+
+	return encoding;
+}
+
+// Formats a strong entity tag for the file version in the specified content coding.
+static struct string response_etag(char buffer[restrict ETAG_LENGTH_MAX], const struct file_info *file_info, int encoding)
+{
+	char *position = buffer;
+	*position++ = '"';
+	position = format_uint(position, file_info->version, 10);
+	if (encoding == RESPONSE_GZIP) position = format_bytes(position, "-gzip", sizeof("-gzip") - 1);
+	else if (encoding == RESPONSE_DEFLATE) position = format_bytes(position, "-deflate", sizeof("-deflate") - 1);
+	*position++ = '"';
+	return string(buffer, position - buffer);
+}
+
+// Returns whether the conditional headers of the request show that the client has the current representation.
+static bool response_not_modified(const struct http_request *request, const struct string *etag, time_t modified)
+{
+	struct string *header;
+
+	if ((request->method != METHOD_GET) && (request->method != METHOD_HEAD)) return false;
+
+	// If-Modified-Since is ignored when If-None-Match is present.
+	if (header = request->headers_known[HEADER_IF_NONE_MATCH]) return http_parse_etag_match(header, etag);
+	if (header = request->headers_known[HEADER_IF_MODIFIED_SINCE])
+	{
+		time_t since = http_parse_date(header->data, header->length);
+		return ((since >= 0) && (modified <= since));
+	}
+
+	return false;
+}
+
+// Serializes the response to a GET request for the whole file. The value of the Date header is left for the caller.
+static struct storage_response *response_serialize(const struct http_response *restrict response, const struct string *restrict content)
+{
+	static const struct string content_length = string("Content-Length: "), date = string("Date: ");
+	const struct string *status_line = status_lines + OK;
+	size_t headers_length = response->headers_end - response->headers;
+	struct storage_response *result;
+	char *position;
+
+	result = malloc(sizeof(*result) + status_line->length + headers_length + content_length.length + SIZE_LENGTH_MAX + 2 + date.length + HTTP_DATE_LENGTH + 4 + content->length);
+	if (!result) return 0;
+
+	position = format_bytes(result->data, status_line->data, status_line->length);
+	position = format_bytes(position, response->headers, headers_length);
+	position = format_bytes(position, content_length.data, content_length.length);
+	position = format_uint(position, content->length, 10);
+	position = format_bytes(position, terminator.data, terminator.length);
+	position = format_bytes(position, date.data, date.length);
+	result->date_offset = position - result->data;
+	position += HTTP_DATE_LENGTH;
+	position = format_bytes(position, "\r\n\r\n", 4);
+	position = format_bytes(position, content->data, content->length);
+	result->length = position - result->data;
+
+	return result;
+}
+
+// Sends the complete response to a GET request for the whole file with a single write.
+// The response is serialized once for each version and variant. When the time changes, the cached response is copied with the new Date.
+// Returns ERROR_MEMORY without sending anything if there is not enough memory to cache the response.
+static int response_cached_send(struct stream *restrict stream, struct http_response *restrict response, struct file_info *restrict file_info, int encoding, bool pinned, bool cors)
+{
+	unsigned variant = ((encoding - RESPONSE_IDENTITY) * 2 + pinned) * 2 + cors;
+	struct storage_response *cached;
+	struct string data;
+	time_t now = time(0);
+	int status;
+
+	cached = storage_response_get(file_info, variant);
+	if (!cached || (cached->date != now))
+	{
+		struct storage_response *update;
+		char date[HTTP_DATE_LENGTH + 1];
+
+		if (cached)
+		{
+			update = malloc(sizeof(*update) + cached->length);
+			if (update) memcpy(update, cached, sizeof(*update) + cached->length);
+			storage_response_release(cached);
+		}
+		else
+		{
+			struct string content = response_file_content(file_info, encoding);
+			update = response_serialize(response, &content);
+		}
+		if (!update) return ERROR_MEMORY;
+
+		http_date(date, now);
+		memcpy(update->data + update->date_offset, date, HTTP_DATE_LENGTH);
+		update->date = now;
+		update->links = 2; // one for the cache and one for this function
+
+		storage_response_set(file_info, variant, update);
+		cached = update;
+	}
+
+	response->code = OK;
+	response->content_encoding = encoding;
+
+	data = string(cached->data, cached->length);
+	status = stream_write(stream, &data);
+	if (!status) status = stream_write_flush(stream);
+
+	storage_response_release(cached);
+	return status;
+}
+
 // TODO: fix path generation, etc.
 int handler_static(struct http_request *restrict request, struct http_response *restrict response, struct resources *restrict resources)
 {
@@ -161,12 +404,35 @@ int handler_static(struct http_request *restrict request, struct http_response *
 	//char buffer[64], *end = format_uint(buffer, result, 10);
 	//*end++ = '\n';
 
+	// The path names the article.
+	if ((request->path.length <= sizeof(ARTICLE_PATH) - 1) || memcmp(request->path.data, ARTICLE_PATH, sizeof(ARTICLE_PATH) - 1)) return NotFound;
+	struct string name = string(request->path.data + sizeof(ARTICLE_PATH) - 1, request->path.length - (sizeof(ARTICLE_PATH) - 1));
+
 	if (request->method == METHOD_POST)
 	{
-		off_t length = content_length(&request->headers);
-		if (length < 0) ; // TODO
-		response->code = OK;
-		return storage_set(&request->path, &resources->stream, length); // TODO check for error
+		int status;
+
+		// Versions are numbered by the server so a path that names a version can not be written.
+		if (!storage_name_valid(&name)) return BadRequest;
+
+		// Transfer-Encoding takes precedence over Content-Length. The only supported coding is chunked.
+		struct string *encoding = request->headers_known[HEADER_TRANSFER_ENCODING];
+		if (encoding)
+		{
+			if ((encoding->length != sizeof("chunked") - 1) || strncasecmp(encoding->data, "chunked", encoding->length)) return NotImplemented;
+			status = storage_set(&name, &resources->stream, STORAGE_CHUNKED);
+		}
+		else
+		{
+			off_t length = content_length(request);
+			if (length < 0) return LengthRequired;
+			status = storage_set(&name, &resources->stream, length);
+		}
+
+		// Malformed chunked body.
+		if (status == ERROR_INPUT) return BadRequest;
+		if (!status) response->code = OK;
+		return status;
 	}
 	else
 	{
@@ -178,16 +444,86 @@ int handler_static(struct http_request *restrict request, struct http_response *
 		if (!path) return -1; // memory error
 		*/
 
-		int status;
+		int status = 0;
+		bool pinned = false;
+		unsigned version;
+
+		// A path that ends with a version number refers to that version of the article.
+		for(index = name.length; index && isdigit(name.data[index - 1]); --index)
+			;
+		if ((index > 1) && (index < name.length) && (name.length - index <= VERSION_DIGITS_MAX) && (name.data[index - 1] == '/'))
+		{
+			version = strtoul(name.data + index, 0, 10);
+			name.length = index - 1;
+			pinned = true;
+		}
 
 		//struct file_info *file_info = storage_file_info(&request->path);
-		struct file_info *file_info = storage_get(&request->path);
+		struct file_info *file_info = (pinned ? storage_get_version(&name, version) : storage_get(&name));
+		if (!file_info) return NotFound;
+
+		int encoding = (file_info->variants[STORAGE_GZIP].buffer ? response_encoding(request) : RESPONSE_IDENTITY);
+		struct string content = response_file_content(file_info, encoding);
+		char etag_buffer[ETAG_LENGTH_MAX], modified[HTTP_DATE_LENGTH + 1];
+		struct string key, value, etag = response_etag(etag_buffer, file_info, encoding);
+
+		// Clients must check whether the latest version changed. Pinned versions never change.
+		if (file_info->variants[STORAGE_GZIP].buffer)
+		{
+			key = string("Vary");
+			value = string("Accept-Encoding");
+			response_header_add(response, &key, &value);
+		}
+		key = string("ETag");
+		response_header_add(response, &key, &etag);
+		key = string("Cache-Control");
+		if (pinned) value = string("public, max-age=31536000, immutable");
+		else value = string("no-cache");
+		response_header_add(response, &key, &value);
+
+		if (response_not_modified(request, &etag, file_info->modified))
+		{
+			response->code = NotModified;
+			if (!response_headers_send(&resources->stream, request, response, content.length)) status = -1;
+			storage_release(file_info);
+			return status;
+		}
+
+		if (encoding != RESPONSE_IDENTITY)
+		{
+			key = string("Content-Encoding");
+			if (encoding == RESPONSE_GZIP) value = string("gzip");
+			else value = string("deflate");
+			response_header_add(response, &key, &value);
+		}
+		http_date(modified, file_info->modified);
+		key = string("Last-Modified");
+		value = string(modified, HTTP_DATE_LENGTH);
+		response_header_add(response, &key, &value);
+
+		// Small files are sent from the cache of serialized responses when the response does not depend on the request.
+		// The headers so far depend only on the content coding, on whether the version is pinned and on whether the request is cross-origin (see request_serve()).
+		if (!request->http2 && (request->method == METHOD_GET) && !request->headers_known[HEADER_RANGE] && (content.length <= RESPONSE_CACHE_MAX))
+		{
+			status = response_cached_send(&resources->stream, response, file_info, encoding, pinned, (request->headers_known[HEADER_ORIGIN] != 0));
+			if (status != ERROR_MEMORY)
+			{
+				storage_release(file_info);
+				return status;
+			}
+		}
 
 		response->code = OK;
-		if (!response_headers_send(&resources->stream, request, response, file_info->size))
+		if (!response_headers_send(&resources->stream, request, response, content.length))
+		{
+			storage_release(file_info);
 			return -1;
+		}
 		if (response->content_encoding) // if response body is required
-			status = response_entity_send(&resources->stream, response, file_info->buffer, file_info->size);
+		{
+			response->content_encoding = encoding;
+			status = response_entity_send_file(&resources->stream, response, file_info);
+		}
 		/*if (!response_headers_send(&resources->stream, request, response, end - buffer))
 			return -1;
 		if (response->content_encoding) // if response body is required
@@ -259,10 +595,9 @@ int handler_dynamic(struct http_request *restrict request, struct http_response
 	return status;
 }
 
-off_t content_length(const struct dict *restrict headers)
+off_t content_length(const struct http_request *restrict request)
 {
-	struct string key = string("content-length");
-	struct string *content_length = dict_get(headers, &key);
+	struct string *content_length = request->headers_known[HEADER_CONTENT_LENGTH];
 	if (!content_length) return ERROR_MISSING;
 
 	char *end;
@@ -367,6 +702,79 @@ off_t content_length(const struct dict *restrict headers)
 	return result;
 }*/
 
+bool response_static_init(const struct string *server)
+{
+	static const struct string cors = string("Access-Control-Allow-Origin: *\r\n"), expose = string("Access-Control-Expose-Headers: Server, UUID\r\n");
+	static const struct string options = string(
+		"Access-Control-Allow-Headers: Cache-Control, X-Requested-With, Filename, Filesize, Content-Type, Content-Length, Authorization, Range\r\n"
+		"Access-Control-Allow-Methods: GET, POST, OPTIONS, PUT, DELETE, SUBSCRIBE, NOTIFY\r\n"
+	);
+	static const struct string empty = string("Content-Length: 0\r\nDate: ");
+	static char buffer[(HEADERS_STATIC + 2) * 512]; // enough for the longest server name allowed
+
+	const struct string server_header = string("Server: ");
+	char *end = buffer;
+	unsigned flags;
+
+	if (server->length > 128) return false;
+
+	boundary_seed = ((uint64_t)time(0) << 32) ^ (uint64_t)getpid();
+
+	for(flags = 0; flags < HEADERS_STATIC; ++flags)
+	{
+		headers_static[flags].data = end;
+		end = format_bytes(end, server_header.data, server_header.length);
+		end = format_bytes(end, server->data, server->length);
+		end = format_bytes(end, terminator.data, terminator.length);
+		if (flags & HEADERS_CORS)
+		{
+			end = format_bytes(end, cors.data, cors.length);
+			end = format_bytes(end, expose.data, expose.length);
+		}
+		if (flags & HEADERS_OPTIONS)
+		{
+			if (!(flags & HEADERS_CORS)) end = format_bytes(end, expose.data, expose.length);
+			end = format_bytes(end, options.data, options.length);
+		}
+		headers_static[flags].length = end - headers_static[flags].data;
+	}
+
+	// The answer to an OPTIONS request is the same except for the date.
+	for(flags = 0; flags < 2; ++flags)
+	{
+		const struct string *headers = headers_static + (HEADERS_OPTIONS | (flags ? HEADERS_CORS : 0));
+		preflight[flags].data = end;
+		end = format_bytes(end, status_lines[OK].data, status_lines[OK].length);
+		end = format_bytes(end, headers->data, headers->length);
+		end = format_bytes(end, empty.data, empty.length);
+		preflight[flags].length = end - preflight[flags].data;
+	}
+
+	return true;
+}
+
+void response_headers_static(struct http_response *restrict response, unsigned flags)
+{
+	response->headers_end = format_bytes(response->headers, headers_static[flags].data, headers_static[flags].length);
+}
+
+bool response_preflight_send(struct stream *restrict stream, struct http_response *restrict response, bool cors)
+{
+	char date[HTTP_DATE_LENGTH + 4];
+	struct string fragment = string(date, sizeof(date));
+
+	http_date(date, time(0));
+	memcpy(date + HTTP_DATE_LENGTH, "\r\n\r\n", 4);
+
+	response->content_encoding = 0;
+	if (stream_write(stream, preflight + cors) || stream_write(stream, &fragment) || stream_write_flush(stream))
+	{
+		stream_term(stream);
+		return false;
+	}
+	return true;
+}
+
 bool response_header_add(struct http_response *restrict response, const struct string *key, const struct string *value)
 {
 	// Make sure there is enough space left in the buffer.
@@ -383,6 +791,108 @@ bool response_header_add(struct http_response *restrict response, const struct s
 	return true;
 }
 
+// Compressor state for chunked responses.
+struct response_compressor
+{
+	z_stream z;
+	int encoding; // content coding for which the state is initialized (0 if it is not initialized)
+};
+
+// State of a thread that sends responses. Each chunked response sent by the thread reuses it.
+struct response_worker
+{
+	struct response_compressor compressor;
+	char buffer[RESPONSE_WRITER_BUFFER]; // collects the data of a response writer
+};
+
+static pthread_key_t worker_key;
+static pthread_once_t worker_once = PTHREAD_ONCE_INIT;
+static bool worker_ready;
+
+static void response_worker_free(void *argument)
+{
+	struct response_worker *worker = argument;
+	if (worker->compressor.encoding) deflateEnd(&worker->compressor.z);
+	free(worker);
+}
+
+static void response_worker_key(void)
+{
+	worker_ready = !pthread_key_create(&worker_key, response_worker_free);
+}
+
+// Returns the state of the current thread or 0 on error.
+static struct response_worker *response_worker(void)
+{
+	struct response_worker *worker;
+
+	pthread_once(&worker_once, response_worker_key);
+	if (!worker_ready) return 0;
+
+	worker = pthread_getspecific(worker_key);
+	if (!worker)
+	{
+		worker = malloc(sizeof(*worker));
+		if (!worker) return 0;
+		worker->compressor.encoding = 0;
+		if (pthread_setspecific(worker_key, worker))
+		{
+			free(worker);
+			return 0;
+		}
+	}
+
+	return worker;
+}
+
+// Returns the compressor of the current thread prepared for a new response or 0 on error.
+static struct response_compressor *response_compressor(int encoding)
+{
+	struct response_worker *worker = response_worker();
+	struct response_compressor *compressor;
+
+	if (!worker) return 0;
+	compressor = &worker->compressor;
+
+	// Reuse the allocated state if possible. zlib and gzip format need different initialization.
+	if ((compressor->encoding == encoding) && (deflateReset(&compressor->z) == Z_OK)) return compressor;
+
+	if (compressor->encoding) deflateEnd(&compressor->z);
+	compressor->encoding = 0;
+	memset(&compressor->z, 0, sizeof(compressor->z));
+	if (deflateInit2(&compressor->z, RESPONSE_COMPRESS_LEVEL, Z_DEFLATED, MAX_WBITS + ((encoding == RESPONSE_GZIP) ? 16 : 0), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	compressor->encoding = encoding;
+
+	return compressor;
+}
+
+// Returns a boundary for a multipart/byteranges response. Responses in progress at the same time get different boundaries.
+static uint64_t response_boundary(const struct http_response *response)
+{
+	// Scramble the value so that the boundary is not predictable from the content.
+	uint64_t value = boundary_seed ^ ((uint64_t)(uintptr_t)response->ranges << 16) ^ (uint64_t)time(0);
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+	return value ^ (value >> 31);
+}
+
+// Formats the boundary delimiter and the headers that precede a part of a multipart/byteranges entity body.
+// Returns the end of the formatted data.
+static char *response_part_start(char *restrict buffer, const struct http_response *response, size_t index, off_t total)
+{
+	static const struct string range = string("\r\nContent-Range: bytes ");
+	buffer = format_bytes(buffer, "\r\n--", 4);
+	buffer = format_uint_pad(buffer, response->boundary, 16, BOUNDARY_LENGTH, '0');
+	buffer = format_bytes(buffer, range.data, range.length);
+	buffer = format_uint(buffer, response->ranges[index][0], 10);
+	*buffer++ = '-';
+	buffer = format_uint(buffer, response->ranges[index][1], 10);
+	*buffer++ = '/';
+	buffer = format_uint(buffer, total, 10);
+	return format_bytes(buffer, "\r\n\r\n", 4);
+}
+
 bool response_headers_send(struct stream *restrict stream, const struct http_request *request, struct http_response *restrict response, off_t length)
 {
 	struct string key, value;
@@ -399,23 +909,14 @@ bool response_headers_send(struct stream *restrict stream, const struct http_req
 		content = RESPONSE_IDENTITY;
 
 		// TODO: 415 UnsupportedMediaType should be returned in some cases here
-		// TODO: support compression
-
-		/*key = string("accept-encoding");
-		struct string *header = dict_get(&request->headers, &key);
-		if (header)
+		// Chunked responses are compressed as they are sent if the client accepts it.
+		// Handlers that have compressed content select the content coding themselves (see response_encoding()).
+		if (length == RESPONSE_CHUNKED)
 		{
-			struct string *list;
-			size_t allow, deny;
-			int status = http_parse_accept(header, &list, &allow, &deny);
-			// TODO: find the best encoding
-			free(list);
+			content = response_encoding(request);
+			if ((content != RESPONSE_IDENTITY) && !(response->compressor = response_compressor(content)))
+				content = RESPONSE_IDENTITY; // send uncompressed if the compressor is not available
 		}
-		else ; // TODO: identity
-
-		key = string("Content-Encoding");
-		value = string("deflate");
-		response_header_add(response, &key, &value);*/
 
 		response->index = 0;
 		response->length = length;
@@ -427,6 +928,19 @@ bool response_headers_send(struct stream *restrict stream, const struct http_req
 		key = string("Transfer-Encoding");
 		value = string("chunked");
 		if (!response_header_add(response, &key, &value)) goto error; // memory error
+
+		if (content)
+		{
+			key = string("Vary");
+			value = string("Accept-Encoding");
+			if (!response_header_add(response, &key, &value)) goto error; // memory error
+		}
+		if (response->compressor)
+		{
+			key = string("Content-Encoding");
+			value = ((content == RESPONSE_GZIP) ? string("gzip") : string("deflate"));
+			if (!response_header_add(response, &key, &value)) goto error; // memory error
+		}
 	}
 	else
 	{
@@ -434,31 +948,53 @@ bool response_headers_send(struct stream *restrict stream, const struct http_req
 		struct string *range;
 
 		// Take care of ranges.
-		key = string("range");
-		if ((response->code == OK) && (range = dict_get(&request->headers, &key)))
+		if ((response->code == OK) && (range = request->headers_known[HEADER_RANGE]))
 		{
 			if (status = http_parse_range(range->data, length, &response->ranges, &response->intervals)) return false; // TODO return status;
 
-			// TODO: support multipart/byteranges and remove this
-			if (response->intervals > 1) return false; // TODO return RequestedRangeNotSatisfiable; // TODO this return value is not right
-
-			// Content-Range
-			// bytes <low>-<high>/<total>
-			char buffer[sizeof("bytes ") - 1 + SIZE_LENGTH_MAX + 1 + SIZE_LENGTH_MAX + 1 + SIZE_LENGTH_MAX] = "bytes ", *start = buffer + sizeof("bytes ") - 1;
-			start = format_uint(start, response->ranges[0][0], 10);
-			*start++ = '-';
-			start = format_uint(start, response->ranges[0][1], 10);
-			*start++ = '/';
-			start = format_uint(start, length, 10);
-			key = string("Content-Range");
-			value = string(buffer, start - buffer);
-			if (!response_header_add(response, &key, &value)) goto error; // memory error
+			if (response->intervals > 1)
+			{
+				// Each part of the entity body is preceded by its own Content-Range header.
+				char part[PART_START_LENGTH_MAX];
+				char type[sizeof("multipart/byteranges; boundary=") - 1 + BOUNDARY_LENGTH] = "multipart/byteranges; boundary=";
+				off_t size = PART_END_LENGTH;
+				size_t index;
+
+				response->boundary = response_boundary(response);
+				for(index = 0; index < response->intervals; ++index)
+				{
+					size += response_part_start(part, response, index, length) - part;
+					size += response->ranges[index][1] - response->ranges[index][0] + 1;
+				}
+
+				format_uint_pad(type + sizeof(type) - BOUNDARY_LENGTH, response->boundary, 16, BOUNDARY_LENGTH, '0');
+				key = string("Content-Type");
+				value = string(type, sizeof(type));
+				if (!response_header_add(response, &key, &value)) goto error; // memory error
+
+				length = size;
+			}
+			else
+			{
+				// Content-Range
+				// bytes <low>-<high>/<total>
+				char buffer[sizeof("bytes ") - 1 + SIZE_LENGTH_MAX + 1 + SIZE_LENGTH_MAX + 1 + SIZE_LENGTH_MAX] = "bytes ", *start = buffer + sizeof("bytes ") - 1;
+				start = format_uint(start, response->ranges[0][0], 10);
+				*start++ = '-';
+				start = format_uint(start, response->ranges[0][1], 10);
+				*start++ = '/';
+				start = format_uint(start, length, 10);
+				key = string("Content-Range");
+				value = string(buffer, start - buffer);
+				if (!response_header_add(response, &key, &value)) goto error; // memory error
+
+				length = response->ranges[0][1] - response->ranges[0][0] + 1;
+			}
 
 			key = string("Accept-Ranges");
 			value = string("bytes");
 			if (!response_header_add(response, &key, &value)) goto error; // memory error
 
-			length = response->ranges[0][1] - response->ranges[0][0] + 1;
 			response->code = PartialContent;
 		}
 
@@ -474,37 +1010,9 @@ bool response_headers_send(struct stream *restrict stream, const struct http_req
 	value = string(date, HTTP_DATE_LENGTH);
 	if (!response_header_add(response, &key, &value)) goto error; // memory error
 
-	// Make sure response code is valid. Find appropriate response phrase.
-	struct string phrase;
-	#define PHRASE_SET(status) case (status): \
-		phrase = string(PHRASE_ ## status); \
-		break
-	#define PHRASE(status) PHRASE_SET(status)
-	switch (response->code)
-	{
-		PHRASE(OK);
-		PHRASE(NoContent);
-		PHRASE(PartialContent);
-		PHRASE(MovedPermanently);
-		PHRASE(NotModified);
-		PHRASE(BadRequest);
-		PHRASE(Forbidden);
-		PHRASE(NotFound);
-		PHRASE(MethodNotAllowed);
-		PHRASE(RequestTimeout);
-		PHRASE(LengthRequired);
-		PHRASE(RequestEntityTooLarge);
-		PHRASE(RequestURITooLong);
-		PHRASE(UnsupportedMediaType);
-		PHRASE(RequestedRangeNotSatisfiable);
-		PHRASE(InternalServerError);
-		PHRASE(NotImplemented);
-		PHRASE(ServiceUnavailable);
-	default: // TODO is this necessary? should it really just return false?
+	// Make sure response code is valid.
+	if ((response->code >= sizeof(status_lines) / sizeof(*status_lines)) || !status_lines[response->code].data)
 		goto error; // invalid response code
-	}
-	#undef PHRASE
-	#undef PHRASE_SET
 
 #if defined(DEBUG)
 	if (request->URI.data)
@@ -517,20 +1025,20 @@ bool response_headers_send(struct stream *restrict stream, const struct http_req
 	}
 #endif
 
-	char line[64]; // TODO make sure this is enough
-	char *end = line;
 	struct string fragment;
 
-	// HTTP/1.1 code phrase\r\n
-	end = format_bytes(end, version.data, version.length);
-	*end++ = ' ';
-	end = format_uint_pad(end, response->code, 10, HTTP_CODE_LENGTH, 0);
-	*end++ = ' ';
-	end = format_bytes(end, phrase.data, phrase.length);
-	end = format_bytes(end, terminator.data, terminator.length);
+	// HTTP/2 responses have no status line. The end of the response is marked by the stream.
+	if (response->http2)
+	{
+		if (http2_headers_send(response->http2, response->code, response->headers, response->headers_end - response->headers, !content || !length)) return false;
+		response->content_encoding = content;
+		return true;
+	}
+
+	// Hold the headers in the kernel until the entity body is written so that they are sent in the same segments.
+	if (content && length) stream_cork(stream, true);
 
-	fragment = string(line, end - line);
-	if (status = stream_write(stream, &fragment))
+	if (status = stream_write(stream, status_lines + response->code))
 		goto error;
 
 	fragment = string(response->headers, response->headers_end - response->headers);
@@ -549,52 +1057,300 @@ error:
 	return false; // memory error // TODO or invalid response code
 }
 
+// Determines which part of the data to send as response entity body. Returns false if no part of the data should be sent.
+static bool response_entity_part(struct http_response *restrict response, struct string *restrict content)
+{
+	if (response->ranges)
+	{
+		off_t length = content->length;
+
+		// Find which part of the data to send.
+		off_t start = response->ranges[0][0] - response->index;
+		response->index += length;
+		if (start >= length) return false; // no entity body to send
+		if (start > 0)
+		{
+			content->data += start;
+			length -= start;
+		}
+		off_t size = response->ranges[0][1] + 1 - response->ranges[0][0];
+		if (start < 0)
+		{
+			size += start;
+			if (size <= 0) return false; // no entity body to send
+		}
+		if (size > length) size = length;
+		content->length = size;
+	}
+
+	return true;
+}
+
+// Appends data to the entity body.
+static int response_write(struct stream *restrict stream, struct http_response *restrict response, const struct string *buffer, bool end)
+{
+	if (response->http2) return http2_data_send(response->http2, buffer->data, buffer->length, end);
+	return stream_write(stream, buffer);
+}
+
+static void response_file_release(void *argument)
+{
+	storage_release(argument);
+}
+
+// Sends the parts of a multipart/byteranges entity body that are in the data. The data continues from where the previous call left off.
+// Parts of file content are sent without copying them when ZEROCOPY is enabled and they are large enough.
+static int response_parts_send(struct stream *restrict stream, struct http_response *restrict response, const char *data, off_t length, struct file_info *restrict file_info)
+{
+	char buffer[PART_START_LENGTH_MAX];
+	struct string part;
+	off_t offset = response->index, end = offset + length, last = response->ranges[response->intervals - 1][1];
+	size_t index;
+	int status;
+
+	response->index = end;
+
+	for(index = 0; index < response->intervals; ++index)
+	{
+		off_t low = response->ranges[index][0], high = response->ranges[index][1] + 1;
+		if (high <= offset) continue;
+		if (low >= end) break;
+
+		// Start the part if this is its first byte.
+		if (low >= offset)
+		{
+			part = string(buffer, response_part_start(buffer, response, index, response->length) - buffer);
+			if (status = response_write(stream, response, &part, false)) return status;
+		}
+		else low = offset;
+		if (high > end) high = end;
+
+		part = string((char *)data + (low - offset), high - low); // TODO fix this cast
+#if defined(ZEROCOPY)
+		if (file_info && !response->http2 && (part.length >= ZEROCOPY_MIN))
+		{
+			// The mapping must stay until the kernel completes the transmission.
+			storage_retain(file_info);
+			status = stream_write_zerocopy(stream, &part, response_file_release, file_info);
+		}
+		else
+#endif
+			status = response_write(stream, response, &part, false);
+		if (status) return status;
+	}
+
+	// Close the multipart body after the last part.
+	if ((offset <= last) && (last < end))
+	{
+		char *position = format_bytes(buffer, "\r\n--", 4);
+		position = format_uint_pad(position, response->boundary, 16, BOUNDARY_LENGTH, '0');
+		position = format_bytes(position, "--\r\n", 4);
+		part = string(buffer, position - buffer);
+		if (status = response_write(stream, response, &part, true)) return status;
+	}
+
+	return (response->http2 ? 0 : stream_write_flush(stream));
+}
+
+// Sends a chunk of entity body with chunked transfer coding (as DATA frame for HTTP/2). An empty chunk completes the response.
+static int response_chunk_send(struct stream *restrict stream, struct http_response *restrict response, const char *restrict data, size_t length)
+{
+	char buffer[SIZE_LENGTH_MAX + 2], *start;
+	int status;
+
+	if (response->http2) return http2_data_send(response->http2, data, length, !length);
+
+	start = format_uint(buffer, (uintmax_t)length, 16);
+	*start++ = terminator.data[0];
+	*start++ = terminator.data[1];
+
+	// Chunk size, chunk data and the line terminator are written together.
+	struct string chunk[] = {
+		string(buffer, start - buffer),
+		string((char *)data, length), // TODO fix this cast
+		terminator,
+	};
+	status = stream_write_vector(stream, chunk, sizeof(chunk) / sizeof(*chunk));
+
+	// The last chunk completes the response.
+	if (!length && !status && !(status = stream_write_flush(stream)))
+		return stream_cork(stream, false);
+	return (status ? status : stream_write_flush(stream));
+}
+
+// Compresses data and sends the compressed output as chunks. Empty data completes the response.
+// With RESPONSE_FLUSH_RATIO output is sent when a buffer of it is ready. With RESPONSE_FLUSH_LATENCY the data is sent right away.
+static int response_compress_send(struct stream *restrict stream, struct http_response *restrict response, const char *restrict data, size_t length)
+{
+	z_stream *z = &response->compressor->z;
+	char buffer[RESPONSE_COMPRESS_BUFFER];
+	size_t index = 0;
+	int flush, status;
+
+	do
+	{
+		// zlib takes sizes as unsigned int.
+		size_t size = length - index;
+		if (size > UINT_MAX) size = UINT_MAX;
+		z->next_in = (unsigned char *)data + index; // TODO fix this cast
+		z->avail_in = size;
+		index += size;
+
+		if (!length) flush = Z_FINISH;
+		else if ((index < length) || (response->flush == RESPONSE_FLUSH_RATIO)) flush = Z_NO_FLUSH;
+		else flush = Z_SYNC_FLUSH;
+
+		// Output that fills the buffer means that there may be more.
+		do
+		{
+			z->next_out = buffer;
+			z->avail_out = sizeof(buffer);
+			if (deflate(z, flush) == Z_STREAM_ERROR) return ERROR_MEMORY;
+			if ((z->avail_out < sizeof(buffer)) && (status = response_chunk_send(stream, response, buffer, sizeof(buffer) - z->avail_out)))
+				return status;
+		} while (!z->avail_out);
+	} while (index < length);
+
+	return (length ? 0 : response_chunk_send(stream, response, "", 0));
+}
+
 int response_entity_send(struct stream *restrict stream, struct http_response *restrict response, const char *restrict data, off_t length)
 {
 	// Do nothing if no entity body is required.
 	if (!response->content_encoding) return 0;
 
+	if (response->length == RESPONSE_CHUNKED)
+	{
+		if (response->compressor) return response_compress_send(stream, response, data, length);
+		return response_chunk_send(stream, response, data, length);
+	}
+
+	if (response->intervals > 1) return response_parts_send(stream, response, data, length, 0);
+
 	struct string content = string((char *)data, length); // TODO fix this cast
 	int status;
 
-	if (response->length == RESPONSE_CHUNKED)
+	if (!response_entity_part(response, &content)) return 0;
+
+	if (response->http2)
 	{
-		char buffer[SIZE_LENGTH_MAX + 2], *start;
-		start = format_uint(buffer, (uintmax_t)length, 16);
-		*start++ = terminator.data[0];
-		*start++ = terminator.data[1];
-		struct string size = string(buffer, start - buffer);
-
-		status = stream_write(stream, &size);
-		if (!status) status = stream_write(stream, &content);
-		if (!status) status = stream_write(stream, &terminator);
+		// Mark the end of the stream with the last data if possible.
+		bool end = (response->ranges ? (response->index > response->ranges[0][1]) : (length == response->length));
+		return http2_data_send(response->http2, content.data, content.length, end);
 	}
-	else
+
+	status = stream_write(stream, &content);
+	return (status ? status : stream_write_flush(stream));
+}
+
+// Sends the response headers for an entity body of the specified length (or RESPONSE_CHUNKED).
+static int response_writer_headers(struct response_writer *restrict writer, off_t length)
+{
+	writer->started = true;
+	if (!response_headers_send(writer->stream, writer->request, writer->response, length)) writer->status = ERROR_MEMORY;
+	return writer->status;
+}
+
+bool response_writer_start(struct response_writer *restrict writer, struct stream *restrict stream, const struct http_request *request, struct http_response *restrict response)
+{
+	struct response_worker *worker;
+
+	// Without the buffer of the thread each append is sent as a separate chunk.
+	// With RESPONSE_FLUSH_LATENCY the buffer is not used so that each append reaches the client right away.
+	worker = ((response->flush == RESPONSE_FLUSH_RATIO) ? response_worker() : 0);
+	writer->stream = stream;
+	writer->request = request;
+	writer->response = response;
+	writer->buffer = (worker ? worker->buffer : 0);
+	writer->length = 0;
+	writer->status = 0;
+	writer->started = false;
+
+	// With the buffer, the headers are sent when it is known whether the body is long enough to compress it.
+	return (writer->buffer || !response_writer_headers(writer, RESPONSE_CHUNKED));
+}
+
+// Sends the buffered data as a chunk.
+static int response_writer_flush(struct response_writer *restrict writer)
+{
+	if (!writer->started && response_writer_headers(writer, RESPONSE_CHUNKED)) return writer->status;
+	if (writer->length && !writer->status)
+		writer->status = response_entity_send(writer->stream, writer->response, writer->buffer, writer->length);
+	writer->length = 0;
+	return writer->status;
+}
+
+int response_writer_append(struct response_writer *restrict writer, const char *restrict data, size_t length)
+{
+	size_t available;
+
+	if (writer->status || !writer->response->content_encoding || !length) return writer->status;
+
+	if (writer->buffer)
 	{
-		// TODO support response->intervals > 1
+		// Fill the buffer and send it when it is full.
+		available = RESPONSE_WRITER_BUFFER - writer->length;
+		if (length < available)
+		{
+			memcpy(writer->buffer + writer->length, data, length);
+			writer->length += length;
+			return 0;
+		}
 
-		if (response->ranges)
+		memcpy(writer->buffer + writer->length, data, available);
+		writer->length += available;
+		if (response_writer_flush(writer)) return writer->status;
+		data += available;
+		length -= available;
+
+		// Data that fills the buffer again is sent without copying it.
+		if (length < RESPONSE_WRITER_BUFFER)
 		{
-			// Find which part of the data to send.
-			off_t start = response->ranges[0][0] - response->index;
-			response->index += length;
-			if (start >= length) return 0; // no entity body to send
-			if (start > 0)
-			{
-				data += start;
-				length -= start;
-			}
-			off_t size = response->ranges[0][1] + 1 - response->ranges[0][0];
-			if (start < 0)
-			{
-				size += start;
-				if (size <= 0) return 0; // no entity body to send
-			}
-			if (size > length) size = length;
-			content = string((char *)data, size); // TODO fix this cast
+			memcpy(writer->buffer, data, length);
+			writer->length = length;
+			return 0;
 		}
+	}
 
-		status = stream_write(stream, &content);
+	writer->status = response_entity_send(writer->stream, writer->response, data, length);
+	return writer->status;
+}
+
+int response_writer_end(struct response_writer *restrict writer)
+{
+	if (writer->status) return writer->status;
+
+	// A short body is sent as it is with its length known in advance.
+	if (!writer->started && (writer->length < RESPONSE_WRITER_COMPRESS_MIN))
+	{
+		if (response_writer_headers(writer, writer->length)) return writer->status;
+		return response_entity_send(writer->stream, writer->response, writer->buffer, writer->length);
 	}
-	return (status ? status : stream_write_flush(stream));
+
+	if (!writer->response->content_encoding) return 0;
+	if (response_writer_flush(writer)) return writer->status;
+	return response_entity_send(writer->stream, writer->response, "", 0);
+}
+
+// Sends file content in the selected content coding as response entity body. Large bodies are sent without copying them to the socket buffer when ZEROCOPY is enabled.
+int response_entity_send_file(struct stream *restrict stream, struct http_response *restrict response, struct file_info *restrict file_info)
+{
+	if (!response->content_encoding) return 0;
+
+	struct string content = response_file_content(file_info, response->content_encoding);
+
+	if (response->intervals > 1) return response_parts_send(stream, response, content.data, content.length, file_info);
+
+#if defined(ZEROCOPY)
+	if ((response->length != RESPONSE_CHUNKED) && (content.length >= ZEROCOPY_MIN) && !response->http2)
+	{
+		if (!response_entity_part(response, &content)) return 0;
+
+		// The mapping must stay until the kernel completes the transmission.
+		storage_retain(file_info);
+		return stream_write_zerocopy(stream, &content, response_file_release, file_info);
+	}
+#endif
+
+	return response_entity_send(stream, response, content.data, content.length);
 }
@@ -1,4 +1,7 @@
 struct resources; // TODO: remove this
+struct file_info;
+struct http2_stream;
+struct response_compressor;
 
 #define HEADERS_LENGTH_MAX 1024
 
@@ -9,6 +12,11 @@ struct http_response
 	unsigned code;
 
 	int content_encoding;
+
+	struct response_compressor *compressor; // compresses a chunked response (0 if the response is not compressed)
+	unsigned flush; // when compressed data of a chunked response is sent
+
+	struct http2_stream *http2; // stream of an HTTP/2 response (0 for HTTP/1.1)
 	
 #if !defined(OS_WINDOWS)
 	off_t (*ranges)[2];
@@ -19,10 +27,29 @@ struct http_response
 	size_t intervals;
 	__int64 index, length;
 #endif
+	uint64_t boundary; // separates the parts of a multipart/byteranges entity body
 };
 
+// Flush policies for compressed chunked responses.
+#define RESPONSE_FLUSH_RATIO 0 /* send compressed data when there is enough of it (default) */
+#define RESPONSE_FLUSH_LATENCY 1 /* send each chunk as soon as it is compressed */
+
+// Flags that select a block of static headers.
+#define HEADERS_CORS 1 /* headers for cross-origin requests */
+#define HEADERS_OPTIONS 2 /* headers for OPTIONS requests */
+#define HEADERS_STATIC 4
+
 int http_errno_status(int error);
 
+// Renders the headers that are the same for many responses. Must be called once before any response is sent.
+bool response_static_init(const struct string *server);
+
+// Starts the response headers with a block of static headers.
+void response_headers_static(struct http_response *restrict response, unsigned flags);
+
+// Sends the complete response to an OPTIONS request.
+bool response_preflight_send(struct stream *restrict stream, struct http_response *restrict response, bool cors);
+
 //bool header_add(struct vector *restrict headers, const struct string *key, const struct string *value);
 bool response_header_add(struct http_response *restrict response, const struct string *key, const struct string *value);
 
@@ -31,10 +58,11 @@ int handler_dynamic(struct http_request *restrict request, struct http_response
 
 int response_cache(const char *restrict key, const struct http_request *request, struct http_response *restrict response, struct resources *restrict resources);
 
-off_t content_length(const struct dict *restrict headers);
+off_t content_length(const struct http_request *restrict request);
 
 bool response_headers_send(struct stream *restrict stream, const struct http_request *request, struct http_response *restrict response, off_t length);
 int response_entity_send(struct stream *restrict stream, struct http_response *restrict response, const char *restrict data, off_t length);
+int response_entity_send_file(struct stream *restrict stream, struct http_response *restrict response, struct file_info *restrict file_info);
 
 // WARNING: deprecated; use response_entity_send() instead
 #define response_content_send(stream, response, data, length) (!response_entity_send((stream), (response), (data), (length)))
@@ -42,3 +70,27 @@ int response_entity_send(struct stream *restrict stream, struct http_response *r
 #define response_chunk_last(stream, response) response_content_send((stream), (response), "", 0)
 
 #define RESPONSE_CHUNKED -1
+
+// Streams an entity body of unknown length with chunked transfer coding (compressed if the client accepts it).
+// Appended data is collected in a buffer of the thread and sent in chunks of a few KiB. A body that ends before it is 1 KiB long is sent uncompressed with Content-Length.
+// Actions that produce data slowly set response->flush to RESPONSE_FLUSH_LATENCY before starting the writer. Each append is then sent (and compressed) as soon as it is made.
+// Sending waits while the client is not accepting data, so only a bounded amount of the response is held in memory.
+struct response_writer
+{
+	struct stream *stream;
+	const struct http_request *request;
+	struct http_response *response;
+	char *buffer; // buffer of the thread (0 if it is not available)
+	size_t length; // length of the data in the buffer
+	int status; // error that stopped the response (0 if there is none)
+	bool started; // whether the response headers are sent
+};
+
+// Prepares the response. The headers are sent once the writer decides how to send the entity body. Returns false on error.
+bool response_writer_start(struct response_writer *restrict writer, struct stream *restrict stream, const struct http_request *request, struct http_response *restrict response);
+
+// Appends data to the entity body. Once an error occurs, it is returned by each call that follows.
+int response_writer_append(struct response_writer *restrict writer, const char *restrict data, size_t length);
+
+// Sends the remaining data and completes the response.
+int response_writer_end(struct response_writer *restrict writer);
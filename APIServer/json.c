@@ -35,16 +35,6 @@ SOFTWARE.
 #include "format.h"
 #include "json.h"
 
-static struct string *string_init(struct string *restrict s, const char *data, size_t length)
-{
-    s->data = malloc(sizeof(char) * (length + 1));
-    if (!s->data) return 0;
-    memcpy(s->data, data, length);
-    s->data[length] = 0;
-    s->length = length;
-    return s;
-}
-
 /* Windows DLL stuff */
 #ifdef JSON_PARSER_DLL
 #   ifdef _MSC_VER
@@ -241,6 +231,7 @@ struct json_context
 	union json *data[JSON_DEPTH_MAX];
 	size_t length;
 	struct string key;
+	struct arena *arena; // if set, nodes are allocated from it
 };
 
 #define COUNTOF(x) (sizeof(x)/sizeof(x[0])) 
@@ -1262,11 +1253,20 @@ static inline unsigned char msb_pos(unsigned char byte)
 
 // TODO: memory errors can cause memory leaks
 
+static inline void *json_alloc(const struct json_context *restrict stack, size_t size)
+{
+	return (stack->arena ? arena_alloc(stack->arena, size) : malloc(size));
+}
+
+static inline void json_release(const struct json_context *restrict stack, void *buffer)
+{
+	if (!stack->arena) free(buffer);
+}
+
 static int token_add(void *restrict context, int type, const JSON_value *value)
 {
 	struct json_context *stack = (struct json_context *)context;
-	union json *item = malloc(sizeof(union json)), *parent;
-	if (!item) return 0; // Memory error
+	union json *item, *parent;
 
 	// Get node parent
 	if (stack->length) parent = stack->data[stack->length - 1];
@@ -1275,62 +1275,68 @@ static int token_add(void *restrict context, int type, const JSON_value *value)
 	switch (type)
 	{
 		union json **node;
-	case JSON_T_NULL:
-		json_type(item) = NONE;
-		break;
-	case JSON_T_TRUE:
-		json_type(item) = BOOLEAN;
-		item->boolean = true;
-		break;
-	case JSON_T_FALSE:
-		json_type(item) = BOOLEAN;
-		item->boolean = false;
-		break;
-	case JSON_T_INTEGER:
-		json_type(item) = INTEGER;
-		item->integer = value->vu.integer_value;
-		break;
-	case JSON_T_FLOAT:
-		json_type(item) = REAL;
-		item->real = value->vu.float_value;
-		break;
+	case JSON_T_ARRAY_END:
+	case JSON_T_OBJECT_END:
+		stack->length -= 1;
+		return 1;
+	case JSON_T_KEY:
+		stack->key.length = value->vu.str.length;
+		stack->key.data = json_alloc(stack, stack->key.length + 1);
+		if (!stack->key.data) return 0; // memory error
+		*format_bytes(stack->key.data, value->vu.str.value, stack->key.length) = 0;
+		return 1;
 	case JSON_T_STRING:
-		free(item);
-		{
-			struct string entry = string((char *)value->vu.str.value, value->vu.str.length); // TODO fix this cast
-			item = json_string_old(&entry);
-		}
+		item = json_alloc(stack, sizeof(union json) + value->vu.str.length + 1);
 		if (!item) goto error; // memory error
-		break;
-	case JSON_T_ARRAY_BEGIN:
-		json_type(item) = ARRAY;
-		if (!vector_init(&item->array_node, VECTOR_SIZE_BASE)) goto error; // memory error
-		node = stack->data + stack->length;
-		*node = item;
-		stack->length += 1;
+		json_type(item) = STRING;
+		item->string_node = string((char *)(item + 1), value->vu.str.length);
+		*format_bytes(item->string_node.data, value->vu.str.value, value->vu.str.length) = 0;
 		break;
 	case JSON_T_OBJECT_BEGIN:
+		// The dictionary is stored right after the node.
+		item = json_alloc(stack, sizeof(union json) + sizeof(struct dict));
+		if (!item) goto error; // memory error
 		json_type(item) = OBJECT;
-		item->object = malloc(sizeof(struct dict));
-		if (!item->object) goto error; // memory error
-		if (!dict_init(item->object, DICT_SIZE_BASE))
-		{
-			free(item->object);
+		item->object = (struct dict *)(item + 1);
+		if (!(stack->arena ? dict_init_arena(item->object, DICT_SIZE_BASE, stack->arena) : dict_init(item->object, DICT_SIZE_BASE)))
 			goto error; // memory error
-		}
 		node = stack->data + stack->length;
 		*node = item;
 		stack->length += 1;
 		break;
-	case JSON_T_ARRAY_END:
-	case JSON_T_OBJECT_END:
-		free(item);
-		stack->length -= 1;
-		return 1;
-	case JSON_T_KEY:
-		free(item);
-		if (!string_init(&stack->key, value->vu.str.value, value->vu.str.length)) return 0; // memory error
-		return 1;
+	default:
+		item = json_alloc(stack, sizeof(union json));
+		if (!item) goto error; // memory error
+		switch (type)
+		{
+		case JSON_T_NULL:
+			json_type(item) = NONE;
+			break;
+		case JSON_T_TRUE:
+			json_type(item) = BOOLEAN;
+			item->boolean = true;
+			break;
+		case JSON_T_FALSE:
+			json_type(item) = BOOLEAN;
+			item->boolean = false;
+			break;
+		case JSON_T_INTEGER:
+			json_type(item) = INTEGER;
+			item->integer = value->vu.integer_value;
+			break;
+		case JSON_T_FLOAT:
+			json_type(item) = REAL;
+			item->real = value->vu.float_value;
+			break;
+		case JSON_T_ARRAY_BEGIN:
+			json_type(item) = ARRAY;
+			if (!(stack->arena ? vector_init_arena(&item->array_node, VECTOR_SIZE_BASE, stack->arena) : vector_init(&item->array_node, VECTOR_SIZE_BASE)))
+				goto error; // memory error
+			node = stack->data + stack->length;
+			*node = item;
+			stack->length += 1;
+			break;
+		}
 	}
 
 	if (parent)
@@ -1344,7 +1350,7 @@ static int token_add(void *restrict context, int type, const JSON_value *value)
 			break;
 		case OBJECT:
 			error = dict_add(parent->object, &stack->key, item);
-			free(stack->key.data);
+			json_release(stack, stack->key.data);
 			if (error) goto error;
 			break;
 		}
@@ -1355,8 +1361,8 @@ static int token_add(void *restrict context, int type, const JSON_value *value)
 
 error:
 	// Memory error
-	if (json_type(parent) == OBJECT) free(stack->key.data);
-	free(item);
+	if (parent && (json_type(parent) == OBJECT)) json_release(stack, stack->key.data);
+	json_release(stack, item);
 	return 0;
 }
 
@@ -1404,7 +1410,12 @@ void json_free(union json *restrict json)
 // TODO: decide how to distinguish parse error from internal server error
 union json *json_parse(const struct string *json)
 {
-	struct json_context context = {.length = 0};
+	return json_parse_arena(json, 0);
+}
+
+union json *json_parse_arena(const struct string *json, struct arena *arena)
+{
+	struct json_context context = {.length = 0, .arena = arena};
 	struct JSON_parser_struct *jc = new_JSON_parser(&token_add, &context); // TODO: memory error
 	size_t i;
 
@@ -1419,7 +1430,7 @@ union json *json_parse(const struct string *json)
 	return *context.data;
 
 error:
-	if (*context.data) json_free(*context.data);
+	if (*context.data && !arena) json_free(*context.data);
 	delete_JSON_parser(jc);
 	return 0;
 }
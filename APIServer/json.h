@@ -32,6 +32,9 @@ union json
 
 union json *json_parse(const struct string *json); // TODO split the arguments
 
+// Allocates the nodes from the arena. json_free() must not be called for the result.
+union json *json_parse_arena(const struct string *json, struct arena *arena);
+
 ssize_t json_length_string(const char *restrict data, size_t size);
 ssize_t json_length(const union json *restrict json);
 
@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -16,20 +17,23 @@
 #include "http.h"
 #include "http_parse.h"
 #include "http_response.h"
+#include "http2.h"
 
 #define LISTEN_MAX 10
 
 #define STATUS_BUFFER 64
 
 #define PORT_HTTP 8080
+#define PORT_HTTPS 8443
 
 struct connection
 {
-	enum {Listen = 1, Parse, ResponseStatic, ResponseDynamic} type;
+	enum {Listen = 1, ListenTLS, Handshake, Parse, ResponseStatic, ResponseDynamic} type;
 	struct http_context context;
 	struct resources resources;
 	size_t thread;
 	time_t activity;
+	struct stream_stats stats; // stream counters at the end of the last request
 };
 
 struct thread_pool
@@ -45,6 +49,28 @@ struct thread_pool
 
 #define THREAD_POOL_SIZE 4
 
+// I/O statistics for each request type. Each thread adds only to its own totals.
+// The totals of a thread are locked because server_stats() reads them from other threads. The lock is almost never contended.
+static struct stream_stats stats[THREAD_POOL_SIZE][REQUEST_TYPES];
+static pthread_mutex_t stats_lock[THREAD_POOL_SIZE];
+
+// HTTP/2 connections and their requests are served by threads of their own. Their number is limited across all connections.
+#define HTTP2_CONNECTIONS_MAX 32
+#define HTTP2_REQUESTS_MAX 128
+static unsigned http2_connections, http2_requests;
+
+// Reserves one of count threads of which there can be no more than limit. Returns whether a thread is reserved.
+static bool thread_reserve(unsigned *count, unsigned limit)
+{
+	if (__atomic_add_fetch(count, 1, __ATOMIC_RELAXED) <= limit) return true;
+	__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+// I/O statistics of HTTP/2 connections. Each connection has its own thread so the totals are locked.
+static struct stream_stats stats_http2;
+static pthread_mutex_t stats_http2_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct string SERVER = {"test/1.0", 8};
 
 static const struct string key_connection = {"Connection", 10}, value_close = {"close", 5};
@@ -84,11 +110,38 @@ static int init(void)
 	return 0;
 }
 
-static void response_init(struct http_response *restrict response)
+// Sums the I/O statistics of all threads.
+void server_stats(struct stream_stats total[REQUEST_TYPES])
 {
+	size_t thread, type;
+
+	memset(total, 0, sizeof(*total) * REQUEST_TYPES);
+	for(thread = 0; thread < THREAD_POOL_SIZE; ++thread)
+	{
+		pthread_mutex_lock(stats_lock + thread);
+		for(type = 0; type < REQUEST_TYPES; ++type)
+		{
+			#define STATS_SUM(name) total[type].name += stats[thread][type].name;
+			STREAM_STATS(STATS_SUM)
+			#undef STATS_SUM
+		}
+		pthread_mutex_unlock(stats_lock + thread);
+	}
+
+	pthread_mutex_lock(&stats_http2_lock);
+	total[RequestHTTP2] = stats_http2;
+	pthread_mutex_unlock(&stats_http2_lock);
+}
+
+static void response_init(struct http_response *restrict response, const struct http_request *request)
+{
+	response->http2 = request->http2;
 	response->headers_end = response->headers;
 	response->content_encoding = -1;
 	response->ranges = 0;
+	response->intervals = 0;
+	response->compressor = 0;
+	response->flush = RESPONSE_FLUSH_RATIO;
 }
 
 static void response_term(struct http_response *restrict response)
@@ -109,68 +162,44 @@ static void response_term(struct http_response *restrict response)
 	}
 }*/
 
-static void *server_serve(void *argument)
+// Handles a request and sends the response. Sets type to the type of the request.
+// Returns whether the connection should be closed.
+static bool request_serve(struct http_request *restrict request, struct resources *restrict resources, unsigned *restrict type)
 {
-	struct connection *connection = argument;
-
-	struct http_request *request = &connection->context.request;
 	struct http_response response;
-	struct string key, value;
 	int status;
-	bool last;
+	bool last, cors;
 
 	// Remember to terminate the connection if the client specified so.
 	{
-		struct string *connection = dict_get(&request->headers, &key_connection);
+		struct string *connection = request->headers_known[HEADER_CONNECTION];
 		last = (connection && string_equal(connection, &value_close));
 	}
 
-	response_init(&response);
-
-	// Assume that response_header_add() will always succeed before the response handler is called.
-
-	// Server - Server name and version.
-	key = string("Server");
-	response_header_add(&response, &key, &SERVER);
+	response_init(&response, request);
 
 	// Allow cross-origin requests.
-	key = string("origin");
-	if (dict_get(&request->headers, &key))
-	{
-		// TODO: maybe allow only some domains as origin. is origin always in the same format as allow-origin ?
-		key = string("Access-Control-Allow-Origin");
-		value = string("*");
-		response_header_add(&response, &key, &value);
-
-		// TODO is this okay
-		key = string("Access-Control-Expose-Headers");
-		value = string("Server, UUID");
-		response_header_add(&response, &key, &value);
-	}
+	// TODO: maybe allow only some domains as origin. is origin always in the same format as allow-origin ?
+	cors = (request->headers_known[HEADER_ORIGIN] != 0);
 
 	// TODO: change this to do stuff properly
 	if (request->method == METHOD_OPTIONS)
 	{
-		// TODO: Access-Control-Request-Headers
-		key = string("Access-Control-Allow-Headers");
-		value = string("Cache-Control, X-Requested-With, Filename, Filesize, Content-Type, Content-Length, Authorization, Range");
-		response_header_add(&response, &key, &value);
-
-		// TODO is this okay
-		key = string("Access-Control-Expose-Headers");
-		value = string("Server, UUID");
-		response_header_add(&response, &key, &value);
-
-		// TODO: Access-Control-Request-Method
-		key = string("Access-Control-Allow-Methods");
-		value = string("GET, POST, OPTIONS, PUT, DELETE, SUBSCRIBE, NOTIFY");
-		response_header_add(&response, &key, &value);
-
+		// TODO: Access-Control-Request-Headers, Access-Control-Request-Method
 		status = 0;
 		response.code = OK;
+		*type = RequestOptions;
+
+		// The answer is the same for all HTTP/1.1 requests.
+		if (request->http2) response_headers_static(&response, HEADERS_OPTIONS | (cors ? HEADERS_CORS : 0));
+		else last |= !response_preflight_send(&resources->stream, &response, cors);
 	}
 	else
 	{
+		// Server and CORS headers.
+		// Assume that response_header_add() will always succeed before the response handler is called.
+		response_headers_static(&response, (cors ? HEADERS_CORS : 0));
+
 		// Parse request URI and call appropriate handler.
 		if (response.code = http_parse_uri(request)) goto finally;
 		else
@@ -179,11 +208,15 @@ static void *server_serve(void *argument)
 			response.code = InternalServerError; // default response code
 			if (request->query)
 			{
-				status = handler_dynamic(request, &response, &connection->resources);
-				json_free(request->query);
+				*type = RequestDynamic;
+				status = handler_dynamic(request, &response, resources);
+			}
+			else
+			{
+				if (request->method == METHOD_POST) *type = RequestUpload;
+				status = handler_static(request, &response, resources);
 			}
-			else status = handler_static(request, &response, &connection->resources);
-			free(request->path.data);
+			// Path and query are freed with the request arena by http_parse_term().
 
 			// Close the connection on error with a request containing body.
 			// TODO is this okay?
@@ -254,27 +287,93 @@ static void *server_serve(void *argument)
 
 finally:
 
+	// The response is complete. Send any data held by the cork.
+	stream_cork(&resources->stream, false);
+
 	if (status == ERROR_PROGRESS)
 	{
 		response_term(&response);
-		return 0;
+		return false;
 	}
 
 	// Send default response if specified but only if none is sent until now.
 	if (response.content_encoding < 0)
-		last |= !response_headers_send(&connection->resources.stream, request, &response, 0);
-
-	if (last) status = 1;
+		last |= !response_headers_send(&resources->stream, request, &response, 0);
 
 	if (0)
 	{
 error:
-		status = -1;
+		last = true;
 	}
 
 	response_term(&response);
 	//connection_release(connection->control, status); // TODO should this be in a function?
 
+	return last;
+}
+
+static void *server_serve(void *argument)
+{
+	struct connection *connection = argument;
+	unsigned type = RequestStatic;
+
+	request_serve(&connection->context.request, &connection->resources, &type);
+
+	// Attribute the I/O performed for this request (including parsing) to its type.
+	pthread_mutex_lock(stats_lock + connection->thread);
+	stream_stats_add(&stats[connection->thread][type], &connection->resources.stream.stats, &connection->stats);
+	pthread_mutex_unlock(stats_lock + connection->thread);
+
+	return connection;
+}
+
+// Handles a request received on an HTTP/2 stream. The request body is read from a pipe.
+static void *server_serve_http2(void *argument)
+{
+	struct http2_stream *stream = argument;
+	struct resources resources;
+	unsigned type = RequestStatic;
+
+	memset(&resources, 0, sizeof(resources));
+	if (!http2_stream_body(stream, &resources.stream))
+	{
+		request_serve(&stream->context.request, &resources, &type);
+		stream_term(&resources.stream);
+	}
+
+	http2_stream_close(stream);
+	__atomic_sub_fetch(&http2_requests, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int server_dispatch_http2(struct http2_stream *stream)
+{
+	pthread_t thread_id;
+	if (!thread_reserve(&http2_requests, HTTP2_REQUESTS_MAX)) return ERROR_AGAIN;
+	if (pthread_create(&thread_id, 0, &server_serve_http2, stream))
+	{
+		__atomic_sub_fetch(&http2_requests, 1, __ATOMIC_RELAXED);
+		return ERROR_MEMORY;
+	}
+	pthread_detach(thread_id);
+	return 0;
+}
+
+// Serves an HTTP/2 connection in its own thread. Each of its requests is handled in a separate thread.
+static void *server_http2(void *argument)
+{
+	struct connection *connection = argument;
+
+	http2_serve(&connection->resources.stream, &connection->context, &server_dispatch_http2);
+
+	pthread_mutex_lock(&stats_http2_lock);
+	stream_stats_add(&stats_http2, &connection->resources.stream.stats, &connection->stats);
+	pthread_mutex_unlock(&stats_http2_lock);
+
+	stream_term(&connection->resources.stream);
+	http_close(connection->resources.stream.fd);
+	free(connection);
+	__atomic_sub_fetch(&http2_connections, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -295,7 +394,44 @@ static void *worker(void *argument)
 	return 0;
 }
 
-// Listen for incoming HTTP connections.
+// Creates a socket listening for connections on the specified port.
+static int listen_socket(unsigned port)
+{
+	struct sockaddr_in address;
+	int value = 1;
+	int fd;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		error(logs("Unable to create socket"));
+		return -1;
+	}
+
+	// disable TCP time_wait
+	// TODO should I do this?
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&value, sizeof(value)); // TODO can this fail
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)))
+	{
+		error(logs("Unable to bind to port "), logi(port));
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, LISTEN_MAX))
+	{
+		error(logs("Listen error"));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Listen for incoming HTTP and HTTPS connections.
 void server_listen(void *storage)
 {
 	size_t connections_count = 0, connections_size;
@@ -307,7 +443,6 @@ void server_listen(void *storage)
 	size_t pool_free[THREAD_POOL_SIZE], pool_free_count;
 
 	size_t i;
-	struct sockaddr_in address;
 	socklen_t address_len;
 	pthread_t thread_id;
 
@@ -316,8 +451,10 @@ void server_listen(void *storage)
 	{
 		pipe(pool[i].io.request);
 		pipe(pool[i].io.response);
+		fcntl(pool[i].io.response[0], F_SETFL, O_NONBLOCK); // all connections waiting for the thread poll the pipe
 
 		pool[i].busy = 0;
+		pthread_mutex_init(stats_lock + i, 0);
 
 		pthread_create(&pool[i].thread_id, 0, &worker, (void *)&pool[i].io);
 		pthread_detach(thread_id);
@@ -336,49 +473,44 @@ void server_listen(void *storage)
 		goto error;
 	}
 
-	// Create listening socket.
+	// Create listening sockets.
 	{
-		int value = 1;
-		size_t i = 0;
-
-		wait[i].fd = socket(PF_INET, SOCK_STREAM, 0);
-		if (wait[i].fd < 0)
+		struct
 		{
-			error(logs("Unable to create socket"));
-			goto error;
-		}
-		wait[i].events = POLLIN;
-		wait[i].revents = 0;
+			unsigned port;
+			int type;
+		} listeners[2] = {{PORT_HTTP, Listen}};
+		size_t listeners_count = 1;
 
-		// disable TCP time_wait
-		// TODO should I do this?
-		setsockopt(wait[i].fd, SOL_SOCKET, SO_REUSEADDR, (void *)&value, sizeof(value)); // TODO can this fail
-
-		address.sin_family = AF_INET;
-		address.sin_addr.s_addr = INADDR_ANY;
-		address.sin_port = htons(PORT_HTTP);
-		if (bind(wait[i].fd, (struct sockaddr *)&address, sizeof(address)))
-		{
-			error(logs("Unable to bind to port "), logi(PORT_HTTP));
-			goto error;
-		}
-		if (listen(wait[i].fd, LISTEN_MAX))
+#if defined(TLS)
+		if (tls_init()) warning(logs("Unable to initialize TLS. HTTPS is disabled."));
+		else
 		{
-			error(logs("Listen error"));
-			goto error;
+			listeners[listeners_count].port = PORT_HTTPS;
+			listeners[listeners_count].type = ListenTLS;
+			listeners_count += 1;
 		}
+#endif
 
-		connections[i] = malloc(sizeof(**connections));
-		if (!connections[i])
+		for(i = 0; i < listeners_count; ++i)
 		{
-			error(logs("Unable to allocate memory"));
-			goto error;
-		}
+			wait[i].fd = listen_socket(listeners[i].port);
+			if (wait[i].fd < 0) goto error;
+			wait[i].events = POLLIN;
+			wait[i].revents = 0;
 
-		connections[i]->type = Listen;
-		// TODO set other fields
+			connections[i] = malloc(sizeof(**connections));
+			if (!connections[i])
+			{
+				error(logs("Unable to allocate memory"));
+				goto error;
+			}
+
+			connections[i]->type = listeners[i].type;
+			// TODO set other fields
 
-		connections_count = 1;
+			connections_count = i + 1;
+		}
 	}
 
 	int client;
@@ -389,8 +521,6 @@ void server_listen(void *storage)
 	// TODO connections elements may be changed by another thread; think about this (are there caching problems?)
 	// http://stackoverflow.com/questions/26097773/non-simultaneous-memory-use-from-multiple-threads-caching
 
-	// TODO add one more listening socket for https
-
 	// Start an event loop to handle the connections.
 	while (1)
 	{
@@ -401,13 +531,14 @@ void server_listen(void *storage)
 		poll_count = connections_count;
 		for(i = 0; i < poll_count; ++i)
 		{
-			if (wait[i].revents & POLLIN)
+			if (wait[i].revents & wait[i].events)
 			{
 				wait[i].revents = 0;
 
 				switch (connections[i]->type)
 				{
 				case Listen:
+				case ListenTLS:
 					// A client has connected to the server. Accept the connection and prepare for parsing.
 
 					// Make sure there is enough allocated memory to store connection data.
@@ -447,14 +578,32 @@ void server_listen(void *storage)
 					if ((client = accept(wait[i].fd, (struct sockaddr *)&connection->resources.address, &address_len)) < 0)
 						continue;
 					http_open(client);
-					if (stream_init(&connection->resources.stream, client))
+#if defined(TLS)
+					if (connections[i]->type == ListenTLS)
 					{
-						warning(logs("Unable to initialize stream"));
-						http_close(client);
-						continue;
+						// The handshake is performed in the event loop as the client sends its messages.
+						if (stream_init_tls_accept(&connection->resources.stream, client))
+						{
+							warning(logs("Unable to initialize TLS stream"));
+							http_close(client);
+							free(connection);
+							continue;
+						}
+						connection->type = Handshake;
+					}
+					else
+#endif
+					{
+						if (stream_init(&connection->resources.stream, client))
+						{
+							warning(logs("Unable to initialize stream"));
+							http_close(client);
+							continue;
+						}
+						connection->type = Parse;
 					}
-					connection->type = Parse;
 					connection->activity = now;
+					connection->stats = connection->resources.stream.stats;
 					http_parse_init(&connection->context); // TODO error check
 
 					wait[connections_count].fd = client;
@@ -464,6 +613,30 @@ void server_listen(void *storage)
 					connections_count += 1;
 					break;
 
+#if defined(TLS)
+				case Handshake:
+					connection = connections[i];
+
+					// Continue the handshake with the data received from the client.
+					{
+						short event;
+						status = stream_handshake(&connection->resources.stream, &event);
+						if (status == ERROR_AGAIN)
+						{
+							wait[i].events = event;
+							connection->activity = now;
+							break;
+						}
+						else if (status) goto term;
+					}
+
+					// The handshake is completed. Wait for a request.
+					wait[i].events = POLLIN;
+					connection->type = Parse;
+					connection->activity = now;
+					break;
+#endif
+
 				case Parse:
 					connection = connections[i];
 
@@ -474,9 +647,31 @@ void server_listen(void *storage)
 					{
 						// Request parsed successfully.
 
+						// The connection switches to HTTP/2. It is served by a separate thread from now on.
+						// When there are too many HTTP/2 connections, upgrade requests are served with HTTP/1.1.
+						// Only cleartext connections are switched (h2c). HTTP/2 over TLS requires ALPN which is not supported.
+						if (!stream_tls(&connection->resources.stream) && http2_start(&connection->context.request))
+						{
+							if (thread_reserve(&http2_connections, HTTP2_CONNECTIONS_MAX))
+							{
+								if (pthread_create(&thread_id, 0, &server_http2, connection))
+								{
+									__atomic_sub_fetch(&http2_connections, 1, __ATOMIC_RELAXED);
+									status = ERROR_MEMORY;
+									goto term;
+								}
+								pthread_detach(thread_id);
+								goto detach;
+							}
+							else if (connection->context.request.method == METHOD_PRI)
+							{
+								status = ERROR_AGAIN;
+								goto term;
+							}
+						}
+
 						// Check if host header is specified.
-						struct string name = string("host");
-						connection->context.request.hostname = dict_get(&connection->context.request.headers, &name);
+						connection->context.request.hostname = connection->context.request.headers_known[HEADER_HOST];
 						if (!connection->context.request.hostname)
 						{
 							// TODO send BadRequest
@@ -545,37 +740,45 @@ void server_listen(void *storage)
 					break;*/
 
 				case ResponseDynamic:
-					connection = connections[i];
+					thread = connections[i]->thread;
 
-					thread = connection->thread;
-
-					{
-						void *response;
-						read(pool[thread].io.response[0], &response, sizeof(response));
-						// assert(read() returned sizeof(response));
-						status = (response != 0);
-					}
+					// The connections waiting for the same thread poll the same pipe. The thread sends the connection it has served.
+					// Another connection may have already taken the response that made the pipe readable.
+					if (read(pool[thread].io.response[0], &connection, sizeof(connection)) != sizeof(connection))
+						break;
 
 					pool[thread].busy -= 1;
 
 					//if (!pool[thread].busy)
 					//	pool_free[pool_free_count++] = thread;
 
-					wait[i].fd = connection->resources.stream.fd;
-
-					if (status) goto term;
-					else
+					// Find the served connection unless it is the one that is polled.
 					{
-						connection->type = Parse;
-						connection->activity = now;
+						size_t served = i;
+						if (connection != connections[i])
+						{
+							for(served = 0; connections[served] != connection; ++served)
+								;
+							wait[served].revents = 0; // the response is handled now
+						}
+						wait[served].fd = connection->resources.stream.fd;
 					}
 
-					http_parse_term(&connection->context); // TODO race condition here?
+					connection->type = Parse;
+					connection->activity = now;
+
+					http_parse_term(&connection->context);
+					stream_read_unpin(&connection->resources.stream);
 					http_parse_init(&connection->context); // TODO error check
 
 					break;
 				}
 			}
+			else if ((wait[i].revents == POLLERR) && (connections[i]->type == Parse) && stream_zerocopy_reap(&connections[i]->resources.stream))
+			{
+				// Zerocopy completion notifications are delivered through the socket error queue.
+				wait[i].revents = 0;
+			}
 			else if (wait[i].revents)
 			{
 				if (connections[i]->type == ResponseDynamic)
@@ -588,7 +791,7 @@ void server_listen(void *storage)
 				status = -1;
 				goto term; // TODO race condition here?
 			}
-			else if ((connections[i]->type == Parse) && ((now - connections[i]->activity) > (TIMEOUT / 1000)))
+			else if (((connections[i]->type == Parse) || (connections[i]->type == Handshake)) && ((now - connections[i]->activity) > (TIMEOUT / 1000)))
 			{
 				status = ERROR_AGAIN;
 				goto term;
@@ -603,6 +806,7 @@ term:
 			else close(connections[i]->resources.stream.fd); // close with RST
 			free(connections[i]);
 
+detach:
 			// Fill the entry freed by the terminated connection.
 			// Make sure the moved entry is inspected (if included in poll_count).
 			if (i != --connections_count)
@@ -637,6 +841,12 @@ int main(void)
 {
 	init();
 
+	if (!response_static_init(&SERVER))
+	{
+		error(logs("Unable to initialize static headers"));
+		return 1;
+	}
+
 	server_listen(0);
 
 	return 0;
@@ -6,3 +6,10 @@ struct resources
 	struct sockaddr_storage address;
 	void *storage;
 };
+
+// Request types for which I/O statistics are collected.
+// HTTP/2 connections carry requests of all types so their I/O is counted separately.
+enum {RequestStatic, RequestUpload, RequestDynamic, RequestOptions, RequestHTTP2};
+#define REQUEST_TYPES 5
+
+void server_stats(struct stream_stats total[REQUEST_TYPES]);
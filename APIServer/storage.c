@@ -2,69 +2,530 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <errno.h>
 
+#include <zlib.h>
+
 #include "base.h"
 #include "format.h"
 #include "stream.h"
 #include "storage.h"
 
 #define WEBROOT "/tmp/data/"
-#define FILENAME "Latest_plane_crash"
 
 #define PATH_SIZE_LIMIT 4096
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ARTICLES_SIZE_MIN 1024 /* initial number of slots in the article table */
+
+// Each article directory has a manifest with the latest version, its size and its CRC-32 as a line of text:
+// <version> <size> <checksum in hexadecimal>
+// An upload replaces the manifest before its version appears in the directory, so there is never a version newer than the manifest.
+#define MANIFEST "manifest"
+#define MANIFEST_LENGTH_MAX (sizeof(unsigned) * 3 + 1 + sizeof(size_t) * 3 + 1 + 8 + 1)
+
+struct manifest
+{
+	unsigned version;
+	size_t size;
+	uint32_t checksum;
+};
+
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8 /* CRC-32 and size */
+#define ZLIB_HEADER_SIZE 2
+#define ZLIB_TRAILER_SIZE 4 /* Adler-32 */
+
+#define COMPRESS_CHUNK 1048576 /* 1 MiB */
+
+#define RETIRE_BATCH 8 /* number of retired objects that triggers reclamation */
+
+// Readers access the current version and the cached responses without locking (in the style of RCU).
+// Each thread that reads has a record with the epoch in which its read started (0 while it is not reading).
+// Objects that readers may still see are retired with the epoch in which they became unreachable and are freed
+// in batches once no read that started in that epoch or earlier is in progress.
+struct reader
+{
+	unsigned long epoch;
+	bool used; // whether a thread owns the record
+	struct reader *next;
+};
+
+struct retired
+{
+	void (*free)(void *);
+	void *object;
+	unsigned long epoch;
+};
+
+static struct reader *readers = 0; // records are never freed; records of finished threads are reused
+static unsigned long epoch = 1;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static bool reader_ready;
+
+static pthread_mutex_t retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *retired = 0;
+static size_t retired_count = 0, retired_size = 0;
+
+static void reader_free(void *argument)
+{
+	struct reader *reader = argument;
+	__atomic_store_n(&reader->used, false, __ATOMIC_RELEASE);
+}
+
+static void reader_key_create(void)
+{
+	reader_ready = !pthread_key_create(&reader_key, reader_free);
+}
+
+// Returns the record of the current thread or 0 on error.
+static struct reader *reader_get(void)
+{
+	struct reader *reader;
+	bool used;
+
+	pthread_once(&reader_once, reader_key_create);
+	if (!reader_ready) return 0;
+
+	if (reader = pthread_getspecific(reader_key)) return reader;
+
+	// Take a record left by a finished thread or add a new one.
+	for(reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+	{
+		used = false;
+		if (__atomic_compare_exchange_n(&reader->used, &used, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!reader)
+	{
+		reader = malloc(sizeof(*reader));
+		if (!reader) return 0;
+		reader->epoch = 0;
+		reader->used = true;
+		reader->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&readers, &reader->next, reader, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	if (pthread_setspecific(reader_key, reader))
+	{
+		reader_free(reader);
+		return 0;
+	}
+	return reader;
+}
+
+// Marks the start of a read. Pointers loaded until read_end() stay valid.
+static struct reader *read_start(void)
+{
+	struct reader *reader = reader_get();
+	if (reader) __atomic_store_n(&reader->epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return reader;
+}
+
+static void read_end(struct reader *reader)
+{
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Adds a reference to an object found by a reader unless the object is already released.
+static bool link_acquire(unsigned *links)
+{
+	unsigned value = __atomic_load_n(links, __ATOMIC_RELAXED);
+	do
+	{
+		if (!value) return false;
+	} while (!__atomic_compare_exchange_n(links, &value, value + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
+
+// Frees the retired objects that no reader can access anymore.
+static void reclaim(void)
+{
+	unsigned long oldest = (unsigned long)-1, value;
+	struct reader *reader;
+	size_t index;
 
-static struct file_info *content = 0;
+	pthread_mutex_lock(&retire_mutex);
+
+	// Find the epoch of the oldest read in progress.
+	for(reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+		if ((value = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST)) && (value < oldest))
+			oldest = value;
+
+	// Free the objects retired before that read started. Freeing them does not retire other objects.
+	for(index = 0; index < retired_count; )
+	{
+		if (retired[index].epoch < oldest)
+		{
+			(*retired[index].free)(retired[index].object);
+			retired[index] = retired[--retired_count];
+		}
+		else index += 1;
+	}
+
+	pthread_mutex_unlock(&retire_mutex);
+}
+
+// Frees the object once no reader can access it.
+static void retire(void (*destroy)(void *), void *object)
+{
+	bool full;
+
+	pthread_mutex_lock(&retire_mutex);
+	if (retired_count == retired_size)
+	{
+		size_t size = (retired_size ? retired_size * 2 : RETIRE_BATCH * 2);
+		struct retired *buffer = realloc(retired, size * sizeof(*retired));
+		if (!buffer)
+		{
+			// Wait until no reader can access the object.
+			unsigned long retire_epoch = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+			struct reader *reader;
+			pthread_mutex_unlock(&retire_mutex);
+			for(reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+			{
+				unsigned long value;
+				while ((value = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST)) && (value <= retire_epoch))
+					sched_yield();
+			}
+			(*destroy)(object);
+			return;
+		}
+		retired = buffer;
+		retired_size = size;
+	}
+
+	// Reads that start after the epoch is advanced can not find the object.
+	retired[retired_count].free = destroy;
+	retired[retired_count].object = object;
+	retired[retired_count].epoch = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+	retired_count += 1;
+	full = (retired_count >= RETIRE_BATCH);
+	pthread_mutex_unlock(&retire_mutex);
+
+	if (full) reclaim();
+}
+
+static void response_free(void *argument)
+{
+	free(argument);
+}
+
+// Responses are retired because storage_response_get() can find them without a reference.
+static void response_release(struct storage_response *response)
+{
+	if (__atomic_sub_fetch(&response->links, 1, __ATOMIC_ACQ_REL)) return;
+	retire(response_free, response);
+}
+
+static void file_info_free(void *argument)
+{
+	struct file_info *file_info = argument;
+	size_t variant;
+
+	// Cached responses are only accessible through the file_info.
+	for(variant = 0; variant < STORAGE_RESPONSES; ++variant)
+		if (file_info->responses[variant] && !__atomic_sub_fetch(&file_info->responses[variant]->links, 1, __ATOMIC_ACQ_REL))
+			free(file_info->responses[variant]);
+	for(variant = 0; variant < STORAGE_VARIANTS; ++variant)
+		free(file_info->variants[variant].buffer);
+	munmap(file_info->buffer, file_info->size);
+	free(file_info);
+}
 
 static void release(struct file_info *file_info)
 {
-	file_info->links -= 1;
-	if (!file_info->links)
+	if (__atomic_sub_fetch(&file_info->links, 1, __ATOMIC_ACQ_REL)) return;
+
+	// Only published versions can be found by readers without a reference.
+	if (file_info->shared) retire(file_info_free, file_info);
+	else file_info_free(file_info);
+}
+
+// Each article has a directory in WEBROOT with a file for each version. Articles are never removed, so they stay valid without a reference.
+struct article
+{
+	pthread_mutex_t mutex; // serializes loading, numbering and publishing versions of the article
+	struct file_info *content; // current version (0 if there is none); readers load it without locking
+	unsigned version; // highest version number given to the article
+	unsigned stored; // highest version stored on disk
+	bool loaded; // whether the versions on disk are examined
+	uint32_t hash;
+	size_t name_length;
+	char name[];
+};
+
+// Hash table of articles with open addressing. Readers probe it without locking. Adding articles is serialized.
+// The table grows by replacing it with a bigger one. The old table is retired because readers may still probe it.
+struct articles
+{
+	size_t size; // power of 2
+	size_t count; // changed only with articles_mutex locked
+	struct article *slots[];
+};
+
+static struct articles *articles = 0;
+static pthread_mutex_t articles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t article_hash(const char *restrict name, size_t length)
+{
+	// FNV-1a
+	uint32_t result = 2166136261u;
+	size_t index;
+	for(index = 0; index < length; ++index)
+		result = (result ^ (unsigned char)name[index]) * 16777619u;
+	return result;
+}
+
+bool storage_name_valid(const struct string *name)
+{
+	return (name->length && (name->length <= NAME_MAX) && (name->data[0] != '.') && !memchr(name->data, '/', name->length) && !memchr(name->data, 0, name->length));
+}
+
+// Returns the article with the specified name or 0 if it is not in the table. Must be called by a reader or with articles_mutex locked.
+static struct article *article_find(const struct articles *table, const struct string *name, uint32_t hash)
+{
+	struct article *article;
+	size_t index;
+
+	if (!table) return 0;
+	for(index = hash & (table->size - 1); article = __atomic_load_n(&table->slots[index], __ATOMIC_ACQUIRE); index = (index + 1) & (table->size - 1))
+		if ((article->hash == hash) && (article->name_length == name->length) && !memcmp(article->name, name->data, name->length))
+			return article;
+	return 0;
+}
+
+static void articles_slot_set(struct articles *restrict table, struct article *article)
+{
+	size_t index;
+	for(index = article->hash & (table->size - 1); table->slots[index]; index = (index + 1) & (table->size - 1))
+		;
+	__atomic_store_n(&table->slots[index], article, __ATOMIC_RELEASE);
+}
+
+// Adds an article to the table unless it is already there. Returns the article or 0 on memory error.
+static struct article *article_insert(const struct string *name, uint32_t hash)
+{
+	struct articles *table;
+	struct article *article;
+	size_t index;
+
+	pthread_mutex_lock(&articles_mutex);
+
+	table = articles;
+	if (article = article_find(table, name, hash)) goto finally;
+
+	// Keep the table at most half full so that probe sequences stay short.
+	if (!table || ((table->count + 1) * 2 > table->size))
 	{
-		munmap(file_info->buffer, file_info->size);
-		free(file_info);
+		size_t size = (table ? table->size * 2 : ARTICLES_SIZE_MIN);
+		struct articles *new = malloc(sizeof(*new) + size * sizeof(*new->slots));
+		if (!new) goto finally;
+		new->size = size;
+		new->count = (table ? table->count : 0);
+		memset(new->slots, 0, size * sizeof(*new->slots));
+		if (table)
+			for(index = 0; index < table->size; ++index)
+				if (table->slots[index]) articles_slot_set(new, table->slots[index]);
+
+		__atomic_store_n(&articles, new, __ATOMIC_SEQ_CST);
+		if (table) retire(free, table);
+		table = new;
 	}
+
+	article = malloc(sizeof(*article) + name->length + 1);
+	if (!article) goto finally;
+	pthread_mutex_init(&article->mutex, 0);
+	article->content = 0;
+	article->version = 0;
+	article->stored = 0;
+	article->loaded = false;
+	article->hash = hash;
+	article->name_length = name->length;
+	memcpy(article->name, name->data, name->length);
+	article->name[name->length] = 0;
+
+	articles_slot_set(table, article);
+	table->count += 1;
+
+finally:
+	pthread_mutex_unlock(&articles_mutex);
+	return article;
+}
+
+static unsigned char *format_uint32_be(unsigned char *buffer, uint32_t value)
+{
+	*buffer++ = value >> 24;
+	*buffer++ = value >> 16;
+	*buffer++ = value >> 8;
+	*buffer++ = value;
+	return buffer;
+}
+
+static unsigned char *format_uint32_le(unsigned char *buffer, uint32_t value)
+{
+	*buffer++ = value;
+	*buffer++ = value >> 8;
+	*buffer++ = value >> 16;
+	*buffer++ = value >> 24;
+	return buffer;
 }
 
-static int storage_load(const unsigned char *filename, unsigned version)
+// Compresses the content once and stores it in zlib and gzip format. The two formats differ only in header and trailer.
+// The variants are not generated if compression does not make the content smaller.
+static void compress_variants(struct file_info *restrict file_info)
 {
+	static const unsigned char gzip_header[GZIP_HEADER_SIZE] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3}; // deflate, no flags, no time, best compression, unix
+	static const unsigned char zlib_header[ZLIB_HEADER_SIZE] = {0x78, 0xda}; // deflate with 32K window, best compression
+	unsigned char *gzip, *zlib;
+	size_t raw_size, index = 0;
+	uLong crc = crc32(0, 0, 0), adler = adler32(0, 0, 0);
+	z_stream z = {0};
+	int status;
+
+	// Compressed data is only useful if it is smaller than the content.
+	if (file_info->size <= GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE) return;
+
+	// Negative window bits produce raw deflate data.
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK) return;
+
+	// Compress directly into the gzip buffer.
+	raw_size = deflateBound(&z, file_info->size);
+	if (raw_size > file_info->size - GZIP_HEADER_SIZE - GZIP_TRAILER_SIZE) raw_size = file_info->size - GZIP_HEADER_SIZE - GZIP_TRAILER_SIZE;
+	gzip = malloc(GZIP_HEADER_SIZE + raw_size + GZIP_TRAILER_SIZE);
+	if (!gzip)
+	{
+		deflateEnd(&z);
+		return;
+	}
+
+	z.next_out = gzip + GZIP_HEADER_SIZE;
+	do
+	{
+		size_t available;
+
+		if (!z.avail_in && (index < file_info->size))
+		{
+			// Stop early if the data compressed so far is almost as large as the input.
+			if (index && (z.total_out > z.total_in - z.total_in / 16)) goto error;
+
+			size_t size = file_info->size - index;
+			if (size > COMPRESS_CHUNK) size = COMPRESS_CHUNK;
+
+			crc = crc32(crc, file_info->buffer + index, size);
+			adler = adler32(adler, file_info->buffer + index, size);
+
+			z.next_in = file_info->buffer + index;
+			z.avail_in = size;
+			index += size;
+		}
+
+		available = raw_size - (z.next_out - (gzip + GZIP_HEADER_SIZE));
+		if (!available) goto error; // the data is incompressible
+		z.avail_out = ((available > UINT_MAX) ? UINT_MAX : available); // zlib takes sizes as unsigned int
+
+		status = deflate(&z, ((index == file_info->size) ? Z_FINISH : Z_NO_FLUSH));
+		if ((status != Z_OK) && (status != Z_STREAM_END)) goto error;
+	} while (status != Z_STREAM_END);
+	raw_size = z.next_out - (gzip + GZIP_HEADER_SIZE);
+	deflateEnd(&z);
+
+	zlib = malloc(ZLIB_HEADER_SIZE + raw_size + ZLIB_TRAILER_SIZE);
+	if (!zlib)
+	{
+		free(gzip);
+		return;
+	}
+
+	memcpy(gzip, gzip_header, GZIP_HEADER_SIZE);
+	format_uint32_le(format_uint32_le(gzip + GZIP_HEADER_SIZE + raw_size, crc), file_info->size);
+	file_info->variants[STORAGE_GZIP].buffer = gzip;
+	file_info->variants[STORAGE_GZIP].size = GZIP_HEADER_SIZE + raw_size + GZIP_TRAILER_SIZE;
+
+	memcpy(zlib, zlib_header, ZLIB_HEADER_SIZE);
+	memcpy(zlib + ZLIB_HEADER_SIZE, gzip + GZIP_HEADER_SIZE, raw_size);
+	format_uint32_be(zlib + ZLIB_HEADER_SIZE + raw_size, adler);
+	file_info->variants[STORAGE_DEFLATE].buffer = zlib;
+	file_info->variants[STORAGE_DEFLATE].size = ZLIB_HEADER_SIZE + raw_size + ZLIB_TRAILER_SIZE;
+
+	return;
+
+error:
+	deflateEnd(&z);
+	free(gzip);
+}
+
+// Maps the file with the specified version. Generates its compressed variants if compress is true.
+static struct file_info *storage_open(const unsigned char *filename, unsigned version, bool compress)
+{
+	struct file_info *file_info;
 	struct stat info;
 	int file;
 
-	if (content) release(content);
-
-	content = malloc(sizeof(*content));
-	if (!content) return -1;
+	file_info = malloc(sizeof(*file_info));
+	if (!file_info) return 0;
 
 	file = open(filename, O_RDONLY);
-	if (file < 0) return -2;
+	if (file < 0) goto error;
 	if (fstat(file, &info) < 0)
 	{
 		close(file);
-		return -3;
+		goto error;
 	}
 
-	content->buffer = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
-	//content->buffer = mmap(0, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+	file_info->buffer = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	//file_info->buffer = mmap(0, info.st_size, PROT_READ, MAP_SHARED, file, 0);
 	close(file);
-	if (content->buffer == MAP_FAILED) return -4;
+	if (file_info->buffer == MAP_FAILED) goto error;
+
+	file_info->size = info.st_size;
+	file_info->modified = info.st_mtime;
 
-	content->size = info.st_size;
+	file_info->version = version;
+	file_info->links = 1;
+	file_info->shared = false;
+	memset(file_info->variants, 0, sizeof(file_info->variants));
+	memset(file_info->responses, 0, sizeof(file_info->responses));
 
-	content->version = version;
-	content->links = 1;
+	if (compress) compress_variants(file_info);
 
+	return file_info;
+
+error:
+	free(file_info);
 	return 0;
 }
 
+// Makes the file_info the current content of the article unless a newer version is already published. Returns whether the file_info is published.
+// Must be called with the mutex of the article locked.
+static bool storage_publish(struct article *restrict article, struct file_info *restrict file_info)
+{
+	struct file_info *old = article->content;
+
+	// Uploads may complete in a different order than the one in which they got their version numbers.
+	if (old && (old->version > file_info->version))
+	{
+		release(file_info);
+		return false;
+	}
+
+	file_info->shared = true;
+	__atomic_store_n(&article->content, file_info, __ATOMIC_SEQ_CST);
+	if (old) release(old);
+	return true;
+}
+
 static void generate_path(unsigned char *restrict result, const unsigned char *restrict filename, size_t filename_size, unsigned version)
 {
 	char *position;
@@ -75,6 +536,32 @@ static void generate_path(unsigned char *restrict result, const unsigned char *r
 	*position++ = 0;
 }
 
+// Generates the path of the file to which a version is uploaded before it gets its final name.
+// The name is not a number so neither requests for a version nor examining the directory find it.
+static void upload_path(unsigned char *restrict result, const unsigned char *restrict filename, size_t filename_size, unsigned version)
+{
+	char *position;
+	position = format_bytes(result, WEBROOT, sizeof(WEBROOT) - 1);
+	position = format_bytes(position, filename, filename_size);
+	*position++ = '/';
+	position = format_uint(position, version, 10);
+	position = format_bytes(position, ".part", sizeof(".part") - 1);
+	*position++ = 0;
+}
+
+static int writeall(int fd, const char *buffer, size_t total)
+{
+    size_t index;
+    ssize_t size;
+    for(index = 0; index < total; index += size)
+    {
+        size = write(fd, buffer + index, total - index);
+        if (size < 0) return -1;
+    }
+    return 0;
+}
+
+// Finds the latest version by examining each file in the article directory. Returns -1 if there is no version.
 static int latest_version(unsigned char *restrict path, size_t *restrict path_size, const unsigned char *restrict filename, size_t filename_size)
 {
 	unsigned char *position;
@@ -83,31 +570,19 @@ static int latest_version(unsigned char *restrict path, size_t *restrict path_si
 	*position = 0;
 	*path_size = position - path;
 
-	struct dirent *entry, *more;
+	struct dirent *entry;
 
 	DIR *dir = opendir(path);
 	if (!dir) return -1; // TODO no such file
-	entry = malloc(offsetof(struct dirent, d_name) + pathconf(path, _PC_NAME_MAX) + 1);
-	if (!entry)
-	{
-		closedir(dir);
-		return -1; // TODO memory error
-	}
 
 	int version = -1; // TODO no such file
 
-	while (1)
+	// readdir() is safe to use from multiple threads as long as each thread uses its own directory stream.
+	while (entry = readdir(dir))
 	{
 		char *end;
 		long number;
 
-		if (readdir_r(dir, entry, &more))
-		{
-			closedir(dir);
-			return -1; // TODO readdir error
-		}
-		if (!more) break; // no more entries
-
 		number = strtol(entry->d_name, &end, 10);
 		if (*end) continue;
 
@@ -121,49 +596,231 @@ static int latest_version(unsigned char *restrict path, size_t *restrict path_si
 	return version;
 }
 
-struct file_info *storage_get(const struct string *name)
+static uint32_t checksum(const unsigned char *data, size_t size)
+{
+	uLong crc = crc32(0, 0, 0);
+	size_t index;
+
+	// zlib takes sizes as unsigned int.
+	for(index = 0; index < size; index += COMPRESS_CHUNK)
+		crc = crc32(crc, data + index, ((size - index > COMPRESS_CHUNK) ? COMPRESS_CHUNK : size - index));
+	return crc;
+}
+
+// Generates the path of the manifest of the article (or of the temporary file from which the manifest is replaced).
+static void manifest_path(unsigned char *restrict result, const struct article *article, bool temporary)
+{
+	char *position;
+	position = format_bytes(result, WEBROOT, sizeof(WEBROOT) - 1);
+	position = format_bytes(position, article->name, article->name_length);
+	position = format_bytes(position, "/" MANIFEST, sizeof("/" MANIFEST) - 1);
+	if (temporary) position = format_bytes(position, ".new", sizeof(".new") - 1);
+	*position++ = 0;
+}
+
+// Reads the manifest of the article. Returns 0 on success or -1 if the manifest is missing or invalid.
+static int manifest_read(const struct article *restrict article, struct manifest *restrict manifest)
 {
-	struct file_info *result = 0;
+	char path[PATH_SIZE_LIMIT], buffer[MANIFEST_LENGTH_MAX + 1], *end;
+	unsigned long long value;
+	ssize_t length;
+	int file;
 
-	pthread_mutex_lock(&mutex);
+	manifest_path(path, article, false);
+	file = open(path, O_RDONLY);
+	if (file < 0) return -1;
+	length = read(file, buffer, sizeof(buffer) - 1);
+	close(file);
+	if ((length <= 0) || (buffer[length - 1] != '\n')) return -1;
+	buffer[length] = 0;
+
+	// <version> <size> <checksum>
+	value = strtoull(buffer, &end, 10);
+	if ((end == buffer) || (*end != ' ') || !value || (value > INT_MAX)) return -1;
+	manifest->version = value;
+	value = strtoull(end + 1, &end, 10);
+	if ((*end != ' ') || (value > SIZE_MAX)) return -1;
+	manifest->size = value;
+	value = strtoull(end + 1, &end, 16);
+	if ((*end != '\n') || (value > UINT32_MAX)) return -1;
+	manifest->checksum = value;
 
-	if (!content)
+	return 0;
+}
+
+// Replaces the manifest of the article. Readers of the manifest see either the old or the new one.
+// The manifest only speeds up loading. If it cannot be replaced, it is removed and loading falls back to examining the directory.
+static void manifest_write(const struct article *restrict article, const struct manifest *restrict manifest)
+{
+	char path[PATH_SIZE_LIMIT], temporary[PATH_SIZE_LIMIT], buffer[MANIFEST_LENGTH_MAX], *position;
+	int file;
+
+	manifest_path(path, article, false);
+
+	position = format_uint(buffer, manifest->version, 10);
+	*position++ = ' ';
+	position = format_uint(position, manifest->size, 10);
+	*position++ = ' ';
+	position = format_uint(position, manifest->checksum, 16);
+	*position++ = '\n';
+
+	manifest_path(temporary, article, true);
+	file = creat(temporary, 0644);
+	if (file < 0)
+	{
+		unlink(path);
+		return;
+	}
+	if (writeall(file, buffer, position - buffer))
+	{
+		close(file);
+		unlink(temporary);
+		unlink(path);
+		return;
+	}
+	close(file);
+
+	if (rename(temporary, path) < 0)
+	{
+		unlink(temporary);
+		unlink(path);
+	}
+}
+
+// Returns the article with the specified name or 0 if there is no such article.
+// The article is created if create is true. Otherwise only articles that have a directory are added to the table.
+static struct article *article_get(const struct string *name, bool create)
+{
+	char path[PATH_SIZE_LIMIT], *position;
+	struct article *article;
+	struct reader *reader;
+	struct stat info;
+	uint32_t hash;
+
+	if (!storage_name_valid(name)) return 0;
+	hash = article_hash(name->data, name->length);
+
+	if (!(reader = read_start())) return 0;
+	article = article_find(__atomic_load_n(&articles, __ATOMIC_SEQ_CST), name, hash);
+	read_end(reader);
+	if (article) return article;
+
+	// Requests for names that do not exist must not fill the table.
+	position = format_bytes(path, WEBROOT, sizeof(WEBROOT) - 1);
+	position = format_bytes(position, name->data, name->length);
+	*position = 0;
+	if (create)
+	{
+		if ((mkdir(path, 0755) < 0) && (errno != EEXIST)) return 0;
+	}
+	else if ((stat(path, &info) < 0) || !S_ISDIR(info.st_mode)) return 0;
+
+	return article_insert(name, hash);
+}
+
+// Finds the latest version of the article on disk and publishes it. Must be called with the mutex of the article locked.
+// The manifest names the latest version. The directory is examined only if the manifest does not match the files.
+static void article_load(struct article *article)
+{
+	char path[PATH_SIZE_LIMIT], *position;
+	struct file_info *file_info;
+	struct manifest manifest;
+	size_t path_size;
+	int version;
+
+	if (article->loaded) return;
+
+	// The manifest does not match the files if an upload stopped before its version was stored.
+	if (!manifest_read(article, &manifest))
 	{
-		char path[PATH_SIZE_LIMIT], *position;
-		size_t path_size;
-		int version = latest_version(path, &path_size, FILENAME, sizeof(FILENAME) - 1);
-		if (version < 0) ; // TODO error check
+		generate_path(path, article->name, article->name_length, manifest.version);
+		if (file_info = storage_open(path, manifest.version, true))
+		{
+			if ((file_info->size == manifest.size) && (checksum(file_info->buffer, file_info->size) == manifest.checksum))
+			{
+				storage_publish(article, file_info);
+				if (manifest.version > article->version) article->version = manifest.version;
+				article->stored = manifest.version;
+				article->loaded = true;
+				return;
+			}
+			release(file_info);
+		}
+	}
 
+	version = latest_version(path, &path_size, article->name, article->name_length);
+	if (version > 0)
+	{
 		path[path_size++] = '/';
 		position = format_uint(path + path_size, version, 10);
 		*position++ = 0;
 
-		if (storage_load(path, version))
-			goto finally;
+		if (file_info = storage_open(path, version, true))
+		{
+			storage_publish(article, file_info);
+
+			// Record the version so that the next load does not examine the directory.
+			manifest.version = version;
+			manifest.size = file_info->size;
+			manifest.checksum = checksum(file_info->buffer, file_info->size);
+			manifest_write(article, &manifest);
+		}
+		if (version > article->version) article->version = version;
+		article->stored = version;
 	}
+	article->loaded = true;
+}
 
-	content->links += 1;
-	result = content;
+// Returns a reference to the current content of the article or 0 if there is none.
+static struct file_info *article_current(struct article *article)
+{
+	struct file_info *result;
+	struct reader *reader = read_start();
+	if (!reader) return 0;
 
-finally:
-	pthread_mutex_unlock(&mutex);
+	// The content may be released between loading it and adding a reference. Then a newer version is already published.
+	while ((result = __atomic_load_n(&article->content, __ATOMIC_SEQ_CST)) && !link_acquire(&result->links))
+		;
 
+	read_end(reader);
 	return result;
 }
 
-static int writeall(int fd, const char *buffer, size_t total)
+struct file_info *storage_get(const struct string *name)
 {
-    size_t index;
-    ssize_t size;
-    for(index = 0; index < total; index += size)
-    {
-        size = write(fd, buffer + index, total - index);
-        if (size < 0) return -1;
-    }
-    return 0;
+	struct article *article = article_get(name, false);
+	struct file_info *result;
+
+	if (!article) return 0;
+	if (result = article_current(article)) return result;
+
+	// Load the latest version on first access.
+	pthread_mutex_lock(&article->mutex);
+	article_load(article);
+	pthread_mutex_unlock(&article->mutex);
+
+	return article_current(article);
 }
 
-static int transfer(struct stream *input, int output, size_t size)
+struct file_info *storage_get_version(const struct string *name, unsigned version)
+{
+	struct file_info *result = storage_get(name);
+	char path[PATH_SIZE_LIMIT];
+	unsigned latest;
+
+	if (!result || (result->version == version)) return result;
+	latest = result->version;
+	storage_release(result);
+
+	// Newer versions may still be in the process of being written.
+	if (version > latest) return 0;
+
+	// Older versions are mapped only for the request that needs them.
+	generate_path(path, name->data, name->length, version);
+	return storage_open(path, version, false);
+}
+
+static int transfer(struct stream *input, int output, size_t size, uLong *restrict crc)
 {
 	struct string buffer;
 	int status;
@@ -171,51 +828,61 @@ static int transfer(struct stream *input, int output, size_t size)
 	{
 		if (status = stream_read(input, &buffer, (size > BUFFER_SIZE_MAX) ? BUFFER_SIZE_MAX : size))
 			return status;
-		if (status = writeall(output, buffer.data, buffer.length))
-			return status;
+		if (writeall(output, buffer.data, buffer.length))
+			return ERROR_EVFS;
+		*crc = crc32(*crc, buffer.data, buffer.length);
 		stream_read_flush(input, buffer.length);
 		size -= buffer.length;
 	}
 	return 0;
 }
 
-int storage_set(const struct string *restrict name, struct stream *restrict stream, size_t size)
+// Writes the data as it arrives. The size of the body is not known in advance.
+static int transfer_chunked(struct stream *input, int output, uLong *restrict crc)
 {
-	unsigned version;
-
-	pthread_mutex_lock(&mutex);
-	if (!content)
+	struct stream_chunked chunked = {0};
+	struct string buffer;
+	int status;
+	while (1)
 	{
-		char path[PATH_SIZE_LIMIT], *position;
-		size_t path_size;
-		int version = latest_version(path, &path_size, FILENAME, sizeof(FILENAME) - 1);
-		if (version < 0) ; // TODO error check
+		if (status = stream_read_chunked(input, &buffer, &chunked))
+			return status;
+		if (!buffer.length) return 0; // end of body
+		if (writeall(output, buffer.data, buffer.length))
+			return ERROR_EVFS;
+		*crc = crc32(*crc, buffer.data, buffer.length);
+		stream_read_chunked_flush(input, &chunked, buffer.length);
+	}
+}
 
-		path[path_size++] = '/';
-		position = format_uint(path + path_size, version, 10);
-		*position++ = 0;
+int storage_set(const struct string *restrict name, struct stream *restrict stream, size_t size)
+{
+	struct article *article;
+	unsigned version;
 
-		if (storage_load(path, version) < 0)
-		{
-			pthread_mutex_unlock(&mutex);
-			return -1;
-		}
-	}
-	version = content->version;
-	pthread_mutex_unlock(&mutex);
+	if (!storage_name_valid(name)) return ERROR_INPUT;
+	article = article_get(name, true);
+	if (!article) return ERROR_EVFS; // the directory of the article can not be created
 
-	version += 1;
+	// Each upload gets its own version number so that uploads of the same article can proceed at the same time.
+	pthread_mutex_lock(&article->mutex);
+	article_load(article);
+	version = ++article->version;
+	pthread_mutex_unlock(&article->mutex);
 
-	// Generate full path for the new version of the file.
-	char path[PATH_SIZE_LIMIT];
-	generate_path(path, FILENAME, sizeof(FILENAME) - 1, version);
+	// The data is written to a temporary file which is renamed after the upload completes.
+	// This way a request for the version never finds a partially uploaded file.
+	char path[PATH_SIZE_LIMIT], temporary[PATH_SIZE_LIMIT];
+	generate_path(path, article->name, article->name_length, version);
+	upload_path(temporary, article->name, article->name_length, version);
 
 	int file;
 	unsigned char *buffer;
 
 	// Create the new file and write the data to it.
-	file = creat(path, 0644);
-	ftruncate(file, size);
+	file = creat(temporary, 0644);
+	if (file < 0) return ERROR_EVFS;
+	if (size != STORAGE_CHUNKED) ftruncate(file, size);
 	//buffer = mmap(0, size, PROT_WRITE, MAP_SHARED, file, 0);
 	//close(file);
 	/*if (buffer == MAP_FAILED)
@@ -224,26 +891,90 @@ int storage_set(const struct string *restrict name, struct stream *restrict stre
 		unlink(path);
 		return -2;
 	}*/
-	if (transfer(stream, file, size) < 0)
+	uLong crc = crc32(0, 0, 0);
+	struct stat info;
+	int status = ((size == STORAGE_CHUNKED) ? transfer_chunked(stream, file, &crc) : transfer(stream, file, size, &crc));
+	if (!status && (fstat(file, &info) < 0)) status = ERROR_EVFS;
+	if (status)
 	{
 		//munmap(buffer, size);
 		close(file);
-		unlink(path);
-		return -3;
+		unlink(temporary);
+		return status;
 	}
 	close(file);
 	//munmap(buffer, size);
 
-	pthread_mutex_lock(&mutex);
-	storage_load(path, version);
-	pthread_mutex_unlock(&mutex);
+	// The manifest names the new version before the version is stored, unless a newer version is already stored.
+	// If the version is never stored, the manifest names a missing file and loading examines the directory.
+	// link() fails instead of replacing a file with the same name. The upload then gets the next number.
+	pthread_mutex_lock(&article->mutex);
+	while (1)
+	{
+		if (version > article->stored)
+		{
+			struct manifest manifest = {.version = version, .size = info.st_size, .checksum = crc};
+			manifest_write(article, &manifest);
+		}
+		if (!link(temporary, path)) break;
+		if (errno != EEXIST)
+		{
+			pthread_mutex_unlock(&article->mutex);
+			unlink(temporary);
+			return ERROR_EVFS;
+		}
+		version = ++article->version;
+		generate_path(path, article->name, article->name_length, version);
+	}
+	if (version > article->stored) article->stored = version;
+	pthread_mutex_unlock(&article->mutex);
+	unlink(temporary);
+
+	// Compress the new version before publishing it so that requests are not blocked meanwhile.
+	struct file_info *file_info = storage_open(path, version, true);
+	if (!file_info) return ERROR_EVFS;
+
+	pthread_mutex_lock(&article->mutex);
+	storage_publish(article, file_info);
+	pthread_mutex_unlock(&article->mutex);
+
+	// Unmap the versions that are no longer used.
+	reclaim();
 
 	return 0;
 }
 
+// Adds a reference to a file_info that is already referenced by the caller.
+void storage_retain(struct file_info *file_info)
+{
+	__atomic_add_fetch(&file_info->links, 1, __ATOMIC_RELAXED);
+}
+
 void storage_release(struct file_info *file_info)
 {
-	pthread_mutex_lock(&mutex);
 	release(file_info);
-	pthread_mutex_unlock(&mutex);
+}
+
+struct storage_response *storage_response_get(struct file_info *restrict file_info, unsigned variant)
+{
+	struct storage_response *response;
+	struct reader *reader = read_start();
+	if (!reader) return 0;
+
+	if ((response = __atomic_load_n(&file_info->responses[variant], __ATOMIC_SEQ_CST)) && !link_acquire(&response->links))
+		response = 0; // the response is being replaced
+
+	read_end(reader);
+	return response;
+}
+
+void storage_response_set(struct file_info *restrict file_info, unsigned variant, struct storage_response *restrict response)
+{
+	struct storage_response *old = __atomic_exchange_n(&file_info->responses[variant], response, __ATOMIC_SEQ_CST);
+	if (old) response_release(old);
+}
+
+void storage_response_release(struct storage_response *response)
+{
+	response_release(response);
 }
@@ -1,12 +1,63 @@
+// Serialized response for a file version. The data is not modified after the response is stored.
+struct storage_response
+{
+	unsigned links; // reference counting (changed atomically)
+	time_t date; // time in the Date header
+	size_t date_offset; // position of the Date header value in data
+	size_t length;
+	char data[];
+};
+
+#define STORAGE_RESPONSES 12 /* number of response variants cached for each version */
+
+// Compressed variants of each version.
+#define STORAGE_DEFLATE 0 /* zlib format (Content-Encoding: deflate) */
+#define STORAGE_GZIP 1 /* gzip format (Content-Encoding: gzip) */
+#define STORAGE_VARIANTS 2
+
 struct file_info
 {
 	unsigned char *buffer;
 	size_t size;
 	unsigned version;
+	time_t modified; // when the version was stored
+
+	// Content in each compressed format (buffer is 0 if compression does not make the content smaller).
+	struct
+	{
+		unsigned char *buffer;
+		size_t size;
+	} variants[STORAGE_VARIANTS];
+
+	unsigned links; // reference counting (changed atomically)
+	bool shared; // whether readers can find the version without holding a reference (it is published)
 
-	unsigned links; // reference counting
+	struct storage_response *responses[STORAGE_RESPONSES]; // responses cached for this version (0 if not cached)
 };
 
+// Articles are identified by name. Each article has its own versions.
+// Returns whether the name can be used as the directory name of an article.
+bool storage_name_valid(const struct string *name);
+
+// Returns a reference to the latest version of the article or 0 if there is no such article.
 struct file_info *storage_get(const struct string *name);
+
+// Returns the specified version or 0 if there is no such version. Versions other than the latest have no compressed variants.
+struct file_info *storage_get_version(const struct string *name, unsigned version);
+// Size of an upload with chunked transfer coding.
+#define STORAGE_CHUNKED ((size_t)-1)
+
+// Stores the data from the stream as a new version of the article. The article is created if it does not exist.
+// Returns ERROR_INPUT if the body is malformed, ERROR_EVFS if the data can not be stored or the error of the stream.
 int storage_set(const struct string *restrict name, struct stream *restrict stream, size_t size);
+void storage_retain(struct file_info *file_info);
 void storage_release(struct file_info *file_info);
+
+// Returns a reference to the cached response variant for the file version or 0 if there is no such response.
+struct storage_response *storage_response_get(struct file_info *restrict file_info, unsigned variant);
+
+// Caches the response variant for the file version, replacing any previous one. Takes over the reference of the caller.
+// The cache of a version is discarded with the version so publishing a new version invalidates it.
+void storage_response_set(struct file_info *restrict file_info, unsigned variant, struct storage_response *restrict response);
+
+void storage_response_release(struct storage_response *response);
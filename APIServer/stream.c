@@ -1,21 +1,75 @@
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 # include <poll.h>
+#if !defined(OS_WINDOWS)
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/ioctl.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+#endif
+#if defined(__linux__)
+# include <linux/errqueue.h>
+# include <linux/sockios.h>
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+# define ZEROCOPY_SUPPORT
+#endif
+
+#if defined(TLS) && defined(KTLS) && defined(__linux__)
+# include <linux/tls.h>
+# if defined(TCP_ULP) && defined(SOL_TLS) && defined(TLS_TX) && defined(TLS_CIPHER_AES_GCM_128)
+#  define KTLS_SUPPORT
+# endif
+#endif
 
 #include "base.h"
 #include "stream.h"
 
 #define terminated(stream) (!(stream)->_input)
 
-// TODO: read about TLS packet size (negotiated maximum record size)
-#define TLS_RECORD		1024
+// Counts an event that both reading and writing can cause. An HTTP/2 connection reads in one thread while other threads write.
+#define stats_count(stream, name) __atomic_add_fetch(&(stream)->stats.name, 1, __ATOMIC_RELAXED)
+
+#define CHUNKED_LINE_MAX 1024 /* chunk size line or trailer field */
+
+// Whether the written data must be encrypted by gnutls. With kernel TLS the socket encrypts it.
+#if defined(KTLS_SUPPORT)
+# define tls_write(stream) ((stream)->_tls && !(stream)->_ktls)
+#elif defined(TLS)
+# define tls_write(stream) ((stream)->_tls)
+#endif
+
+// TLS record sizing. Small records can be decrypted by the client as soon as their single TCP segment arrives. This lowers the time to first byte.
+// Big records have less overhead for bulk transfers. Records start small and get big after TLS_RAMP bytes have been sent.
+// Sending starts again with small records after the connection was idle (the congestion window may have shrunk) and at the start of each response.
+#define TLS_RECORD_MIN	1400	/* fits a single TCP segment with TLS overhead */
+#define TLS_RECORD_MAX	16384	/* 16 KiB, maximum allowed by the protocol */
+#define TLS_RAMP		65536	/* 64 KiB */
+#define TLS_IDLE		1000	/* 1s in milliseconds */
 
-#define WRITE_MAX 8192 /* rename this */
+// Writes are sized by the free space in the socket send buffer. This is used when the free space can not be determined.
+#define WRITE_MIN 4096
+
+// Limit for the data queued in the kernel that is not sent yet. Keeps the socket buffer small so that the data in it is never stale.
+#define NOTSENT_LOWAT 16384 /* 16 KiB */
+
+// Buffer used by zerocopy transmissions. It is released when the transmission with sequence number last is completed.
+struct stream_release
+{
+	unsigned last;
+	void (*release)(void *);
+	void *argument;
+	struct stream_release *next;
+};
 
 // When a flush operation is performed, if the corresponding buffer (input or output) is empty, its size is shrinked to the minimum allowed size.
 
@@ -134,9 +188,52 @@ int errno_error(int code)
 	}
 }
 
+// Sets socket options required by the stream.
+static void stream_socket(int fd)
+{
+#if !defined(OS_WINDOWS)
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	// Segments are coalesced with TCP_CORK. Nagle's algorithm would only delay small responses (and TLS records) until the previous segment is acknowledged.
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&nodelay, sizeof(nodelay));
+
+#if defined(TCP_NOTSENT_LOWAT)
+	// Report the socket as writable only when little of the written data is still waiting to be sent.
+	int value = NOTSENT_LOWAT;
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&value, sizeof(value)); // not supported for some sockets
+#endif
+}
+
+// Returns how many bytes can be written to the socket without blocking.
+static size_t send_space(int fd)
+{
+	int size;
+	socklen_t length = sizeof(size);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&size, &length) || (size <= WRITE_MIN)) return WRITE_MIN;
+
+#if defined(SIOCOUTQNSD)
+	// Subtract the data that is queued but not sent yet. Sent data that is not acknowledged is not counted.
+	// It is released as acknowledgements arrive and TCP_NOTSENT_LOWAT reports writability by the unsent data as well.
+	int queued;
+	if (!ioctl(fd, SIOCOUTQNSD, &queued) && (queued > 0))
+	{
+		if (queued >= (size - WRITE_MIN)) return WRITE_MIN;
+		size -= queued;
+	}
+#endif
+
+	return size;
+}
+
 #if defined(TLS)
 // TLS implementation based on X.509
 
+# include <pthread.h>
+# include <stdint.h>
+# include <time.h>
+
 # include "gnutls/gnutls.h"					// libgnutls
 
 // certificate authorities
@@ -168,6 +265,122 @@ extern char *tls_location;
 static gnutls_certificate_credentials_t x509;
 static gnutls_dh_params_t dh_params;
 
+// Resumption of TLS sessions.
+// Sessions are stored in a cache shared by all connections. The clients supporting session tickets keep the session state themselves.
+# define TLS_CACHE_SIZE 1024
+# define TLS_SESSION_LIFETIME 3600 /* 1 hour */
+
+struct tls_session
+{
+	unsigned char id[GNUTLS_MAX_SESSION_ID_SIZE];
+	unsigned id_size;
+	unsigned char *data;
+	size_t size;
+	time_t expire;
+};
+
+static struct tls_session tls_cache[TLS_CACHE_SIZE];
+static gnutls_datum_t ticket_key; // master key; gnutls derives the key that encrypts the tickets from it
+static unsigned long tls_handshakes, tls_resumed;
+static pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct tls_session *tls_cache_slot(const gnutls_datum_t *id)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	unsigned index;
+	for(index = 0; index < id->size; ++index)
+		hash = (hash ^ id->data[index]) * 16777619u;
+	return tls_cache + (hash % TLS_CACHE_SIZE);
+}
+
+static int tls_cache_store(void *argument, gnutls_datum_t id, gnutls_datum_t data)
+{
+	struct tls_session *session;
+	unsigned char *copy;
+
+	if (id.size > GNUTLS_MAX_SESSION_ID_SIZE) return -1;
+	copy = malloc(data.size);
+	if (!copy) return -1;
+	memcpy(copy, data.data, data.size);
+
+	// The new session replaces any session stored in the same slot.
+	pthread_mutex_lock(&tls_mutex);
+	session = tls_cache_slot(&id);
+	free(session->data);
+	memcpy(session->id, id.data, id.size);
+	session->id_size = id.size;
+	session->data = copy;
+	session->size = data.size;
+	session->expire = time(0) + TLS_SESSION_LIFETIME;
+	pthread_mutex_unlock(&tls_mutex);
+
+	return 0;
+}
+
+static gnutls_datum_t tls_cache_retrieve(void *argument, gnutls_datum_t id)
+{
+	gnutls_datum_t result = {0, 0};
+	struct tls_session *session;
+
+	pthread_mutex_lock(&tls_mutex);
+	session = tls_cache_slot(&id);
+	if (session->data && (session->id_size == id.size) && !memcmp(session->id, id.data, id.size) && (session->expire > time(0)))
+	{
+		// gnutls frees the returned data with gnutls_free().
+		result.data = gnutls_malloc(session->size);
+		if (result.data)
+		{
+			memcpy(result.data, session->data, session->size);
+			result.size = session->size;
+		}
+	}
+	pthread_mutex_unlock(&tls_mutex);
+
+	return result;
+}
+
+static int tls_cache_remove(void *argument, gnutls_datum_t id)
+{
+	struct tls_session *session;
+	int status = -1;
+
+	pthread_mutex_lock(&tls_mutex);
+	session = tls_cache_slot(&id);
+	if (session->data && (session->id_size == id.size) && !memcmp(session->id, id.data, id.size))
+	{
+		free(session->data);
+		session->data = 0;
+		status = 0;
+	}
+	pthread_mutex_unlock(&tls_mutex);
+
+	return status;
+}
+
+// Enables session resumption for a server session.
+// gnutls rotates the key that encrypts the tickets once per TLS_SESSION_LIFETIME. Tickets encrypted with the previous key are still accepted.
+static int tls_resumption(gnutls_session_t session)
+{
+	gnutls_db_set_retrieve_function(session, tls_cache_retrieve);
+	gnutls_db_set_store_function(session, tls_cache_store);
+	gnutls_db_set_remove_function(session, tls_cache_remove);
+	gnutls_db_set_cache_expiration(session, TLS_SESSION_LIFETIME);
+
+	// The master key is set only by tls_init() so it is used without locking.
+	if (ticket_key.data && (gnutls_session_ticket_enable_server(session, &ticket_key) != GNUTLS_E_SUCCESS))
+		return -1;
+	return 0;
+}
+
+void tls_stats(unsigned long *restrict handshakes, unsigned long *restrict resumed)
+{
+	pthread_mutex_lock(&tls_mutex);
+	*handshakes = tls_handshakes;
+	*resumed = tls_resumed;
+	pthread_mutex_unlock(&tls_mutex);
+}
+
 //printf("%s\n", (char *)gnutls_strerror(status));
 
 int tls_init(void)
@@ -212,6 +425,9 @@ int tls_init(void)
 	gnutls_certificate_set_dh_params(x509, dh_params);
 # endif
 
+	// Session tickets are not used if the master key cannot be generated.
+	if (gnutls_session_ticket_key_generate(&ticket_key) != GNUTLS_E_SUCCESS) ticket_key.data = 0;
+
 	gnutls_global_set_log_level(1); // TODO change this
 
 	return 0;
@@ -223,6 +439,20 @@ error:
 
 void tls_term(void)
 {
+	size_t index;
+
+	for(index = 0; index < TLS_CACHE_SIZE; ++index)
+	{
+		free(tls_cache[index].data);
+		tls_cache[index].data = 0;
+	}
+	if (ticket_key.data)
+	{
+		gnutls_memset(ticket_key.data, 0, ticket_key.size);
+		gnutls_free(ticket_key.data);
+		ticket_key.data = 0;
+	}
+
 # if !defined(DEVICE) /* devices don't have this */
 	gnutls_dh_params_deinit(dh_params);
 # endif
@@ -232,13 +462,13 @@ void tls_term(void)
 
 static inline int stream_init_tls(struct stream *restrict stream, int fd, void *tls)
 {
-	// TODO: use gnutls_record_get_max_size()
-
 	stream->_input = malloc(BUFFER_SIZE_MIN);
 	if (!stream->_input) return ERROR_MEMORY;
 	stream->_input_size = BUFFER_SIZE_MIN;
 	stream->_input_index = 0;
 	stream->_input_length = 0;
+	stream->_input_pinned = 0;
+	stream->_input_pin = false;
 
 	stream->_output = malloc(BUFFER_SIZE_MIN);
 	if (!stream->_output)
@@ -251,13 +481,25 @@ static inline int stream_init_tls(struct stream *restrict stream, int fd, void *
 	stream->_output_index = 0;
 	stream->_output_length = 0;
 
-# if !defined(OS_WINDOWS)
-	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
-# endif
+	stream_socket(fd);
 	stream->fd = fd;
+	stream->stats = (struct stream_stats){0};
+	stream->_write_space = 0;
+	stream->_cork = false;
+
+	stream->_consumed = 0;
+	stream->_consumed_argument = 0;
+
+	stream->_release = 0;
+	stream->_zerocopy_sent = 0;
+	stream->_zerocopy_done = 0;
+	stream->_zerocopy = false;
 
 	stream->_tls = tls;
 	stream->_tls_retry = 0;
+	stream->_tls_sent = 0;
+	stream->_tls_active = 0;
+	stream->_ktls = false;
 
 	return 0;
 }
@@ -300,6 +542,7 @@ error:
 	gnutls_deinit(session);
 	return -1;
 }
+// Prepares the stream for TLS handshake. The handshake is performed by calling stream_handshake() when the socket is ready.
 int stream_init_tls_accept(struct stream *restrict stream, int fd)
 {
 	int status;
@@ -307,27 +550,124 @@ int stream_init_tls_accept(struct stream *restrict stream, int fd)
 	gnutls_session_t session;
 	if (gnutls_init(&session, GNUTLS_NONBLOCK | GNUTLS_SERVER) != GNUTLS_E_SUCCESS) return -1;
 
+#if defined(KTLS_SUPPORT)
+	// Prefer the cipher supported by kernel TLS.
+	if (gnutls_priority_set_direct(session, "PERFORMANCE:-CIPHER-ALL:+AES-128-GCM:+ARCFOUR-128:+AES-128-CBC", 0) != GNUTLS_E_SUCCESS) goto error;
+#else
 	if (gnutls_priority_set_direct(session, "PERFORMANCE:-CIPHER-ALL:+ARCFOUR-128:+AES-128-CBC:+AES-128-GCM", 0) != GNUTLS_E_SUCCESS) goto error;
+#endif
 	//if (gnutls_priority_set_direct(session, "PERFORMANCE:-CIPHER-ALL:+ARCFOUR-128", 0) != GNUTLS_E_SUCCESS) goto error;
 	if (gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, x509) != GNUTLS_E_SUCCESS) goto error;
 
 	// We request no certificate from the client. Otherwise we would need to verify it.
 	// gnutls_certificate_server_set_request(session, GNUTLS_CERT_REQUEST);
 
-	// Perform TLS handshake on the socket.
-	gnutls_transport_set_ptr(session, (gnutls_transport_ptr_t)(ptrdiff_t)fd);
-	while ((status = gnutls_handshake(session)) < 0)
-		if (gnutls_error_is_fatal(status))
-			goto error;
+	if (tls_resumption(session)) goto error;
 
-	//printf("CIPHER: %s\n", gnutls_cipher_get_name(gnutls_cipher_get(session)));
+	gnutls_transport_set_ptr(session, (gnutls_transport_ptr_t)(ptrdiff_t)fd);
 
-	return stream_init_tls(stream, fd, session);
+	if (status = stream_init_tls(stream, fd, session)) goto error;
+	return 0;
 
 error:
 	gnutls_deinit(session);
 	return -1;
 }
+
+#if defined(KTLS_SUPPORT)
+// Installs the negotiated transmission keys in the kernel so that the socket encrypts the written data itself.
+// Reading is still done by gnutls. Returns whether kernel TLS is enabled.
+// Only TLS 1.2 is offloaded. A TLS 1.3 KeyUpdate from the client makes gnutls change the transmission keys which the kernel would not know.
+static bool stream_ktls(struct stream *restrict stream)
+{
+	gnutls_session_t session = stream->_tls;
+	struct tls12_crypto_info_aes_gcm_128 crypto = {0};
+	gnutls_datum_t mac, iv, key;
+	unsigned char sequence[8];
+
+	if (gnutls_cipher_get(session) != GNUTLS_CIPHER_AES_128_GCM) return false;
+	if (gnutls_record_get_state(session, 0, &mac, &iv, &key, sequence) != GNUTLS_E_SUCCESS) return false;
+
+	crypto.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	switch (gnutls_protocol_get_version(session))
+	{
+	case GNUTLS_TLS1_2:
+		// The explicit part of the nonce is the record sequence number.
+		crypto.info.version = TLS_1_2_VERSION;
+		if (iv.size < TLS_CIPHER_AES_GCM_128_SALT_SIZE) return false;
+		memcpy(crypto.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(crypto.iv, sequence, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		break;
+
+	default:
+		return false;
+	}
+	if (key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE) return false;
+	memcpy(crypto.key, key.data, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+	memcpy(crypto.rec_seq, sequence, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+
+	// The TLS module may not be available. The socket is not changed if attaching it fails.
+	if (setsockopt(stream->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) return false;
+	if (setsockopt(stream->fd, SOL_TLS, TLS_TX, (void *)&crypto, sizeof(crypto)) < 0) return false; // the socket keeps working without encryption offload
+
+	return true;
+}
+
+// Sends close_notify alert through the kernel TLS socket.
+static void stream_ktls_bye(struct stream *restrict stream)
+{
+	char control[CMSG_SPACE(sizeof(unsigned char))];
+	unsigned char alert[2] = {1, 0}; // warning, close_notify
+	struct iovec chunk = {.iov_base = alert, .iov_len = sizeof(alert)};
+	struct msghdr message = {.msg_iov = &chunk, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = 21; // alert record
+
+	sendmsg(stream->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+#endif
+
+// Continues TLS handshake without blocking.
+// Returns 0 when the handshake is completed. Returns ERROR_AGAIN if the socket must become ready for event before the handshake can continue.
+int stream_handshake(struct stream *restrict stream, short *restrict event)
+{
+	int status;
+
+	while ((status = gnutls_handshake(stream->_tls)) < 0)
+	{
+		switch (status)
+		{
+		case GNUTLS_E_AGAIN:
+			// Determine whether the handshake is waiting to receive or to send data.
+			stats_count(stream, again);
+			*event = (gnutls_record_get_direction(stream->_tls) ? POLLOUT : POLLIN);
+			return ERROR_AGAIN;
+
+		case GNUTLS_E_INTERRUPTED:
+			continue;
+
+		default:
+			if (gnutls_error_is_fatal(status)) return ERROR_NETWORK;
+		}
+	}
+
+	//printf("CIPHER: %s\n", gnutls_cipher_get_name(gnutls_cipher_get(session)));
+
+	pthread_mutex_lock(&tls_mutex);
+	tls_handshakes += 1;
+	if (gnutls_session_is_resumed(stream->_tls)) tls_resumed += 1;
+	pthread_mutex_unlock(&tls_mutex);
+
+#if defined(KTLS_SUPPORT)
+	stream->_ktls = stream_ktls(stream);
+#endif
+
+	return 0;
+}
 #endif /* TLS */
 
 int stream_init(struct stream *restrict stream, int fd)
@@ -337,6 +677,8 @@ int stream_init(struct stream *restrict stream, int fd)
 	stream->_input_size = BUFFER_SIZE_MIN;
 	stream->_input_index = 0;
 	stream->_input_length = 0;
+	stream->_input_pinned = 0;
+	stream->_input_pin = false;
 
 	stream->_output = malloc(BUFFER_SIZE_MIN);
 	if (!stream->_output)
@@ -349,14 +691,26 @@ int stream_init(struct stream *restrict stream, int fd)
 	stream->_output_index = 0;
 	stream->_output_length = 0;
 
-#if !defined(OS_WINDOWS)
-	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
-#endif
+	stream_socket(fd);
 	stream->fd = fd;
+	stream->stats = (struct stream_stats){0};
+	stream->_write_space = 0;
+	stream->_cork = false;
+
+	stream->_consumed = 0;
+	stream->_consumed_argument = 0;
+
+	stream->_release = 0;
+	stream->_zerocopy_sent = 0;
+	stream->_zerocopy_done = 0;
+	stream->_zerocopy = false;
 
 #if defined(TLS)
 	stream->_tls = 0;
 	stream->_tls_retry = 0;
+	stream->_tls_sent = 0;
+	stream->_tls_active = 0;
+	stream->_ktls = false;
 #endif
 
 	return 0;
@@ -368,11 +722,33 @@ int stream_term(struct stream *restrict stream)
 
 	free(stream->_input);
 	stream->_input = 0;
+	free(stream->_input_pinned);
+	stream->_input_pinned = 0;
 
 	free(stream->_output);
 	stream->_output = 0;
 
+	// Release the buffers of the uncompleted zerocopy transmissions.
+	// The kernel keeps its own references to the pages so they remain valid after they are unmapped.
+	stream_zerocopy_reap(stream);
+	while (stream->_release)
+	{
+		struct stream_release *item = stream->_release;
+		stream->_release = item->next;
+		item->release(item->argument);
+		free(item);
+	}
+
 #if defined(TLS)
+#if defined(KTLS_SUPPORT)
+	if (stream->_ktls)
+	{
+		// gnutls no longer knows the state of the transmission. Only the kernel can send the alert.
+		stream_ktls_bye(stream);
+		gnutls_deinit(stream->_tls);
+		return true;
+	}
+#endif
 	if (stream->_tls)
 	{
 		// TODO: check gnutls_bye return status
@@ -394,21 +770,24 @@ size_t stream_cached(const struct stream *stream)
 #endif
 }
 
-static int timeout(int fd, short event)
+static int timeout(struct stream *restrict stream, short event)
 {
 	struct pollfd wait = {
-		.fd = fd,
+		.fd = stream->fd,
 		.events = event,
 		.revents = 0
 	};
 	int status;
 
+	stats_count(stream, waits);
+
 	while (1)
 	{
 		status = poll(&wait, 1, TIMEOUT);
 		if (status > 0)
 		{
 			if (wait.revents & event) return 0;
+			else if ((wait.revents == POLLERR) && stream_zerocopy_reap(stream)) continue; // zerocopy completion notification
 			else return ERROR_NETWORK;
 		}
 		else if ((status < 0) && ((errno == EINTR) || (errno == EAGAIN))) continue;
@@ -416,6 +795,25 @@ static int timeout(int fd, short event)
 	}
 }
 
+// Moves the available data to a new buffer. The pinned data stays in the old buffer until it is unpinned.
+static int input_evacuate(struct stream *restrict stream, size_t size)
+{
+	size_t available = stream->_input_length - stream->_input_index;
+	char *buffer = malloc(sizeof(char) * size);
+	if (!buffer) return ERROR_MEMORY;
+	memcpy(buffer, stream->_input + stream->_input_index, available);
+	stats_count(stream, reallocs);
+
+	stream->_input_pinned = stream->_input;
+	stream->_input_pin = false;
+
+	stream->_input = buffer;
+	stream->_input_size = size;
+	stream->_input_index = 0;
+	stream->_input_length = available;
+	return 0;
+}
+
 int stream_read(struct stream *restrict stream, struct string *restrict buffer, size_t length)
 {
 	size_t available = stream->_input_length - stream->_input_index;
@@ -430,6 +828,12 @@ int stream_read(struct stream *restrict stream, struct string *restrict buffer,
 
 		if (length > BUFFER_SIZE_MAX) return ERROR_MEMORY; // TODO: is this okay?
 
+		if (stream->_input_pin)
+		{
+			if (input_evacuate(stream, size)) return ERROR_MEMORY;
+			goto read;
+		}
+
 		if (available) // the buffer has data that should be kept after resizing
 		{
 			buffer = realloc(stream->_input, sizeof(char) * size);
@@ -439,6 +843,7 @@ int stream_read(struct stream *restrict stream, struct string *restrict buffer,
 				stream->_input = 0;
 				return ERROR_MEMORY;
 			}
+			stats_count(stream, reallocs);
 
 			// Move the available data to the beginning of the buffer if one of these holds:
 			//  size is not enough to fit the requested data with the current buffer data layout
@@ -446,7 +851,11 @@ int stream_read(struct stream *restrict stream, struct string *restrict buffer,
 			if (((length - stream->_input_index) < length) || (stream->_input_size <= stream->_input_index * 2))
 			{
 				// Move byte by byte because the source and the destination overlap.
-				if (stream->_input_index) memmove(buffer, buffer + stream->_input_index, available);
+				if (stream->_input_index)
+				{
+					memmove(buffer, buffer + stream->_input_index, available);
+					stats_count(stream, moves);
+				}
 
 				stream->_input_index = 0;
 				stream->_input_length = available;
@@ -462,6 +871,7 @@ int stream_read(struct stream *restrict stream, struct string *restrict buffer,
 				stream->_input = 0;
 				return ERROR_MEMORY;
 			}
+			stats_count(stream, reallocs);
 		}
 
 		// Remember the new buffer and its size.
@@ -477,12 +887,17 @@ read:
 		ssize_t size;
 
 		// Realign buffer data if necessary
-		if ((stream->_input_index + length) > stream->_input_size)
+		if (((stream->_input_index + length) > stream->_input_size) && stream->_input_pin)
+		{
+			if (input_evacuate(stream, stream->_input_size)) return ERROR_MEMORY;
+		}
+		else if ((stream->_input_index + length) > stream->_input_size)
 		{
 			// Move byte by byte because the source and the destination overlap
 			size_t i;
 			for(i = 0; i < available; ++i)
 				stream->_input[i] = stream->_input[i + stream->_input_index];
+			stats_count(stream, moves);
 
 			stream->_input_index = 0;
 			stream->_input_length = available;
@@ -496,8 +911,15 @@ read:
 			else
 #endif
 				size = read(stream->fd, stream->_input + stream->_input_length, stream->_input_size - stream->_input_length);
+			stream->stats.reads += 1;
 			if (size > 0)
 			{
+#if defined(TLS)
+				// Received data means a new request. Its response starts with small records.
+				stream->_tls_sent = 0;
+#endif
+				stream->stats.received += size;
+				if (stream->_consumed) (*stream->_consumed)(stream->_consumed_argument, size);
 				stream->_input_length += size;
 				available += size;
 				if (available < length) continue;
@@ -515,8 +937,9 @@ read:
 				{
 					int status;
 				case GNUTLS_E_AGAIN: // TODO ?call timeout(, POLLOUT)
+					stats_count(stream, again);
 					// Check if there is more data waiting to be read.
-					if (status = timeout(stream->fd, POLLIN)) return status;
+					if (status = timeout(stream, POLLIN)) return status;
 				case GNUTLS_E_INTERRUPTED:
 					continue;
 
@@ -535,8 +958,10 @@ read:
 
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 			{
+				stats_count(stream, again);
+
 				// Check if there is more data waiting to be read.
-				int status = timeout(stream->fd, POLLIN);
+				int status = timeout(stream, POLLIN);
 				if (status) return status;
 			}
 			else if (errno != EINTR) return errno_error(errno);
@@ -554,7 +979,7 @@ void stream_read_flush(struct stream *restrict stream, size_t length)
 	stream->_input_index += length;
 
 	// Reset length and index position if the buffer holds no data
-	if (stream->_input_index == stream->_input_length)
+	if ((stream->_input_index == stream->_input_length) && !stream->_input_pin)
 	{
 		stream->_input_index = 0;
 		stream->_input_length = 0;
@@ -562,29 +987,204 @@ void stream_read_flush(struct stream *restrict stream, size_t length)
 		{
 			stream->_input = realloc(stream->_input, BUFFER_SIZE_MIN);
 			stream->_input_size = BUFFER_SIZE_MIN;
+			stats_count(stream, reallocs);
 		}
 	}
 }
 
+bool stream_tls(const struct stream *stream)
+{
+#if defined(TLS)
+	return (stream->_tls != 0);
+#else
+	return false;
+#endif
+}
+
+void stream_read_notify(struct stream *restrict stream, void (*consumed)(void *, size_t), void *argument)
+{
+	stream->_consumed = consumed;
+	stream->_consumed_argument = argument;
+}
+
+// Sets line to the next line in the input, including the line terminator.
+static int chunked_line(struct stream *restrict stream, struct string *restrict line)
+{
+	size_t length = 0;
+	int status;
+	while (1)
+	{
+		if (status = stream_read(stream, line, length + 1)) return status;
+		for(; length < line->length; ++length)
+			if (line->data[length] == '\n')
+			{
+				line->length = length + 1;
+				return 0;
+			}
+		if (length >= CHUNKED_LINE_MAX) return ERROR_INPUT;
+	}
+}
+
+int stream_read_chunked(struct stream *restrict stream, struct string *restrict buffer, struct stream_chunked *restrict chunked)
+{
+	int status;
+
+	if (!chunked->size)
+	{
+		struct string line;
+		size_t index, size;
+
+		if (chunked->finished)
+		{
+			buffer->length = 0;
+			return 0;
+		}
+
+		// The data of each chunk is followed by CRLF.
+		if (chunked->started)
+		{
+			if (status = chunked_line(stream, &line)) return status;
+			if (line.length > 2) return ERROR_INPUT;
+			stream_read_flush(stream, line.length);
+		}
+
+		// chunk-size [ chunk-ext ] CRLF
+		if (status = chunked_line(stream, &line)) return status;
+		size = 0;
+		for(index = 0; isxdigit(line.data[index]); ++index)
+		{
+			if (size > (SIZE_MAX >> 4)) return ERROR_INPUT;
+			size = (size << 4) + (isdigit(line.data[index]) ? (line.data[index] - '0') : ((line.data[index] | 0x20) - 'a' + 10));
+		}
+		if (!index) return ERROR_INPUT;
+		stream_read_flush(stream, line.length); // chunk extensions are ignored
+		chunked->started = true;
+
+		if (!size)
+		{
+			// last-chunk. Skip the trailer fields until the empty line.
+			do
+			{
+				if (status = chunked_line(stream, &line)) return status;
+				stream_read_flush(stream, line.length);
+			} while (line.length > 2);
+
+			chunked->finished = true;
+			buffer->length = 0;
+			return 0;
+		}
+
+		chunked->size = size;
+	}
+
+	// Return as much of the chunk as is available.
+	if (status = stream_read(stream, buffer, 1)) return status;
+	if (buffer->length > chunked->size) buffer->length = chunked->size;
+	return 0;
+}
+
+void stream_read_chunked_flush(struct stream *restrict stream, struct stream_chunked *restrict chunked, size_t length)
+{
+	stream_read_flush(stream, length);
+	chunked->size -= length;
+}
+
+void stream_read_pin(struct stream *restrict stream, size_t length)
+{
+	stream->_input_index += length;
+	stream->_input_pin = true;
+}
+
+void stream_read_unpin(struct stream *restrict stream)
+{
+	free(stream->_input_pinned);
+	stream->_input_pinned = 0;
+	stream->_input_pin = false;
+	stream_read_flush(stream, 0); // reuse the buffer if it has no more data
+}
+
+#if defined(TLS)
+// Returns monotonic time in milliseconds. Wall-clock seconds are too coarse to tell whether a transfer paused.
+static uint64_t tls_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Returns the size of the next TLS record.
+static size_t tls_record(const struct stream *restrict stream)
+{
+	size_t size;
+
+	if ((stream->_tls_sent < TLS_RAMP) || ((tls_clock() - stream->_tls_active) >= TLS_IDLE)) return TLS_RECORD_MIN;
+
+	// The client may have negotiated smaller records.
+	size = gnutls_record_get_max_size(stream->_tls);
+	return ((size < TLS_RECORD_MAX) ? size : TLS_RECORD_MAX);
+}
+#endif
+
+// Makes sure the output buffer can hold size bytes. Buffered data is moved at the start of the buffer.
+static int output_reserve(struct stream *restrict stream, size_t size)
+{
+	if (size <= (stream->_output_size - stream->_output_length)) return 0;
+
+	if (stream->_output_index)
+	{
+		stream->_output_length -= stream->_output_index;
+		memmove(stream->_output, stream->_output + stream->_output_index, stream->_output_length);
+		stream->_output_index = 0;
+		stats_count(stream, moves);
+	}
+
+	if ((stream->_output_length + size) > stream->_output_size)
+	{
+		char *new = realloc(stream->_output, stream->_output_length + size);
+		if (!new) return ERROR_MEMORY;
+		stream->_output = new;
+		stream->_output_size = stream->_output_length + size;
+		stats_count(stream, reallocs);
+	}
+
+	return 0;
+}
+
 // Tries to write data without blocking. Returns number of bytes written or error code on error.
 static ssize_t stream_write_internal(struct stream *restrict stream, const char *restrict buffer, size_t size)
 {
 	ssize_t status;
 
 #if defined(TLS)
-	if (stream->_tls)
+	if (tls_write(stream))
 	{
-		status = gnutls_write(stream->_tls, buffer, (stream->_tls_retry ? stream->_tls_retry : ((size > TLS_RECORD) ? TLS_RECORD : size)));
+		// An interrupted write must be retried with the same size.
+		if (stream->_tls_retry) size = stream->_tls_retry;
+		else
+		{
+			size_t record = tls_record(stream);
+			if (size > record) size = record;
+		}
+
+		status = gnutls_write(stream->_tls, buffer, size);
+		stream->stats.writes += 1;
 		if (status > 0)
 		{
+			uint64_t now = tls_clock();
+			if ((now - stream->_tls_active) >= TLS_IDLE) stream->_tls_sent = 0;
+			stream->_tls_sent += status;
+			stream->_tls_active = now;
+
 			stream->_tls_retry = 0;
+			stream->stats.sent += status;
 			return status;
 		}
 		// TODO handle all possible errors and handle them properly
 		switch (status)
 		{
-		case GNUTLS_E_INTERRUPTED:
 		case GNUTLS_E_AGAIN:
+			stats_count(stream, again);
+		case GNUTLS_E_INTERRUPTED:
 			if (!stream->_tls_retry) stream->_tls_retry = size;
 			return 0;
 		default:
@@ -597,12 +1197,26 @@ static ssize_t stream_write_internal(struct stream *restrict stream, const char
 	}
 #endif
 
-	status = write(stream->fd, buffer, ((size > WRITE_MAX) ? WRITE_MAX : size));
+	// Write as much as the socket is expected to accept. Query the send space again when the expected space is used up.
+	if (!stream->_write_space) stream->_write_space = send_space(stream->fd);
+	if (size > stream->_write_space) size = stream->_write_space;
+
+	status = write(stream->fd, buffer, size);
+	stream->stats.writes += 1;
 	if (status < 0)
 	{
+		stream->_write_space = 0;
 		status = errno_error(errno);
-		if (status == ERROR_AGAIN) return 0;
+		if (status == ERROR_AGAIN)
+		{
+			stats_count(stream, again);
+			return 0;
+		}
+		return status;
 	}
+	stream->stats.sent += status;
+	if (status < size) stream->_write_space = 0; // the send buffer is full
+	else stream->_write_space -= status;
 	return status;
 }
 
@@ -612,6 +1226,7 @@ int stream_write(struct stream *restrict stream, const struct string *buffer)
 	size_t available;
 	size_t index = 0;
 #if defined(TLS)
+	size_t record = (tls_write(stream) ? tls_record(stream) : 0);
 	size_t rest;
 #endif
 
@@ -621,29 +1236,27 @@ int stream_write(struct stream *restrict stream, const struct string *buffer)
 #if defined(TLS)
 		// Send as much data as possible in a single request for TLS unless we must retry the last write attempt.
 		// Add more data to the output buffer if the available data is less than the optimal amount.
-		if (stream->_tls && !stream->_tls_retry && (available < TLS_RECORD))
+		if (record && !stream->_tls_retry && (available < record))
 		{
-			rest = TLS_RECORD - available;
-
-			// If the required amount of data won't fit in the output buffer, move buffer contents at the start of the buffer.
-			if (rest < (stream->_output_size - stream->_output_length))
-			{
-				stream->_output_length -= stream->_output_index;
-				memmove(stream->_output, stream->_output + stream->_output_index, stream->_output_length);
-				stream->_output_index = 0;
-			}
+			rest = record - available;
 
 			// If the data is less than the expected packet size, buffer it without sending anything.
-			if (rest > buffer->length)
+			if (rest > (buffer->length - index))
 			{
-				memcpy(stream->_output + stream->_output_length, buffer->data + index, buffer->length);
-				stream->_output_length += buffer->length;
+				rest = buffer->length - index;
+				if (size = output_reserve(stream, rest)) return size;
+				memcpy(stream->_output + stream->_output_length, buffer->data + index, rest);
+				stream->_output_length += rest;
+				stream->stats.buffered += rest;
 				return 0;
 			}
 
+			if (size = output_reserve(stream, rest)) return size;
 			memcpy(stream->_output + stream->_output_length, buffer->data + index, rest);
 			stream->_output_length += rest;
+			stream->stats.buffered += rest;
 			index += rest;
+			available = record;
 		}
 #endif
 
@@ -662,32 +1275,19 @@ int stream_write(struct stream *restrict stream, const struct string *buffer)
 
 		// The remaining data can not be written immediately.
 
-		available += buffer->length;
-		if (available > BUFFER_SIZE_MAX)
+		if ((available + buffer->length - index) > BUFFER_SIZE_MAX)
 		{
 			// The remaining data is too much to buffer it. Wait until more data can be written.
-			if (size = timeout(stream->fd, POLLOUT)) return size;
+			if (size = timeout(stream, POLLOUT)) return size;
 		}
 		else
 		{
-			// Move buffer data at the beginning of the buffer.
-			if (stream->_output_index)
-			{
-				stream->_output_length -= stream->_output_index;
-				memmove(stream->_output, stream->_output + stream->_output_index, stream->_output_length);
-				stream->_output_index = 0;
-			}
-
 			// Buffer the remaining data. Expand the buffer if it's not big enough.
-			if (available > stream->_output_size)
-			{
-				char *new = realloc(stream->_output, available);
-				if (!new) return ERROR_MEMORY;
-				stream->_output = new;
-				stream->_output_size = available;
-			}
-			memcpy(stream->_output + stream->_output_length, buffer->data, buffer->length);
-			stream->_output_length = available;
+			available = buffer->length - index;
+			if (size = output_reserve(stream, available)) return size;
+			memcpy(stream->_output + stream->_output_length, buffer->data + index, available);
+			stream->_output_length += available;
+			stream->stats.buffered += available;
 
 			return 0;
 		}
@@ -700,10 +1300,12 @@ int stream_write(struct stream *restrict stream, const struct string *buffer)
 	{
 #if defined(TLS)
 		// Buffer the data instead of sending it if it is less than the optimal size for TLS record.
-		if (stream->_tls && (available < TLS_RECORD))
+		if (available < record)
 		{
+			if (size = output_reserve(stream, available)) return size;
 			memcpy(stream->_output, buffer->data + index, available);
 			stream->_output_length = available;
+			stream->stats.buffered += available;
 			return 0;
 		}
 #endif
@@ -721,20 +1323,15 @@ int stream_write(struct stream *restrict stream, const struct string *buffer)
 		if (available > BUFFER_SIZE_MAX)
 		{
 			// The remaining data is too much to buffer it. Wait until more data can be written.
-			if (size = timeout(stream->fd, POLLOUT)) return size;
+			if (size = timeout(stream, POLLOUT)) return size;
 		}
 		else
 		{
 			// Buffer the remaining data. Expand the buffer if it's not big enough.
-			if (available > stream->_output_size)
-			{
-				char *new = realloc(stream->_output, available);
-				if (!new) return ERROR_MEMORY;
-				stream->_output = new;
-				stream->_output_size = available;
-			}
+			if (size = output_reserve(stream, available)) return size;
 			memcpy(stream->_output, buffer->data + index, available);
 			stream->_output_length = available;
+			stream->stats.buffered += available;
 			return 0;
 		}
 	}
@@ -742,6 +1339,108 @@ int stream_write(struct stream *restrict stream, const struct string *buffer)
 	return 0;
 }
 
+#if !defined(OS_WINDOWS)
+// Copies the buffers starting at the given offset in the first buffer to the output buffer.
+static int output_append(struct stream *restrict stream, const struct string *buffers, size_t count, size_t offset)
+{
+	size_t size = 0, index;
+	int status;
+
+	for(index = 0; index < count; ++index)
+		size += buffers[index].length;
+	size -= offset;
+	if (status = output_reserve(stream, size)) return status;
+
+	for(index = 0; index < count; ++index)
+	{
+		memcpy(stream->_output + stream->_output_length, buffers[index].data + offset, buffers[index].length - offset);
+		stream->_output_length += buffers[index].length - offset;
+		offset = 0;
+	}
+	stream->stats.buffered += size;
+
+	return 0;
+}
+#endif
+
+int stream_write_vector(struct stream *restrict stream, const struct string *buffers, size_t count)
+{
+	size_t index;
+	ssize_t size;
+
+#if !defined(OS_WINDOWS)
+	struct iovec vector[STREAM_VECTOR_MAX];
+	size_t offset = 0, available;
+
+	// Fall back to separate writes when the data can not be passed to the kernel directly.
+	if ((count > STREAM_VECTOR_MAX) || (stream->_output_length > stream->_output_index)
+# if defined(TLS)
+		|| tls_write(stream)
+# endif
+	)
+#endif
+	{
+		for(index = 0; index < count; ++index)
+			if (size = stream_write(stream, buffers + index)) return size;
+		return 0;
+	}
+
+#if !defined(OS_WINDOWS)
+	// Skip empty buffers so that the vector starts with data to write.
+	while (count && !buffers->length)
+	{
+		buffers += 1;
+		count -= 1;
+	}
+
+	while (count)
+	{
+		available = 0;
+		for(index = 0; index < count; ++index)
+		{
+			vector[index].iov_base = buffers[index].data + (index ? 0 : offset);
+			vector[index].iov_len = buffers[index].length - (index ? 0 : offset);
+			available += vector[index].iov_len;
+		}
+
+		size = writev(stream->fd, vector, count);
+		stream->stats.writes += 1;
+		if (size > 0)
+		{
+			stream->stats.sent += size;
+			if ((size < available) || (size >= stream->_write_space)) stream->_write_space = 0; // the send buffer is full
+			else stream->_write_space -= size;
+
+			// Skip the data that is written.
+			size += offset;
+			while (count && (size >= buffers->length))
+			{
+				size -= buffers->length;
+				buffers += 1;
+				count -= 1;
+			}
+			offset = size;
+			continue;
+		}
+
+		stream->_write_space = 0;
+		size = errno_error(errno);
+		if (size != ERROR_AGAIN) return size;
+		stats_count(stream, again);
+
+		// The remaining data can not be written immediately.
+		if (available > BUFFER_SIZE_MAX)
+		{
+			// The remaining data is too much to buffer it. Wait until more data can be written.
+			if (size = timeout(stream, POLLOUT)) return size;
+		}
+		else return output_append(stream, buffers, count, offset);
+	}
+
+	return 0;
+#endif
+}
+
 #include "log.h"
 
 int stream_write_flush(struct stream *restrict stream)
@@ -760,7 +1459,7 @@ int stream_write_flush(struct stream *restrict stream)
 		else if (size) return size;
 
 		// Wait until more data can be written.
-		if (size = timeout(stream->fd, POLLOUT)) return size;
+		if (size = timeout(stream, POLLOUT)) return size;
 	}
 
 	// Set output buffer as empty. Shrink it if necessary.
@@ -770,7 +1469,168 @@ int stream_write_flush(struct stream *restrict stream)
 	{
 		stream->_output = realloc(stream->_output, BUFFER_SIZE_MIN);
 		stream->_output_size = BUFFER_SIZE_MIN;
+		stats_count(stream, reallocs);
 	}
 
 	return 0;
 }
+
+// Corking makes the kernel hold partial segments until the cork is removed. This way response headers and body are sent together.
+int stream_cork(struct stream *restrict stream, bool cork)
+{
+	if (stream->_cork == cork) return 0;
+
+#if defined(TCP_CORK)
+	int value = cork;
+	if (setsockopt(stream->fd, IPPROTO_TCP, TCP_CORK, (void *)&value, sizeof(value)) < 0) return errno_error(errno);
+#endif
+	stream->_cork = cork;
+
+	return 0;
+}
+
+// Reads zerocopy completion notifications from the socket error queue and releases the buffers no longer used by the kernel.
+// Returns whether any notification was read.
+bool stream_zerocopy_reap(struct stream *restrict stream)
+{
+#if defined(ZEROCOPY_SUPPORT)
+	char control[128];
+	struct msghdr message = {0};
+	struct cmsghdr *cmsg;
+	bool reaped = false;
+
+	if (!stream->_zerocopy) return false;
+
+	while (1)
+	{
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if (recvmsg(stream->fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+		for(cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+		{
+			if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) || ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))))
+				continue;
+
+			// Each notification covers the range of transmissions [ee_info, ee_data]. TCP completes transmissions in order.
+			struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (error->ee_errno || (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) continue;
+			stream->_zerocopy_done = error->ee_data + 1;
+			reaped = true;
+		}
+	}
+
+	// Release the buffers whose transmissions are completed.
+	struct stream_release **item = &stream->_release, *release;
+	while (release = *item)
+	{
+		if ((int)(stream->_zerocopy_done - release->last) > 0)
+		{
+			*item = release->next;
+			release->release(release->argument);
+			free(release);
+		}
+		else item = &release->next;
+	}
+
+	return reaped;
+#else
+	return false;
+#endif
+}
+
+int stream_write_zerocopy(struct stream *restrict stream, const struct string *buffer, void (*release)(void *), void *argument)
+{
+#if defined(ZEROCOPY_SUPPORT)
+	struct stream_release *item;
+	struct iovec chunk;
+	struct msghdr message = {.msg_iov = &chunk, .msg_iovlen = 1};
+	size_t index = 0;
+	ssize_t size;
+	int status = 0;
+
+# if defined(TLS)
+	if (stream->_tls) goto copy; // not supported for TLS, including kernel TLS
+# endif
+
+	if (!stream->_zerocopy)
+	{
+		int value = 1;
+		if (setsockopt(stream->fd, SOL_SOCKET, SO_ZEROCOPY, (void *)&value, sizeof(value)) < 0) goto copy;
+		stream->_zerocopy = true;
+	}
+
+	item = malloc(sizeof(*item));
+	if (!item) return ERROR_MEMORY;
+
+	// The buffered data must be sent first.
+	if (status = stream_write_flush(stream))
+	{
+		free(item);
+		return status;
+	}
+
+	while (index < buffer->length)
+	{
+		chunk.iov_base = buffer->data + index;
+		chunk.iov_len = buffer->length - index;
+		size = sendmsg(stream->fd, &message, MSG_ZEROCOPY);
+		stream->stats.writes += 1;
+		if (size >= 0)
+		{
+			stream->_zerocopy_sent += 1;
+			stream->stats.sent += size;
+			index += size;
+			continue;
+		}
+
+		// ENOBUFS means that too many notifications are pending.
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS))
+		{
+			stats_count(stream, again);
+			stream_zerocopy_reap(stream);
+			if (status = timeout(stream, POLLOUT)) break;
+		}
+		else if (errno != EINTR)
+		{
+			status = errno_error(errno);
+			break;
+		}
+	}
+
+	if (index)
+	{
+		item->last = stream->_zerocopy_sent - 1;
+		item->release = release;
+		item->argument = argument;
+		item->next = stream->_release;
+		stream->_release = item;
+	}
+	else
+	{
+		free(item);
+		release(argument);
+	}
+
+	stream_zerocopy_reap(stream);
+	return ((index == buffer->length) ? 0 : status);
+
+copy:
+#endif
+	{
+		int status = stream_write(stream, buffer);
+		if (!status) status = stream_write_flush(stream);
+		release(argument);
+		return status;
+	}
+}
+
+// Adds the counters accumulated since the last call to total. Remembers the current counters in last.
+void stream_stats_add(struct stream_stats *restrict total, const struct stream_stats *restrict stats, struct stream_stats *restrict last)
+{
+	#define STREAM_STATS_ADD(name) total->name += stats->name - last->name;
+	STREAM_STATS(STREAM_STATS_ADD)
+	#undef STREAM_STATS_ADD
+
+	*last = *stats;
+}
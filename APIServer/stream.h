@@ -3,18 +3,53 @@
 #define BUFFER_SIZE_MIN 1024	/* 1 KiB */
 #define BUFFER_SIZE_MAX 65536	/* 64 KiB */
 
+// I/O counters. Each counter is a field of struct stream_stats.
+// Counters of events caused by both reading and writing (again, waits, reallocs, moves) are updated atomically.
+#define STREAM_STATS(_) \
+	_(reads)		/* read system calls */ \
+	_(writes)		/* write system calls */ \
+	_(again)		/* operations that could not complete without blocking */ \
+	_(waits)		/* waits for the socket to become ready */ \
+	_(reallocs)		/* buffer reallocations */ \
+	_(moves)		/* moves of buffered data to the start of a buffer */ \
+	_(received)		/* bytes read */ \
+	_(sent)			/* bytes written */ \
+	_(buffered)		/* bytes copied to the output buffer */
+
+#define STREAM_STATS_FIELD(name) unsigned long name;
+struct stream_stats
+{
+	STREAM_STATS(STREAM_STATS_FIELD)
+};
+#undef STREAM_STATS_FIELD
+
 struct stream
 {
 	char *_input;
 	size_t _input_size, _input_index, _input_length;
+	char *_input_pinned; // previous input buffer that still holds pinned data
+	bool _input_pin; // whether the data before _input_index must stay at the same address
 
 	char *_output;
 	size_t _output_size, _output_index, _output_length;
 
 	int fd;
+	struct stream_stats stats;
+	size_t _write_space; // bytes the socket is expected to accept before its send space is queried again
+	bool _cork;
+
+	void (*_consumed)(void *, size_t); // called with the number of bytes read from fd
+	void *_consumed_argument;
+
+	struct stream_release *_release; // buffers of zerocopy transmissions that are not completed yet
+	unsigned _zerocopy_sent, _zerocopy_done; // zerocopy transmission counters (used as sequence numbers)
+	bool _zerocopy; // whether the socket supports zerocopy transmission
 #if defined(TLS)
 	void *_tls;
 	size_t _tls_retry; // amount of data that could not be written without blocking on the last request
+	size_t _tls_sent; // bytes sent since the start of the response or since the connection was idle
+	unsigned long long _tls_active; // monotonic time of the last write in milliseconds
+	bool _ktls; // whether the kernel encrypts the written data
 #endif
 };
 
@@ -24,15 +59,54 @@ void tls_term(void);
 
 int stream_init_tls_connect(struct stream *restrict stream, int fd, const char *restrict domain);
 int stream_init_tls_accept(struct stream *restrict stream, int fd);
+int stream_handshake(struct stream *restrict stream, short *restrict event);
+
+// Returns the number of completed server handshakes and how many of them resumed a previous session.
+void tls_stats(unsigned long *restrict handshakes, unsigned long *restrict resumed);
 #endif
 
 int stream_init(struct stream *restrict stream, int fd);
 int stream_term(struct stream *restrict stream);
 
+// Returns whether the data of the stream is encrypted with TLS.
+bool stream_tls(const struct stream *stream);
+
 size_t stream_cached(const struct stream *stream);
 
 int stream_read(struct stream *restrict stream, struct string *restrict buffer, size_t length);
 void stream_read_flush(struct stream *restrict stream, size_t length);
 
+// consumed(argument, size) is called each time size bytes are read from the file descriptor of the stream.
+void stream_read_notify(struct stream *restrict stream, void (*consumed)(void *, size_t), void *argument);
+
+// State of a body with chunked transfer coding. Must be initialized with 0.
+struct stream_chunked
+{
+	size_t size; // bytes remaining in the current chunk
+	bool started; // whether a chunk was read
+	bool finished; // whether the last chunk was read
+};
+
+// Sets buffer to the next part of a body with chunked transfer coding. The buffer is empty at the end of the body.
+// The data must be marked as read with stream_read_chunked_flush().
+int stream_read_chunked(struct stream *restrict stream, struct string *restrict buffer, struct stream_chunked *restrict chunked);
+void stream_read_chunked_flush(struct stream *restrict stream, struct stream_chunked *restrict chunked, size_t length);
+
+// Marks the data as read like stream_read_flush() but keeps it at the same address until stream_read_unpin().
+void stream_read_pin(struct stream *restrict stream, size_t length);
+void stream_read_unpin(struct stream *restrict stream);
+
 int stream_write(struct stream *restrict stream, const struct string *buffer);
 int stream_write_flush(struct stream *restrict stream);
+
+// Writes the buffers in order with as few system calls as possible. Buffers data that can not be written immediately like stream_write().
+#define STREAM_VECTOR_MAX 8 /* more buffers are written one by one */
+int stream_write_vector(struct stream *restrict stream, const struct string *buffers, size_t count);
+
+int stream_cork(struct stream *restrict stream, bool cork);
+
+// Writes the buffer without copying it. release(argument) is called when the kernel no longer uses the buffer.
+int stream_write_zerocopy(struct stream *restrict stream, const struct string *buffer, void (*release)(void *), void *argument);
+bool stream_zerocopy_reap(struct stream *restrict stream);
+
+void stream_stats_add(struct stream_stats *restrict total, const struct stream_stats *restrict stats, struct stream_stats *restrict last);
@@ -8,20 +8,42 @@ bool vector_init(struct vector *restrict v, size_t size)
 {
 	v->length = 0;
 	v->size = size;
+	v->arena = 0;
 
 	v->data = malloc(sizeof(void *) * size);
 	if (!v->data) return 0;
 	return v;
 }
 
+bool vector_init_arena(struct vector *restrict v, size_t size, struct arena *restrict arena)
+{
+	v->length = 0;
+	v->size = size;
+	v->arena = arena;
+
+	v->data = arena_alloc(arena, sizeof(void *) * size);
+	if (!v->data) return 0;
+	return v;
+}
+
 bool vector_add(struct vector *restrict v, void *value)
 {
 	if (v->length == v->size)
 	{
 		void **buffer;
+		if (v->arena)
+		{
+			// The old data stays in the arena until it is freed.
+			buffer = arena_alloc(v->arena, sizeof(void *) * v->size * 2);
+			if (!buffer) return 0; // not enough memory; operation canceled
+			memcpy(buffer, v->data, sizeof(void *) * v->size);
+		}
+		else
+		{
+			buffer = realloc(v->data, sizeof(void *) * v->size * 2);
+			if (!buffer) return 0; // not enough memory; operation canceled
+		}
 		v->size *= 2;
-		buffer = realloc(v->data, sizeof(void *) * v->size);
-		if (!buffer) return 0; // not enough memory; operation canceled
 		v->data = buffer;
 	}
 	return (v->data[v->length++] = value);
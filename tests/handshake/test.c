@@ -0,0 +1,85 @@
+// TLS handshakes per second against the HTTPS listener on loopback.
+// gcc -O2 test.c -o test -lgnutls && ./test [count] [resume]
+// With resume, every connection after the first one resumes the session of the first connection.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gnutls/gnutls.h>
+
+#define PORT_HTTPS 8443
+
+#define REQUEST "GET /article/Latest_plane_crash HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+
+int main(int argc, char *argv[])
+{
+	unsigned count = ((argc > 1) ? strtol(argv[1], 0, 10) : 1000), index;
+	int resume = ((argc > 2) && !strcmp(argv[2], "resume"));
+	unsigned resumed = 0;
+	gnutls_datum_t state = {0, 0};
+	gnutls_certificate_credentials_t x509;
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(PORT_HTTPS)};
+	struct timespec start, end;
+
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	gnutls_global_init();
+	gnutls_certificate_allocate_credentials(&x509);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(index = 0; index < count; ++index)
+	{
+		gnutls_session_t session;
+		int fd, status;
+
+		fd = socket(PF_INET, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *)&address, sizeof(address)))
+		{
+			perror("connect");
+			return 1;
+		}
+
+		gnutls_init(&session, GNUTLS_CLIENT);
+		gnutls_set_default_priority(session);
+		gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, x509);
+		gnutls_transport_set_int(session, fd);
+		if (state.data) gnutls_session_set_data(session, state.data, state.size);
+
+		// The certificate is not verified. Only the handshake cost is measured.
+		while ((status = gnutls_handshake(session)) < 0)
+			if (gnutls_error_is_fatal(status))
+			{
+				fprintf(stderr, "handshake: %s\n", gnutls_strerror(status));
+				return 1;
+			}
+
+		if (gnutls_session_is_resumed(session)) resumed += 1;
+		else if (resume && !state.data)
+		{
+			// TLS 1.3 tickets arrive after the handshake so a response must be received before the session state is complete.
+			char buffer[4096];
+			gnutls_record_send(session, REQUEST, sizeof(REQUEST) - 1);
+			gnutls_record_recv(session, buffer, sizeof(buffer));
+			gnutls_session_get_data2(session, &state);
+		}
+
+		gnutls_bye(session, GNUTLS_SHUT_WR);
+		gnutls_deinit(session);
+		close(fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%u handshakes (%u resumed) in %.2f secs: %.1f handshakes/sec\n", count, resumed, elapsed, count / elapsed);
+
+	gnutls_free(state.data);
+	gnutls_certificate_free_credentials(x509);
+	gnutls_global_deinit();
+	return 0;
+}
@@ -0,0 +1,278 @@
+// Request parser microbenchmark and corpus replay.
+// Each request goes through http_parse() and http_parse_uri() the way the server handles it.
+// Reports nanoseconds per request, bytes per cycle and heap allocations per request.
+// The parser reads from memory through the stream functions below instead of from a socket.
+//  ./bench.sh [iterations] [capture...]
+// builds the benchmark for each variant of the parser (scalar, SSE2, AVX2) and runs it. To build a single variant:
+//  gcc -std=c99 -O2 -D_DEFAULT_SOURCE -I../../APIServer bench.c ../../APIServer/{http_parse,http,json,dictionary,vector,arena,format}.c -o bench && ./bench [iterations] [capture...]
+// A capture is a file with the requests received on a connection, one after the other (as in ./capture).
+// Request bodies in a capture are skipped according to Content-Length.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "base.h"
+#include "format.h"
+#include "json.h"
+#include "stream.h"
+#include "http.h"
+#include "http_parse.h"
+
+#define QUERY_SIZES 3
+
+static const char *requests[][2] = {
+	{"curl", "GET /article/Latest_plane_crash HTTP/1.1\r\nUser-Agent: curl/7.88.1\r\nHost: 127.0.0.1:8080\r\nAccept: */*\r\n\r\n"},
+	{"browser",
+		"GET /article/Latest_plane_crash HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"Cache-Control: max-age=0\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+		"Sec-Fetch-Site: none\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Accept-Language: en-US,en;q=0.9,bg;q=0.8\r\n"
+		"\r\n"},
+	{"cookie",
+		"GET /?%7B%22actions%22%3A%7B%22example.hello_world%22%3A%7B%7D%7D%7D HTTP/1.1\r\n"
+		"Host: api.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Mobile/15E148 Safari/604.1\r\n"
+		"Accept: application/json\r\n"
+		"Origin: https://www.example.com\r\n"
+		"Referer: https://www.example.com/articles/2023/10/18/latest-plane-crash-investigation-update?utm_source=newsletter&utm_medium=email&utm_campaign=daily\r\n"
+		"Cookie: session=3f0a9c1e7b2d4e6f8a0b1c2d3e4f5a6b7c8d9e0f1a2b3c4d5e6f7a8b9c0d1e2f; _ga=GA1.2.1234567890.1697600000; _gid=GA1.2.0987654321.1697600000; preferences=%7B%22theme%22%3A%22dark%22%2C%22lang%22%3A%22en%22%7D; consent=necessary%2Canalytics%2Cmarketing; csrftoken=Zm9vYmFyYmF6cXV4cXV1eGNvcmdlZ3JhdWx0Z2FycGx5d2FsZG8\r\n"
+		"\r\n"},
+};
+
+// Every allocation made while parsing goes through these (they replace the allocator functions of glibc).
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *memory, size_t size);
+static unsigned long allocations;
+void *malloc(size_t size)
+{
+	allocations += 1;
+	return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size)
+{
+	allocations += 1;
+	return __libc_calloc(count, size);
+}
+void *(realloc)(void *memory, size_t size)
+{
+	allocations += 1;
+	return __libc_realloc(memory, size);
+}
+
+// Timestamp counter. It runs at a constant rate which is usually the nominal frequency of the CPU.
+static unsigned long long cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// Memory-backed stream. Everything in memory arrives with the first read.
+int stream_read(struct stream *restrict stream, struct string *restrict buffer, size_t length)
+{
+	if (length > (stream->_input_length - stream->_input_index)) stream->_input_length = stream->_input_size;
+	if (length > (stream->_input_length - stream->_input_index)) return ERROR_AGAIN;
+	buffer->data = stream->_input + stream->_input_index;
+	buffer->length = stream->_input_length - stream->_input_index;
+	return 0;
+}
+void stream_read_flush(struct stream *restrict stream, size_t length)
+{
+	stream->_input_index += length;
+}
+void stream_read_pin(struct stream *restrict stream, size_t length)
+{
+	stream->_input_index += length;
+}
+
+// Generates a request with an encoded JSON query of about the specified size.
+static char *request_query(size_t size)
+{
+	struct string *encoded = 0;
+	char *json = 0, *request;
+	size_t items, length;
+
+	for(items = size / 64; ; items += 1 + items / 16)
+	{
+		free(json);
+		free(encoded);
+
+		json = malloc(128 + items * 48);
+		if (!json) return 0;
+		length = sprintf(json, "{\"actions\":{\"article.get_version\":{\"name\":\"Latest_plane_crash\",\"items\":[");
+		for(size_t item = 0; item < items; ++item)
+			length += sprintf(json + length, "%s{\"id\":%zu,\"tag\":\"r\u00e9sum\u00e9 %zu\"}", (item ? "," : ""), item, item);
+		length += sprintf(json + length, "]}}}");
+
+		encoded = uri_encode(json, length);
+		if (!encoded) return 0;
+		if (encoded->length >= size) break;
+	}
+	free(json);
+
+	request = malloc(encoded->length + 256);
+	if (request) sprintf(request, "GET /?%.*s HTTP/1.1\r\nHost: api.example.com\r\nUser-Agent: curl/7.88.1\r\nAccept: application/json\r\n\r\n", (int)encoded->length, encoded->data);
+	free(encoded);
+	return request;
+}
+
+static char *capture_load(const char *filename, size_t *restrict length)
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file) return 0;
+
+	char *data = 0;
+	if (!fseek(file, 0, SEEK_END) && ((*length = ftell(file)) > 0) && !fseek(file, 0, SEEK_SET))
+	{
+		data = malloc(*length);
+		if (data && (fread(data, 1, *length, file) != *length))
+		{
+			free(data);
+			data = 0;
+		}
+	}
+
+	fclose(file);
+	return data;
+}
+
+// Parses all requests in data. Returns the number of requests or 0 on error.
+static size_t replay(const char *name, char *data, size_t length)
+{
+	struct http_context context;
+	struct stream stream;
+	size_t count = 0;
+	int status;
+
+	stream._input = data;
+	stream._input_size = length;
+	stream._input_index = 0;
+	stream._input_length = 0;
+
+	while (stream._input_index < length)
+	{
+		size_t start = stream._input_index;
+
+		if (!http_parse_init(&context)) return 0;
+		if ((status = http_parse(&context, &stream)) || (status = http_parse_uri(&context.request)))
+		{
+			fprintf(stderr, "%s: error %d in request at offset %zu\n", name, status, start);
+			return 0;
+		}
+
+		// Skip the request body.
+		struct string *content_length = context.request.headers_known[HEADER_CONTENT_LENGTH];
+		if (content_length)
+		{
+			size_t body = strtoul(content_length->data, 0, 10);
+			if (body > (length - stream._input_index))
+			{
+				fprintf(stderr, "%s: body of request at offset %zu is truncated\n", name, start);
+				return 0;
+			}
+			stream._input_index += body;
+		}
+
+		http_parse_term(&context);
+		count += 1;
+	}
+
+	return count;
+}
+
+static int bench(const char *name, const char *input, size_t length, unsigned iterations)
+{
+	struct timespec start, end;
+	unsigned long long start_cycles, end_cycles;
+	unsigned long allocations_start;
+	size_t count = 0;
+	unsigned index;
+
+	// The parser modifies the buffer (header names are converted to lower case). Restore it for each iteration.
+	char *buffer = malloc(length);
+	if (!buffer) return ERROR_MEMORY;
+
+	allocations_start = allocations;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_cycles = cycles();
+	for(index = 0; index < iterations; ++index)
+	{
+		memcpy(buffer, input, length);
+		if (!(count = replay(name, buffer, length))) return ERROR_INPUT;
+	}
+	end_cycles = cycles();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	double requests = (double)count * iterations;
+	printf("%-10s %3zu x %5.0f bytes %8.1f ns/request %6.2f bytes/cycle %5.2f allocations/request\n",
+		name, count, (double)length / count, elapsed / requests,
+		(end_cycles > start_cycles) ? (double)length * iterations / (end_cycles - start_cycles) : 0,
+		(allocations - allocations_start) / requests);
+
+	free(buffer);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[QUERY_SIZES] = {1024, 4096, 12288};
+	unsigned iterations = ((argc > 1) ? strtol(argv[1], 0, 10) : 1000000);
+	char name[32], *input;
+	size_t index, length;
+	int status;
+
+#if defined(__AVX2__)
+	printf("variant: AVX2\n");
+#elif defined(__SSE2__)
+	printf("variant: SSE2\n");
+#else
+	printf("variant: scalar\n");
+#endif
+
+	for(index = 0; index < sizeof(requests) / sizeof(*requests); ++index)
+		if (status = bench(requests[index][0], requests[index][1], strlen(requests[index][1]), iterations))
+			return 1;
+
+	// Long queries take longer so run them fewer times.
+	for(index = 0; index < QUERY_SIZES; ++index)
+	{
+		if (!(input = request_query(sizes[index]))) return 1;
+		sprintf(name, "query-%zuk", sizes[index] / 1024);
+		status = bench(name, input, strlen(input), (iterations * 64) / sizes[index] + 1);
+		free(input);
+		if (status) return 1;
+	}
+
+	for(index = 2; index < argc; ++index)
+	{
+		if (!(input = capture_load(argv[index], &length)))
+		{
+			fprintf(stderr, "%s: cannot load capture\n", argv[index]);
+			return 1;
+		}
+		status = bench(argv[index], input, length, iterations);
+		free(input);
+		if (status) return 1;
+	}
+
+	return 0;
+}
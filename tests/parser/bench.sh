@@ -0,0 +1,12 @@
+#!/bin/sh
+# Builds the parser benchmark for each variant of the parser and runs it.
+# ./bench.sh [iterations] [capture...]
+
+cd "$(dirname "$0")"
+SOURCE=../../APIServer
+
+for variant in scalar:-U__SSE2__ SSE2: AVX2:-mavx2
+do
+	gcc -std=c99 -O2 -D_DEFAULT_SOURCE ${variant#*:} -I$SOURCE bench.c $SOURCE/http_parse.c $SOURCE/http.c $SOURCE/json.c $SOURCE/dictionary.c $SOURCE/vector.c $SOURCE/arena.c $SOURCE/format.c -o bench-${variant%%:*} || exit 1
+	./bench-${variant%%:*} "$@" || exit 1
+done
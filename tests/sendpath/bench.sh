@@ -0,0 +1,32 @@
+#!/bin/sh
+# Measures small JSON responses and a multi-MB article body together with the system calls of the server.
+# Start the server first. ./bench.sh [count]
+# The write and read system calls of the server are taken from /proc/<pid>/io (syscw and syscr).
+
+cd "$(dirname "$0")"
+COUNT=${1:-200}
+SIZE_MB=${SIZE_MB:-8}
+PID=$(pidof server) || { echo "server is not running"; exit 1; }
+
+gcc -O2 test.c -o test || exit 1
+
+# Publish a large version of the article so that GET returns multi-MB body.
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom | curl -s --data-binary @- http://127.0.0.1:8080/article/Latest_plane_crash > /dev/null
+
+syscalls()
+{
+	awk '/^syscw/ {w = $2} /^syscr/ {r = $2} END {print w, r}' /proc/$PID/io
+}
+
+run()
+{
+	set -- "$1" "$2" $(syscalls)
+	./test "$1" "$2" || exit 1
+	set -- "$@" $(syscalls)
+	echo "$2 $3 $4 $5 $6" | awk '{printf " %.1f writes and %.1f reads per response\n", ($4 - $2) / $1, ($5 - $3) / $1}'
+}
+
+echo " small JSON (example.hello_world)"
+run '/?%7B%22actions%22%3A%7B%22example.hello_world%22%3A%7B%7D%7D%7D' $COUNT
+echo " article $SIZE_MB MiB"
+run /article/Latest_plane_crash $((COUNT / 10))
@@ -0,0 +1,102 @@
+// Time to first byte and throughput of HTTP responses.
+// gcc -O2 test.c -o test && ./test path [count]
+// The requests are sent one after another on a single connection.
+// The segment size is limited as on ethernet. Otherwise loopback would carry whole responses in a single segment.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT_HTTP 8080
+
+#define SEGMENT_SIZE 1448
+
+#define BUFFER_SIZE 65536
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(PORT_HTTP)};
+	static char buffer[BUFFER_SIZE];
+	char request[1024];
+	int request_length, fd, segment = SEGMENT_SIZE;
+	unsigned count, index;
+	double first = 0, complete = 0;
+	size_t total = 0;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s path [count]\n", argv[0]);
+		return 1;
+	}
+	count = ((argc > 2) ? atoi(argv[2]) : 100);
+
+	request_length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", argv[1]);
+	inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &segment, sizeof(segment));
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)))
+	{
+		perror("connect");
+		return 1;
+	}
+
+	for(index = 0; index < count; ++index)
+	{
+		struct timespec start, now;
+		size_t received = 0, length = 0, header = 0;
+		ssize_t size;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (write(fd, request, request_length) != request_length) return 1;
+
+		// The responses have Content-Length.
+		while (!header || (received < header + length))
+		{
+			size = read(fd, buffer + (header ? 0 : received), (header ? sizeof(buffer) : sizeof(buffer) - 1 - received));
+			if (size <= 0)
+			{
+				fprintf(stderr, "connection closed\n");
+				return 1;
+			}
+			if (!received)
+			{
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				first += elapsed(&start, &now);
+			}
+			received += size;
+
+			if (!header)
+			{
+				char *end, *field;
+				buffer[received] = 0;
+				if (!(end = strstr(buffer, "\r\n\r\n"))) continue;
+				header = end + 4 - buffer;
+				if (!(field = strstr(buffer, "Content-Length: ")) || (field > end))
+				{
+					fprintf(stderr, "no Content-Length\n");
+					return 1;
+				}
+				length = strtoul(field + sizeof("Content-Length: ") - 1, 0, 10);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		complete += elapsed(&start, &now);
+		total = received;
+	}
+	close(fd);
+
+	printf("%u responses of %zu bytes: first byte %.1f us, complete %.1f us, %.1f MB/s\n", count, total, first * 1e6 / count, complete * 1e6 / count, (double)total * count / complete / 1e6);
+	return 0;
+}
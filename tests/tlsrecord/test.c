@@ -0,0 +1,126 @@
+// Time to first byte and throughput of HTTPS responses.
+// gcc -O2 test.c -o test -lgnutls && ./test path [count]
+// Each request is sent on a new connection. The handshake is not measured.
+// The segment size is limited as on ethernet. Otherwise loopback would carry whole responses in a single segment.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gnutls/gnutls.h>
+
+#define PORT_HTTPS 8443
+
+#define SEGMENT_SIZE 1448
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	gnutls_certificate_credentials_t x509;
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(PORT_HTTPS)};
+	struct timespec start, first, end;
+	double first_total = 0, transfer_total = 0;
+	unsigned long long bytes = 0;
+	char request[1024], buffer[65536];
+	unsigned count, index;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s path [count]\n", argv[0]);
+		return 1;
+	}
+	count = ((argc > 2) ? strtol(argv[2], 0, 10) : 100);
+	snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", argv[1]);
+
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	gnutls_global_init();
+	gnutls_certificate_allocate_credentials(&x509);
+
+	for(index = 0; index < count; ++index)
+	{
+		gnutls_session_t session;
+		size_t length = 0, header = 0, total = 0;
+		ssize_t size;
+		int fd, status;
+
+		fd = socket(PF_INET, SOCK_STREAM, 0);
+		status = SEGMENT_SIZE;
+		setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &status, sizeof(status));
+		status = 1; // as browsers do; otherwise the request may wait for the acknowledgement of the handshake
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &status, sizeof(status));
+		if (connect(fd, (struct sockaddr *)&address, sizeof(address)))
+		{
+			perror("connect");
+			return 1;
+		}
+
+		gnutls_init(&session, GNUTLS_CLIENT);
+		gnutls_set_default_priority(session);
+		gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, x509);
+		gnutls_transport_set_int(session, fd);
+
+		while ((status = gnutls_handshake(session)) < 0)
+			if (gnutls_error_is_fatal(status))
+			{
+				fprintf(stderr, "handshake: %s\n", gnutls_strerror(status));
+				return 1;
+			}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		gnutls_record_send(session, request, strlen(request));
+
+		// Receive the response. Its length is determined by Content-Length.
+		while (!total || (length < total))
+		{
+			size = gnutls_record_recv(session, buffer + (header ? 0 : length), sizeof(buffer) - (header ? 0 : length) - 1);
+			if ((size == GNUTLS_E_AGAIN) || (size == GNUTLS_E_INTERRUPTED)) continue; // post-handshake message was processed
+			if (size <= 0)
+			{
+				fprintf(stderr, "receive: %s\n", gnutls_strerror(size));
+				return 1;
+			}
+			if (!length) clock_gettime(CLOCK_MONOTONIC, &first);
+			length += size;
+
+			if (!header)
+			{
+				char *end, *field;
+				buffer[length] = 0;
+				if (!(end = strstr(buffer, "\r\n\r\n"))) continue;
+				header = end + 4 - buffer;
+				if (!(field = strstr(buffer, "Content-Length: ")) || (field > end))
+				{
+					fprintf(stderr, "no Content-Length\n");
+					return 1;
+				}
+				total = header + strtoll(field + sizeof("Content-Length: ") - 1, 0, 10);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		first_total += elapsed(&start, &first);
+		transfer_total += elapsed(&start, &end);
+		bytes += length;
+
+		gnutls_bye(session, GNUTLS_SHUT_WR);
+		gnutls_deinit(session);
+		close(fd);
+	}
+
+	printf("%u responses of %llu bytes: first byte %.1f us, complete %.1f us, %.1f MB/s\n", count, bytes / count, first_total / count * 1e6, transfer_total / count * 1e6, bytes / transfer_total / 1e6);
+
+	gnutls_certificate_free_credentials(x509);
+	gnutls_global_deinit();
+	return 0;
+}
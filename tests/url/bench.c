@@ -0,0 +1,200 @@
+// URL codec microbenchmark. Reports the time to decode and to encode URL-encoded JSON queries of 1 to 16 KiB.
+// Compares url_decode(), url_decode_text() and uri_encode() with the scalar implementation they replaced and checks that the results match.
+//  ./bench.sh [iterations]
+// builds the benchmark for each variant (scalar, SSE2, SSSE3, AVX2) and runs it. To build a single variant:
+//  gcc -std=c99 -O2 -D_DEFAULT_SOURCE -I../../APIServer bench.c ../../APIServer/{http,format}.c -o bench && ./bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "base.h"
+#include "format.h"
+#include "http.h"
+
+#define SIZES 5
+#define REPEAT 5
+
+// The scalar implementation before vectorization (with its out of bounds read for a truncated escape fixed).
+
+static const unsigned char hex2int[256] = {
+	['0'] = 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+	['A'] = 11, 12, 13, 14, 15, 16,
+	['a'] = 11, 12, 13, 14, 15, 16,
+}; // value + 1 (0 = invalid)
+
+static size_t reference_decode(const char *src, char *restrict dest, size_t length)
+{
+	size_t s, d;
+	unsigned char high, low;
+
+	for(s = 0, d = 0; s < length; ++s, ++d)
+	{
+		if (src[s] == '%')
+		{
+			if ((length - s) < 3) return 0;
+
+			high = hex2int[(unsigned char)src[s + 1]];
+			if (!high) return 0;
+			low = hex2int[(unsigned char)src[s + 2]];
+			if (!low) return 0;
+
+			dest[d] = ((high - 1) << 4) | (low - 1);
+			s += 2;
+		}
+		else dest[d] = src[s];
+	}
+
+	return d;
+}
+
+static inline bool allowed(unsigned char character)
+{
+	static const unsigned char table[32] = "\x00\x00\x00\x00\xc2\xe7\xff\xa3\xfe\xff\xff\x87\xfe\xff\xff\x47\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+	return (table[character >> 3] & (1 << (character & 0x7)));
+}
+
+static struct string *reference_encode(const char *restrict source, size_t size)
+{
+	size_t index;
+
+	size_t length = size;
+	for(index = 0; index < size; ++index)
+		if (!allowed(source[index]))
+			length += 2;
+
+	struct string *encoded = malloc(sizeof(struct string) + length + 1);
+	if (!encoded) return 0;
+	encoded->data = (char *)(encoded + 1);
+	encoded->length = length;
+
+	length = 0;
+	for(index = 0; index < size; ++index)
+	{
+		if (allowed(source[index])) encoded->data[length++] = source[index];
+		else
+		{
+			encoded->data[length++] = '%';
+			format_hex(encoded->data + length, source + index, 1);
+			length += 2;
+		}
+	}
+	encoded->data[length] = 0;
+
+	return encoded;
+}
+
+// Generates JSON query for an action with about the specified size.
+static size_t query_json(char *restrict json, size_t size)
+{
+	size_t length = sprintf(json, "{\"actions\":{\"article.get_version\":{\"name\":\"Latest_plane_crash\",\"items\":[");
+	size_t item;
+	for(item = 0; (length + 64) < size; ++item)
+		length += sprintf(json + length, "%s{\"id\":%zu,\"tag\":\"r\xc3\xa9sum\xc3\xa9 %zu\",\"path\":\"/a/b?c=d&e\"}", (item ? "," : ""), item, item);
+	length += sprintf(json + length, "]}}}");
+	return length;
+}
+
+static double now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[SIZES] = {1024, 2048, 4096, 8192, 16384};
+	unsigned iterations = ((argc > 1) ? strtol(argv[1], 0, 10) : 20000), count, index, repeat;
+	size_t size, length, decoded;
+	double start, elapsed, best;
+	struct string *encoded, *expected;
+	char *json, *buffer;
+
+#if defined(__AVX2__)
+	printf("variant: AVX2\n");
+#elif defined(__SSSE3__)
+	printf("variant: SSSE3\n");
+#elif defined(__SSE2__)
+	printf("variant: SSE2\n");
+#else
+	printf("variant: scalar\n");
+#endif
+	printf("%7s %12s %12s %12s %12s %12s\n", "encoded", "decode/old", "decode", "decode_text", "encode/old", "encode");
+
+	for(size = 0; size < SIZES; ++size)
+	{
+		json = malloc(sizes[size] / 2);
+		buffer = malloc(sizes[size]);
+		if (!json || !buffer) return 1;
+		length = query_json(json, sizes[size] / 2);
+
+		encoded = uri_encode(json, length);
+		expected = reference_encode(json, length);
+		if (!encoded || !expected) return 1;
+		if ((encoded->length != expected->length) || memcmp(encoded->data, expected->data, encoded->length + 1))
+		{
+			fprintf(stderr, "%zu: uri_encode() mismatch\n", sizes[size]);
+			return 1;
+		}
+		if (((decoded = url_decode(encoded->data, buffer, encoded->length)) != length) || memcmp(buffer, json, length) ||
+			((decoded = url_decode_text(encoded->data, buffer, encoded->length)) != length) || memcmp(buffer, json, length))
+		{
+			fprintf(stderr, "%zu: url_decode() mismatch\n", sizes[size]);
+			return 1;
+		}
+		free(expected);
+
+		count = (iterations * 1024) / encoded->length + 1;
+		printf("%7zu", encoded->length);
+
+		// Report ns per encoded KiB (best of REPEAT runs).
+		#define BENCH(call) do \
+			{ \
+				for(repeat = 0, best = 0; repeat < REPEAT; ++repeat) \
+				{ \
+					start = now(); \
+					for(index = 0; index < count; ++index) \
+						call; \
+					elapsed = now() - start; \
+					if (!best || (elapsed < best)) best = elapsed; \
+				} \
+				printf(" %12.1f", best / count * 1024 / encoded->length); \
+			} while (0)
+
+		BENCH(reference_decode(encoded->data, buffer, encoded->length));
+		BENCH(url_decode(encoded->data, buffer, encoded->length));
+		BENCH(url_decode_text(encoded->data, buffer, encoded->length));
+		BENCH(free(reference_encode(json, length)));
+		BENCH(free(uri_encode(json, length)));
+		printf("  ns/KiB\n");
+
+		#undef BENCH
+
+		free(encoded);
+		free(buffer);
+		free(json);
+	}
+
+	// Invalid input
+	static const char *invalid[] = {"%", "a%4", "%4g", "%g4", "abcdefghijklmnopqrstuvwxyz0123456789%"};
+	for(index = 0; index < sizeof(invalid) / sizeof(*invalid); ++index)
+	{
+		char output[64];
+		if (url_decode(invalid[index], output, strlen(invalid[index])))
+		{
+			fprintf(stderr, "%s: invalid input decoded\n", invalid[index]);
+			return 1;
+		}
+	}
+	if (url_decode_text("a%00b", buffer = malloc(5), 5) || !url_decode("a%00b", buffer, 5) || !url_decode_text("a%0Ab", buffer, 5))
+	{
+		fprintf(stderr, "url_decode_text() control character check failed\n");
+		return 1;
+	}
+	free(buffer);
+
+	return 0;
+}
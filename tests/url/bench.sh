@@ -0,0 +1,12 @@
+#!/bin/sh
+# Builds the URL codec benchmark for each variant and runs it.
+# ./bench.sh [iterations]
+
+cd "$(dirname "$0")"
+SOURCE=../../APIServer
+
+for variant in scalar:-U__SSE2__ SSE2: SSSE3:-mssse3 AVX2:-mavx2
+do
+	gcc -std=c99 -O2 -D_DEFAULT_SOURCE ${variant#*:} -I$SOURCE bench.c $SOURCE/http.c $SOURCE/format.c -o bench-${variant%%:*} || exit 1
+	./bench-${variant%%:*} "$@" || exit 1
+done